@@ -0,0 +1,788 @@
+#include "pch.h"
+
+#include "interpreter.h"
+#include "mapped_file.h"
+#include "matrix.h"
+#include "sparse.h"
+#include "thread_pool.h"
+#include "tokenizer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <random>
+
+// sh-bench: a timing suite for the matrix kernels and the interpreter's dispatch loop. Each case is timed in batches
+// until --min-time has passed; the fastest batch sets the reported rate, and the median batch shows the spread.
+// Results go to stdout as JSON or CSV, so two runs can be diffed; progress goes to stderr.
+//
+// Usage: sh-bench [--format json|csv] [--filter text] [--min-time seconds]
+
+struct Result
+{
+    std::string name;
+    std::string args;
+    uint64_t iterations;
+    double min_ns;
+    double median_ns;
+    // Work per second at min_ns, in `unit`.
+    double rate;
+    const char* unit;
+};
+
+struct Bench
+{
+    using Clock = std::chrono::steady_clock;
+
+    Bench(std::string filter, double min_time) : m_filter(std::move(filter)), m_min_time(min_time) {}
+
+    bool wants(std::string_view name) const { return m_filter.empty() || name.find(m_filter) != name.npos; }
+
+    // Times `f`, which does `work` units of work per call.
+    template<typename F>
+    void run(std::string_view name, std::string args, double work, const char* unit, F&& f)
+    {
+        if (!wants(name)) return;
+
+        auto start = Clock::now();
+        f();
+        double first = seconds(Clock::now() - start);
+        // Batches of about a twentieth of the time budget keep clock overhead out of short cases.
+        uint64_t batch = std::max<uint64_t>(1, (uint64_t)(m_min_time / 20 / std::max(first, 1e-9)));
+
+        std::vector<double> samples;
+        uint64_t iterations = 0;
+        double total = 0;
+        while ((total < m_min_time || samples.size() < MIN_SAMPLES) && samples.size() < MAX_SAMPLES)
+        {
+            start = Clock::now();
+            for (uint64_t i = 0; i < batch; ++i)
+                f();
+            double t = seconds(Clock::now() - start);
+            samples.push_back(t * 1e9 / batch);
+            iterations += batch;
+            total += t;
+        }
+        std::sort(samples.begin(), samples.end());
+
+        Result r = {std::string(name),
+                    std::move(args),
+                    iterations,
+                    samples.front(),
+                    samples[samples.size() / 2],
+                    work / (samples.front() * 1e-9),
+                    unit};
+        fmt::fprintf(stderr, "%-24s %-24s %12.1f ns %10.3f %s\n", r.name, r.args, r.min_ns, r.rate, r.unit);
+        m_results.push_back(std::move(r));
+    }
+
+    const std::vector<Result>& results() const { return m_results; }
+
+private:
+    static constexpr size_t MIN_SAMPLES = 5;
+    static constexpr size_t MAX_SAMPLES = 1000;
+
+    static double seconds(Clock::duration d) { return std::chrono::duration<double>(d).count(); }
+
+    std::string m_filter;
+    double m_min_time;
+    std::vector<Result> m_results;
+};
+
+// Written after each call so the optimizer cannot drop work whose result is otherwise unused.
+static volatile double g_sink;
+
+static void consume(double d) { g_sink = d; }
+static void consume(const MatrixData& m) { g_sink = (double)m.size(); }
+
+static MatrixData random_matrix(MatrixExtents extents, unsigned seed)
+{
+    MatrixData m(std::move(extents));
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> dist(-1.0, 1.0);
+    auto p = m.mutable_data();
+    for (size_t i = 0; i < m.size(); ++i)
+        p[i] = dist(rng);
+    return m;
+}
+
+static MatrixData random_vector(size_t n, unsigned seed) { return random_matrix({(int)n}, seed); }
+
+static MatrixData to_f32(const MatrixData& m) { return m.contiguous(ElementType::F32); }
+
+static constexpr double GB = 1e9;
+
+static void bench_gemm(Bench& b, ThreadPool& pool)
+{
+    // m x k times k x n.
+    struct Shape
+    {
+        int m, n, k;
+    };
+    for (auto s : {Shape{16, 16, 16},
+                   Shape{64, 64, 64},
+                   Shape{256, 256, 256},
+                   Shape{512, 512, 512},
+                   Shape{1024, 1024, 64},
+                   Shape{64, 64, 4096},
+                   Shape{4096, 16, 256}})
+    {
+        auto args = fmt::format("{}x{}x{}", s.m, s.n, s.k);
+        double flops = 2.0 * s.m * s.n * s.k / GB;
+        if (b.wants("multiply_matrix") || b.wants("inner_product"))
+        {
+            auto left = random_matrix({s.k, s.m}, 1);
+            auto right = random_matrix({s.k, s.n}, 2);
+            b.run("multiply_matrix", args, flops, "GFLOP/s", [&]() { consume(multiply_matrix(left, right, s.k)); });
+
+            // inner_product contracts the middle axis: m1 is m x k x 1 and m2 is n x k x 1.
+            b.run("inner_product", args, flops, "GFLOP/s", [&]() {
+                consume(inner_product(left, right, s.k, 1, 1));
+            });
+            b.run("inner_product/pool", args, flops, "GFLOP/s", [&]() {
+                consume(inner_product(left, right, s.k, 1, 1, &pool));
+            });
+
+            auto left32 = to_f32(left);
+            auto right32 = to_f32(right);
+            b.run("multiply_matrix/f32", args, flops, "GFLOP/s", [&]() {
+                consume(multiply_matrix(left32, right32, s.k));
+            });
+            b.run("inner_product/f32", args, flops, "GFLOP/s", [&]() {
+                consume(inner_product(left32, right32, s.k, 1, 1));
+            });
+        }
+    }
+}
+
+static void bench_elementwise(Bench& b)
+{
+    for (size_t n : {size_t(1000), size_t(1) << 20, size_t(1) << 24})
+    {
+        auto args = fmt::format("{}", n);
+        double bytes = 3.0 * n * sizeof(double) / GB;
+        if (!b.wants("multiply") && !b.wants("divide") && !b.wants("dot") && !b.wants("bayes_rule")) continue;
+
+        auto m = random_vector(n, 1);
+        auto v = random_vector(n, 2);
+        b.run("multiply", args, bytes, "GB/s", [&]() { consume(multiply(m, v)); });
+        b.run("divide", args, bytes, "GB/s", [&]() { consume(divide(m, v)); });
+
+        // Dividing by ones keeps the values stable while the result is written back over the same buffer.
+        MatrixData ones(n, 1.0);
+        auto inplace = m.copy();
+        b.run("multiply/in-place", args, bytes, "GB/s", [&]() { inplace = multiply(std::move(inplace), ones); });
+        b.run("divide/in-place", args, bytes, "GB/s", [&]() { inplace = divide(std::move(inplace), ones); });
+
+        // Rows of 8 against an 8-element vector, and rows of n / 1024 against a vector of that length.
+        for (size_t cols : {size_t(8), std::max<size_t>(n / 1024, 1)})
+        {
+            auto vec = random_vector(cols, 3);
+            b.run("dot", fmt::format("{}x{}", n / cols, cols), 2.0 * n / GB, "GFLOP/s", [&]() {
+                consume(dot(m, vec));
+            });
+        }
+
+        // src viewed as rows x 1024 (or fewer columns for small n), with div the length of one row.
+        size_t cols = std::min<size_t>(n, 1024);
+        auto mult = random_vector(cols, 4);
+        auto div = random_vector(cols, 5);
+        b.run("bayes_rule", fmt::format("{}x{}", n / cols, cols), 2.0 * n * sizeof(double) / GB, "GB/s", [&]() {
+            consume(bayes_rule(m, mult, div));
+        });
+
+        // The same in float32, which moves half the bytes.
+        auto m32 = to_f32(m);
+        auto v32 = to_f32(v);
+        b.run("multiply/f32", args, bytes / 2, "GB/s", [&]() { consume(multiply(m32, v32)); });
+        b.run("divide/f32", args, bytes / 2, "GB/s", [&]() { consume(divide(m32, v32)); });
+        auto vec32 = to_f32(random_vector(8, 3));
+        b.run("dot/f32", fmt::format("{}x{}", n / 8, 8), 2.0 * n / GB, "GFLOP/s", [&]() { consume(dot(m32, vec32)); });
+        auto mult32 = to_f32(mult);
+        auto div32 = to_f32(div);
+        b.run("bayes_rule/f32", fmt::format("{}x{}", n / cols, cols), n * sizeof(double) / GB, "GB/s", [&]() {
+            consume(bayes_rule(m32, mult32, div32));
+        });
+    }
+}
+
+static void bench_transpose(Bench& b, ThreadPool& pool)
+{
+    // rows x cols, stored row-major. Square shapes, then tall-skinny and short-wide ones, where one tile edge is short
+    // and the strided side of the copy dominates.
+    struct Shape
+    {
+        size_t rows, cols;
+    };
+    for (auto s : {Shape{256, 256},
+                   Shape{1024, 1024},
+                   Shape{4096, 4096},
+                   Shape{262144, 64},
+                   Shape{64, 262144},
+                   Shape{1048576, 8}})
+    {
+        auto args = fmt::format("{}x{}", s.rows, s.cols);
+        size_t n = s.rows * s.cols;
+        double bytes = 2.0 * n * sizeof(double) / GB;
+        if (!b.wants("transpose") && !b.wants("memcpy")) continue;
+
+        auto src = random_matrix({(int)s.cols, (int)s.rows}, 1);
+        MatrixData dst(n);
+        b.run("memcpy", args, bytes, "GB/s", [&]() {
+            std::memcpy(dst.mutable_data(), src.data(), n * sizeof(double));
+            consume(dst.data()[0]);
+        });
+        b.run("transpose_copy", args, bytes, "GB/s", [&]() {
+            transpose_copy(src.data(), s.cols, dst.mutable_data(), s.rows, s.rows, s.cols);
+            consume(dst.data()[0]);
+        });
+        b.run("transpose_copy/pool", args, bytes, "GB/s", [&]() {
+            transpose_copy(src.data(), s.cols, dst.mutable_data(), s.rows, s.rows, s.cols, &pool);
+            consume(dst.data()[0]);
+        });
+        auto src32 = to_f32(src);
+        MatrixData dst32({(int)n}, ElementType::F32);
+        b.run("transpose_copy/f32", args, bytes / 2, "GB/s", [&]() {
+            transpose_copy(src32.data_as<float>(), s.cols, dst32.mutable_data_as<float>(), s.rows, s.rows, s.cols);
+            consume(dst32.data_as<float>()[0]);
+        });
+        b.run("transpose_copy/f32/pool", args, bytes / 2, "GB/s", [&]() {
+            transpose_copy(
+                src32.data_as<float>(), s.cols, dst32.mutable_data_as<float>(), s.rows, s.rows, s.cols, &pool);
+            consume(dst32.data_as<float>()[0]);
+        });
+        // The views are free; copying them out runs the strided gather.
+        b.run("transpose", args, bytes, "GB/s", [&]() { consume(transpose(src, (int)s.cols).copy()); });
+        if (s.rows == s.cols && s.rows % 16 == 0)
+        {
+            b.run("transpose2", fmt::format("{}x{}x{}", s.rows / 16, 16, s.cols), bytes, "GB/s", [&]() {
+                consume(transpose2(src, (int)s.cols, 16).copy());
+            });
+        }
+    }
+}
+
+static void bench_views(Bench& b, ThreadPool& pool)
+{
+    if (!b.wants("MatrixData") && !b.wants("MatrixPool")) return;
+
+    for (size_t n : {size_t(8), size_t(1024), size_t(1) << 20})
+    {
+        auto args = fmt::format("{}", n);
+        b.run("MatrixData::MatrixData", args, 1e-6, "Mop/s", [&]() { consume(MatrixData(n)); });
+
+        size_t capacity;
+        auto& global = MatrixPool::global();
+        b.run("MatrixPool::allocate", args, 1e-6, "Mop/s", [&]() {
+            auto p = global.allocate(n, capacity);
+            global.release(p, capacity);
+        });
+    }
+
+    size_t n = 1024;
+    auto args = fmt::format("{}x{}", n, n);
+    double bytes = 2.0 * n * n * sizeof(double) / GB;
+    auto m = random_matrix({(int)n, (int)n}, 1);
+    b.run("MatrixData::clone", args, 1e-6, "Mop/s", [&]() { consume(m.clone()); });
+    b.run("MatrixData::reshape", args, 1e-6, "Mop/s", [&]() { consume(m.reshape({(int)n * 4, (int)n / 4})); });
+    b.run("MatrixData::swap_axes", args, 1e-6, "Mop/s", [&]() { consume(m.swap_axes(0, 1)); });
+    b.run("MatrixData::slice", args, 1e-6, "Mop/s", [&]() { consume(m.slice(0, 0, (int)n / 2)); });
+    b.run("MatrixData::copy", args, bytes, "GB/s", [&]() { consume(m.copy()); });
+
+    // A column slice is strided, so contiguous() has to gather it.
+    auto columns = m.slice(0, 0, (int)n / 2);
+    b.run("MatrixData::contiguous", fmt::format("{}x{} of {}", n / 2, n, args), bytes / 2, "GB/s", [&]() {
+        consume(columns.contiguous());
+    });
+    auto transposed = m.swap_axes(0, 1);
+    b.run("MatrixData::contiguous/pool", "transposed " + args, bytes, "GB/s", [&]() {
+        consume(transposed.contiguous(&pool));
+    });
+}
+
+static void bench_reductions(Bench& b)
+{
+    for (size_t n : {size_t(1000), size_t(1) << 20, size_t(1) << 24})
+    {
+        auto args = fmt::format("{}", n);
+        double bytes = (double)n * sizeof(double) / GB;
+        if (!b.wants("sum") && !b.wants("mean") && !b.wants("minimum") && !b.wants("maximum") && !b.wants("argmax") &&
+            !b.wants("norm"))
+            continue;
+
+        auto m = random_vector(n, 1);
+        b.run("sum", args, bytes, "GB/s", [&]() { consume(sum(m)); });
+        b.run("sum/compensated", args, bytes, "GB/s", [&]() { consume(sum(m, Summation::COMPENSATED)); });
+        b.run("mean", args, bytes, "GB/s", [&]() { consume(mean(m)); });
+        b.run("minimum", args, bytes, "GB/s", [&]() { consume(minimum(m)); });
+        b.run("maximum", args, bytes, "GB/s", [&]() { consume(maximum(m)); });
+        b.run("argmax", args, bytes, "GB/s", [&]() { consume((double)argmax(m)); });
+        b.run("norm", args, bytes, "GB/s", [&]() { consume(norm(m)); });
+        b.run("norm/compensated", args, bytes, "GB/s", [&]() { consume(norm(m, Summation::COMPENSATED)); });
+
+        auto m32 = to_f32(m);
+        b.run("sum/f32", args, bytes / 2, "GB/s", [&]() { consume(sum(m32)); });
+        b.run("maximum/f32", args, bytes / 2, "GB/s", [&]() { consume(maximum(m32)); });
+        b.run("norm/f32", args, bytes / 2, "GB/s", [&]() { consume(norm(m32)); });
+    }
+
+    if (!b.wants("reduce_axis")) return;
+    struct Op
+    {
+        const char* name;
+        Reduction op;
+    };
+    size_t n = 1024;
+    auto m = random_matrix({(int)n, (int)n}, 1);
+    double bytes = (double)n * n * sizeof(double) / GB;
+    for (auto op : {Op{"sum", Reduction::SUM},
+                    Op{"mean", Reduction::MEAN},
+                    Op{"min", Reduction::MIN},
+                    Op{"max", Reduction::MAX},
+                    Op{"argmax", Reduction::ARGMAX},
+                    Op{"norm", Reduction::NORM}})
+    {
+        for (int axis : {0, 1})
+        {
+            b.run("reduce_axis", fmt::format("{} axis {} of {}x{}", op.name, axis, n, n), bytes, "GB/s", [&]() {
+                consume(reduce_axis(m, op.op, axis));
+            });
+        }
+    }
+}
+
+// A dense matrix in which each element is nonzero with probability `density`.
+static MatrixData random_sparse(MatrixExtents extents, double density, unsigned seed)
+{
+    auto m = random_matrix(std::move(extents), seed);
+    std::mt19937 rng(seed + 1000);
+    std::uniform_real_distribution<double> dist(0.0, 1.0);
+    auto p = m.mutable_data();
+    for (size_t i = 0; i < m.size(); ++i)
+        if (dist(rng) >= density) p[i] = 0.0;
+    return m;
+}
+
+// Each sparse kernel against the dense one on the same matrices, across densities, to show where they cross over.
+// Rates are in dense-equivalent GFLOP/s, so the faster path at a given density has the higher rate.
+static void bench_sparse(Bench& b, ThreadPool& pool)
+{
+    if (!b.wants("sparse/dot/dense") && !b.wants("sparse/multiply_matrix/dense") &&
+        !b.wants("sparse/multiply_matrix/sparse") && !b.wants("sparse/inner_product/dense"))
+        return;
+
+    for (double density : {0.001, 0.01, 0.05, 0.1, 0.2, 0.5})
+    {
+        auto percent = fmt::format("{:g}%", density * 100);
+
+        int n = 2048;
+        auto m = random_sparse({n, n}, density, 1);
+        auto s = SparseMatrix::from_dense(m);
+        auto v = random_vector(n, 2);
+        auto args = fmt::format("{} {}x{}", percent, n, n);
+        double flops = 2.0 * n * n / GB;
+        b.run("sparse/dot", args, flops, "GFLOP/s", [&]() { consume(dot(s, v)); });
+        b.run("sparse/dot/dense", args, flops, "GFLOP/s", [&]() { consume(dot(m, v)); });
+
+        // 512 x 512 times 512 x 128.
+        int k = 512;
+        int cols = 128;
+        auto left = random_sparse({k, k}, density, 3);
+        auto left_sparse = SparseMatrix::from_dense(left);
+        auto right = random_matrix({cols, k}, 4);
+        args = fmt::format("{} {}x{}x{}", percent, k, cols, k);
+        flops = 2.0 * k * k * cols / GB;
+        b.run("sparse/multiply_matrix", args, flops, "GFLOP/s", [&]() {
+            consume(multiply_matrix(left_sparse, right, k));
+        });
+        b.run("sparse/multiply_matrix/dense", args, flops, "GFLOP/s", [&]() {
+            consume(multiply_matrix(left, right, k));
+        });
+        // Both operands at the same density, 512 x 512 times 512 x 512.
+        auto square = random_sparse({k, k}, density, 5);
+        auto square_sparse = SparseMatrix::from_dense(square);
+        args = fmt::format("{} {}x{}x{}", percent, k, k, k);
+        flops = 2.0 * k * k * k / GB;
+        b.run("sparse/multiply_matrix/sparse", args, flops, "GFLOP/s", [&]() {
+            consume((double)multiply_matrix(left_sparse, square_sparse, k).nonzeros());
+        });
+        b.run("sparse/multiply_matrix/sparse/dense", args, flops, "GFLOP/s", [&]() {
+            consume(multiply_matrix(left, square, k));
+        });
+
+        // Rows of the sparse matrix against 256 dense rows of 512, as in a similarity table.
+        int others = 256;
+        auto rows = random_matrix({k, others}, 6);
+        args = fmt::format("{} {}x{}x{}", percent, k, others, k);
+        flops = 2.0 * k * others * k / GB;
+        b.run("sparse/inner_product", args, flops, "GFLOP/s", [&]() {
+            consume(inner_product(left_sparse, rows, k, 1, 1, &pool));
+        });
+        b.run("sparse/inner_product/dense", args, flops, "GFLOP/s", [&]() {
+            consume(inner_product(left, rows, k, 1, 1, &pool));
+        });
+    }
+}
+
+static void bench_format(Bench& b)
+{
+    if (!b.wants("format_matrix")) return;
+
+    fmt::memory_buffer out;
+    for (size_t n : {size_t(1000), size_t(1) << 16})
+    {
+        auto m = random_matrix({10, (int)n / 10}, 1);
+        b.run("format_matrix", fmt::format("{} full", n), n * 1e-6, "Melem/s", [&]() {
+            out.clear();
+            format_matrix(out, m);
+            consume((double)out.size());
+        });
+    }
+    auto big = random_matrix({1000, 1000}, 1);
+    b.run("format_matrix", "1000x1000 elided", 1e-6, "Mop/s", [&]() {
+        out.clear();
+        format_matrix(out, big, 1000);
+        consume((double)out.size());
+    });
+    auto big_t = big.swap_axes(0, 1);
+    b.run("format_matrix", "1000x1000 transposed elided", 1e-6, "Mop/s", [&]() {
+        out.clear();
+        format_matrix(out, big_t, 1000);
+        consume((double)out.size());
+    });
+}
+
+// The Value layout before it became a tagged union: every value carried a scalar, a string and a matrix whatever its
+// type, so moving one meant moving all three. Kept here as the baseline for the Stack case below.
+struct WideValue
+{
+    WideValue(double a) : type(ValueType::SCALAR), d(a) {}
+
+    ValueType type;
+    double d;
+    CString s;
+    std::vector<double> m;
+};
+
+struct WideStack
+{
+    void push(double d) { m_stack.emplace_back(d); }
+    double pop_double()
+    {
+        if (m_stack.size() < 1) throw std::runtime_error("stack underflow");
+        if (m_stack.back().type != ValueType::SCALAR) throw std::runtime_error("type error: expected number");
+        auto r = m_stack.back().d;
+        m_stack.pop_back();
+        return r;
+    }
+
+    std::vector<WideValue> m_stack;
+};
+
+// Scalar + - * / on the stack alone, as the arithmetic commands run it, without tokenizing or dispatch: Stack against
+// the same operations on the old layout.
+template<class S>
+static void scalar_arith(S& stack)
+{
+    constexpr int ROUNDS = 250;
+    stack.push(1.0);
+    for (int i = 0; i < ROUNDS; ++i)
+    {
+        stack.push(2.0);
+        stack.push(stack.pop_double() + stack.pop_double());
+        stack.push(3.0);
+        stack.push(stack.pop_double() * stack.pop_double());
+        stack.push(4.0);
+        stack.push(stack.pop_double() - stack.pop_double());
+        stack.push(5.0);
+        stack.push(stack.pop_double() / stack.pop_double());
+    }
+    consume(stack.pop_double());
+}
+
+static void bench_stack(Bench& b)
+{
+    if (!b.wants("Stack")) return;
+
+    // Each round pushes 8 values and pops 8.
+    double work = 250 * 16 * 1e-6;
+    Stack stack;
+    b.run("Stack/scalar-arith", fmt::format("{}-byte Value", sizeof(Value)), work, "Mop/s", [&]() {
+        scalar_arith(stack);
+    });
+    WideStack wide;
+    b.run("Stack/scalar-arith/wide", fmt::format("{}-byte Value", sizeof(WideValue)), work, "Mop/s", [&]() {
+        scalar_arith(wide);
+    });
+}
+
+// Command lookup alone, outside the interpreter loop where tokenizing and the command bodies hide it: the engine's
+// perfect hash against a linear scan of the same table, over every command name and one name that misses.
+static void bench_dispatch(Bench& b)
+{
+    if (!b.wants("Commands::find")) return;
+
+    Engine engine;
+    engine.load();
+    auto& commands = engine.commands;
+    std::vector<std::string> names;
+    for (size_t i = 0; i < commands.size; ++i)
+        names.emplace_back(commands.begin[i].name);
+    names.emplace_back("no-such-command");
+
+    auto args = fmt::format("{} names + 1 miss", commands.size);
+    double work = names.size() * 1e-6;
+    b.run("Commands::find", args, work, "Mop/s", [&]() {
+        size_t found = 0;
+        for (auto& name : names)
+            found += commands.find(name) != nullptr;
+        consume((double)found);
+    });
+    b.run("Commands::find/linear", args, work, "Mop/s", [&]() {
+        size_t found = 0;
+        for (auto& name : names)
+        {
+            for (size_t i = 0; i < commands.size; ++i)
+            {
+                if (commands.begin[i].name == name)
+                {
+                    ++found;
+                    break;
+                }
+            }
+        }
+        consume((double)found);
+    });
+}
+
+// Synthetic scripts, each run token by token through Interpreter::handle_command. Each script leaves the stack as it
+// found it, so it can be repeated any number of times.
+static void bench_interpreter(Bench& b)
+{
+    if (!b.wants("interpreter") && !b.wants("tokenizer") && !b.wants("classify_token")) return;
+
+    struct Script
+    {
+        const char* name;
+        const char* text;
+    };
+    static const Script scripts[] = {
+        {"numbers", "1 2 3 4 pop pop pop pop"},
+        {"scalar-arith", "1 2 + 3 * 4 - pop"},
+        {"symbols", "$$a $$b pop pop"},
+        {"variables", "$x $x + pop"},
+        {"stack-copy", "@0 @1 pop pop"},
+        {"small-matrix", "4 ones 2 m* 1 m+ pop"},
+        {"reduction", "$v sum pop"},
+    };
+    // Enough repetitions that each call runs about a thousand tokens.
+    constexpr int TOKENS = 1000;
+
+    // One interpreter runs the scripts as they are; the other runs them with the profiler recording every token.
+    std::unique_ptr<Interpreter> interpreters[2];
+    for (auto& interpreter : interpreters)
+    {
+        interpreter = std::make_unique<Interpreter>();
+        interpreter->load_engine();
+        interpreter->environment().auto_display_flag = false;
+        for (auto token : {"1", "$$x", "store", "1000", "ones", "$$v", "store", "1", "2"})
+            interpreter->handle_command(token);
+    }
+    auto& interpreter = *interpreters[0];
+    interpreters[1]->handle_command("1");
+    interpreters[1]->handle_command("profile");
+
+    for (auto&& s : scripts)
+    {
+        std::vector<std::string_view> tokens;
+        while (tokens.size() < TOKENS)
+        {
+            Tokenizer in(s.text);
+            std::string_view token;
+            while (in.next(token))
+                tokens.push_back(token);
+        }
+        double work = tokens.size() * 1e-6;
+        for (auto& i : interpreters)
+        {
+            b.run(&i == &interpreters[0] ? "interpreter" : "interpreter/profiled", s.name, work, "Mtok/s", [&]() {
+                for (auto token : tokens)
+                    i->handle_command(token);
+            });
+        }
+    }
+
+    // Whole scripts: tokenized on every run by run_batch, or compiled once and run from the bytecode cache.
+    std::string text;
+    while (text.size() < 64 * 1024)
+        text += "1 2 + 3 * 4 - pop $x $x + pop @0 @1 pop pop ";
+    size_t token_count = 0;
+    {
+        Tokenizer in(text);
+        std::string_view token;
+        while (in.next(token))
+            ++token_count;
+    }
+    double work = token_count * 1e-6;
+    b.run("interpreter/run_batch", "64 KiB script", work, "Mtok/s", [&]() { interpreter.run_batch(text); });
+
+    // Two independent products, run one after the other or as background jobs that overlap until m+m needs both.
+    // multiply_matrix is single-threaded, so the jobs can use a second core each.
+    interpreter.run_batch("256 256 * ones 256 256 2 reshape $$g store");
+    double gemm_flops = 2 * 2.0 * 256 * 256 * 256 / 1e9;
+    b.run("interpreter/jobs", "2 mmul 256, in turn", gemm_flops, "GFLOP/s", [&]() {
+        interpreter.run_batch("$g $g 256 mmul $g $g 256 mmul m+m pop");
+    });
+    b.run("interpreter/jobs", "2 mmul 256, &mmul", gemm_flops, "GFLOP/s", [&]() {
+        interpreter.run_batch("$g $g 256 &mmul $g $g 256 &mmul m+m pop");
+    });
+
+    auto script = fs::temp_directory_path() / fmt::format("sh-bench-{}.sh", std::random_device{}());
+    {
+        auto f = std::fopen(script.string().c_str(), "wb");
+        if (!f) throw std::runtime_error("Failed to write a temporary script.");
+        std::fwrite(text.data(), 1, text.size(), f);
+        std::fclose(f);
+    }
+    b.run("interpreter/load_file", "64 KiB script, cached", work, "Mtok/s", [&]() { interpreter.load_file(script); });
+
+    // Reading the script's tokens from the file: mapped and split in place, as load-file does now, against the
+    // fscanf loop into a 128-byte buffer that it used before.
+    b.run("tokenizer/mapped", "64 KiB file", work, "Mtok/s", [&]() {
+        auto file = MappedFile::open(script);
+        Tokenizer in(std::string_view(file->data(), file->size()));
+        std::string_view token;
+        size_t n = 0;
+        while (in.next(token))
+            n += token.size();
+        consume((double)n);
+    });
+    b.run("tokenizer/fscanf", "64 KiB file", work, "Mtok/s", [&]() {
+        auto f = std::fopen(script.string().c_str(), "rb");
+        if (!f) throw std::runtime_error("Failed to open the temporary script.");
+        char buf[128];
+        size_t n = 0;
+        while (std::fscanf(f, "%127s", buf) == 1)
+            n += std::strlen(buf);
+        std::fclose(f);
+        consume((double)n);
+    });
+    std::error_code ec;
+    fs::remove(script, ec);
+    fs::remove(compiled_cache_path(script), ec);
+
+    b.run("tokenizer", "64 KiB script", work, "Mtok/s", [&]() {
+        Tokenizer in(text);
+        std::string_view token;
+        size_t n = 0;
+        while (in.next(token))
+            ++n;
+        consume((double)n);
+    });
+
+    std::vector<std::string_view> mixed = {"1", "-2.5", "$$name", "$name", "@3", "\"text\"", "m+m", "load-file"};
+    b.run("classify_token", "mixed", mixed.size() * 1e-6, "Mtok/s", [&]() {
+        for (auto token : mixed)
+            consume(classify_token(token).number);
+    });
+}
+
+static void write_json(const std::vector<Result>& results, double min_time)
+{
+    fmt::memory_buffer out;
+    auto it = std::back_inserter(out);
+    fmt::format_to(it,
+                   "{{\"threads\":{},\"avx2\":{},\"min_time\":{},\"benchmarks\":[\n",
+                   std::thread::hardware_concurrency(),
+#if defined(__AVX2__)
+                   "true",
+#else
+                   "false",
+#endif
+                   min_time);
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        auto& r = results[i];
+        fmt::format_to(it,
+                       "  {{\"name\":\"{}\",\"args\":\"{}\",\"iterations\":{},\"min_ns\":{:.1f},\"median_ns\":{:.1f},"
+                       "\"rate\":{:.4g},\"unit\":\"{}\"}}{}\n",
+                       r.name,
+                       r.args,
+                       r.iterations,
+                       r.min_ns,
+                       r.median_ns,
+                       r.rate,
+                       r.unit,
+                       i + 1 < results.size() ? "," : "");
+    }
+    fmt::format_to(it, "]}}\n");
+    std::fwrite(out.data(), 1, out.size(), stdout);
+}
+
+static void write_csv(const std::vector<Result>& results)
+{
+    fmt::printf("name,args,iterations,min_ns,median_ns,rate,unit\n");
+    for (auto&& r : results)
+        fmt::printf("%s,\"%s\",%d,%.1f,%.1f,%.4g,%s\n",
+                    r.name,
+                    r.args,
+                    r.iterations,
+                    r.min_ns,
+                    r.median_ns,
+                    r.rate,
+                    r.unit);
+}
+
+int main(int argc, char** argv)
+{
+    std::string format = "json";
+    std::string filter;
+    double min_time = 0.2;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string_view arg = argv[i];
+        if (arg == "--format" && i + 1 < argc)
+            format = argv[++i];
+        else if (arg == "--filter" && i + 1 < argc)
+            filter = argv[++i];
+        else if (arg == "--min-time" && i + 1 < argc)
+            min_time = std::atof(argv[++i]);
+        else
+        {
+            fmt::fprintf(stderr, "Usage: %s [--format json|csv] [--filter text] [--min-time seconds]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (format != "json" && format != "csv")
+    {
+        fmt::fprintf(stderr, "Unknown format %s.\n", format);
+        return 2;
+    }
+
+    try
+    {
+        Bench b(filter, min_time);
+        ThreadPool pool;
+        bench_gemm(b, pool);
+        bench_elementwise(b);
+        bench_transpose(b, pool);
+        bench_views(b, pool);
+        bench_reductions(b);
+        bench_sparse(b, pool);
+        bench_format(b);
+        bench_stack(b);
+        bench_dispatch(b);
+        bench_interpreter(b);
+
+        if (format == "json")
+            write_json(b.results(), min_time);
+        else
+            write_csv(b.results());
+    }
+    catch (const std::exception& e)
+    {
+        fmt::fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
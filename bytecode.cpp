@@ -0,0 +1,322 @@
+#include "pch.h"
+
+#include "bytecode.h"
+#include "cfile.h"
+#include "mapped_file.h"
+#include "tokenizer.h"
+
+#include <charconv>
+#include <cstring>
+#include <random>
+
+Token classify_token(std::string_view sv)
+{
+    Token t;
+    t.text = sv;
+    if (sv.size() == 1 && isdigit(sv[0]) != 0)
+    {
+        t.kind = TokenKind::NUMBER;
+        t.number = sv[0] - '0';
+    }
+    else if ((isdigit(sv[0]) != 0 || (sv[0] == '-' && sv.size() > 1)) &&
+             std::all_of(sv.begin() + 1, sv.end(), [](char ch) { return isdigit(ch) != 0 || ch == '.'; }))
+    {
+        auto err = std::from_chars(sv.data(), sv.data() + sv.size(), t.number);
+        if (err.ec != std::errc()) throw std::runtime_error("failed to parse number.");
+        t.kind = TokenKind::NUMBER;
+    }
+    else if (sv.size() >= 1 && sv[0] == '$')
+    {
+        if (sv.size() == 1) throw std::runtime_error("expected variable name");
+        if (sv[1] == '$')
+        {
+            if (sv.size() == 2) throw std::runtime_error("expected variable name");
+            t.kind = TokenKind::SYMBOL;
+            t.text = sv.substr(2);
+        }
+        else
+        {
+            t.kind = TokenKind::VARIABLE;
+            t.text = sv.substr(1);
+        }
+    }
+    else if (sv.size() >= 1 && sv[0] == '@')
+    {
+        if (sv.size() == 1) throw std::runtime_error("expected stack index");
+        if (!std::all_of(sv.begin() + 1, sv.end(), [](char ch) { return isdigit(ch) != 0; }))
+            throw std::runtime_error("expected stack index");
+
+        auto err = std::from_chars(sv.data() + 1, sv.data() + sv.size(), t.index);
+        if (err.ec != std::errc()) throw std::runtime_error("failed to parse stack index.");
+        t.kind = TokenKind::STACK_COPY;
+    }
+    else if (sv[0] == '"')
+    {
+        if (sv.size() < 2 || sv.back() != '"') throw std::runtime_error("unterminated string literal");
+        t.kind = TokenKind::STRING;
+        t.text = sv.substr(1, sv.size() - 2);
+    }
+    else
+    {
+        t.kind = TokenKind::WORD;
+    }
+    return t;
+}
+
+bool is_interpreter_word(std::string_view sv)
+{
+    return sv == "load-engine" || sv == "unload-engine" || sv == "load-file" || sv == "profile" ||
+           sv == "profile-reset" || sv == "profile-dump";
+}
+
+uint64_t hash_bytes(const void* data, size_t size)
+{
+    // FNV-1a over 8-byte words: fast enough to rehash multi-hundred-MB scripts on every load.
+    const uint64_t prime = 0x100000001b3ull;
+    uint64_t h = 0xcbf29ce484222325ull ^ size;
+    auto p = (const unsigned char*)data;
+    for (; size >= 8; size -= 8, p += 8)
+    {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * prime;
+        h ^= h >> 29;
+    }
+    for (; size > 0; --size, ++p)
+        h = (h ^ *p) * prime;
+    return h;
+}
+
+uint64_t command_fingerprint(const Commands& commands)
+{
+    uint64_t h = commands.size;
+    for (size_t i = 0; i < commands.size; ++i)
+    {
+        auto name = commands.begin[i].name;
+        h = h * 31 + hash_bytes(name.data(), name.size());
+    }
+    return h;
+}
+
+CompiledScript compile_script(std::string_view source, const Commands& commands)
+{
+    CompiledScript script;
+    script.command_fingerprint = command_fingerprint(commands);
+    for (size_t i = 0; i < commands.size; ++i)
+        script.command_names.emplace_back(commands.begin[i].name);
+
+    using NameIds = std::unordered_map<std::string_view, uint32_t>;
+    NameIds string_ids;
+    NameIds symbol_ids;
+    auto pool = [](std::vector<std::string>& v, NameIds& ids, std::string_view sv) {
+        auto it = ids.find(sv);
+        if (it != ids.end()) return it->second;
+        auto id = (uint32_t)v.size();
+        v.emplace_back(sv);
+        ids.emplace(sv, id);
+        return id;
+    };
+    auto intern = [&](std::string_view sv) { return pool(script.strings, string_ids, sv); };
+    auto intern_symbol = [&](std::string_view sv) { return pool(script.symbols, symbol_ids, sv); };
+
+    Tokenizer in(source);
+    std::string_view sv;
+    while (in.next(sv))
+    {
+        Token t;
+        try
+        {
+            t = classify_token(sv);
+        }
+        catch (const std::exception&)
+        {
+            // Leave the error to be raised when the token is reached, after everything before it has run.
+            script.code.push_back({OpCode::WORD, intern(sv)});
+            continue;
+        }
+
+        switch (t.kind)
+        {
+            case TokenKind::NUMBER:
+                script.code.push_back({OpCode::PUSH_NUMBER, (uint32_t)script.numbers.size()});
+                script.numbers.push_back(t.number);
+                break;
+            case TokenKind::SYMBOL: script.code.push_back({OpCode::PUSH_SYMBOL, intern_symbol(t.text)}); break;
+            case TokenKind::STRING: script.code.push_back({OpCode::PUSH_STRING, intern(t.text)}); break;
+            case TokenKind::VARIABLE: script.code.push_back({OpCode::LOAD_VARIABLE, intern_symbol(t.text)}); break;
+            case TokenKind::STACK_COPY: script.code.push_back({OpCode::PUSH_STACK_COPY, (uint32_t)t.index}); break;
+            case TokenKind::WORD:
+            {
+                auto command = is_interpreter_word(sv) ? nullptr : commands.find(sv);
+                if (command)
+                    script.code.push_back({OpCode::CALL, (uint32_t)(command - commands.begin)});
+                else
+                    script.code.push_back({OpCode::WORD, intern(sv)});
+                break;
+            }
+        }
+    }
+    return script;
+}
+
+static constexpr char BYTECODE_MAGIC[8] = {'S', 'H', 'B', 'C', 'O', 'D', 'E', '\n'};
+static constexpr uint32_t BYTECODE_VERSION = 2;
+
+struct BytecodeHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t source_hash;
+    uint64_t command_fingerprint;
+    uint64_t code_count;
+    uint64_t number_count;
+    uint64_t string_count;
+    uint64_t symbol_count;
+    uint64_t command_count;
+};
+
+std::experimental::filesystem::path compiled_cache_path(const std::experimental::filesystem::path& script)
+{
+    auto ret = script;
+    ret += ".shbc";
+    return ret;
+}
+
+namespace
+{
+    struct BytecodeReader
+    {
+        const char* p;
+        const char* end;
+
+        void read(void* out, size_t n)
+        {
+            if (n == 0) return;
+            if ((size_t)(end - p) < n) throw std::runtime_error("truncated bytecode cache");
+            memcpy(out, p, n);
+            p += n;
+        }
+        std::string read_string()
+        {
+            uint32_t n;
+            read(&n, sizeof(n));
+            if ((size_t)(end - p) < n) throw std::runtime_error("truncated bytecode cache");
+            std::string s(p, n);
+            p += n;
+            return s;
+        }
+    };
+}
+
+bool load_compiled(const std::experimental::filesystem::path& cache,
+                   uint64_t source_hash,
+                   uint64_t fingerprint,
+                   CompiledScript& out)
+{
+    std::shared_ptr<MappedFile> file;
+    try
+    {
+        file = MappedFile::open(cache);
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+
+    try
+    {
+        BytecodeReader r = {file->data(), file->data() + file->size()};
+        BytecodeHeader h;
+        r.read(&h, sizeof(h));
+        if (memcmp(h.magic, BYTECODE_MAGIC, sizeof(h.magic)) != 0 || h.version != BYTECODE_VERSION ||
+            h.source_hash != source_hash || h.command_fingerprint != fingerprint)
+            return false;
+        if (h.code_count > file->size() || h.number_count > file->size()) return false;
+
+        CompiledScript script;
+        script.command_fingerprint = h.command_fingerprint;
+        script.code.resize(h.code_count);
+        r.read(script.code.data(), script.code.size() * sizeof(Instruction));
+        script.numbers.resize(h.number_count);
+        r.read(script.numbers.data(), script.numbers.size() * sizeof(double));
+        for (uint64_t i = 0; i < h.string_count; ++i)
+            script.strings.push_back(r.read_string());
+        for (uint64_t i = 0; i < h.symbol_count; ++i)
+            script.symbols.push_back(r.read_string());
+        for (uint64_t i = 0; i < h.command_count; ++i)
+            script.command_names.push_back(r.read_string());
+
+        for (auto&& insn : script.code)
+        {
+            bool ok = true;
+            switch (insn.op)
+            {
+                case OpCode::PUSH_NUMBER: ok = insn.arg < script.numbers.size(); break;
+                case OpCode::PUSH_SYMBOL:
+                case OpCode::LOAD_VARIABLE: ok = insn.arg < script.symbols.size(); break;
+                case OpCode::PUSH_STRING:
+                case OpCode::WORD: ok = insn.arg < script.strings.size(); break;
+                case OpCode::CALL: ok = insn.arg < script.command_names.size(); break;
+                case OpCode::PUSH_STACK_COPY: break;
+                default: ok = false;
+            }
+            if (!ok) return false;
+        }
+
+        out = std::move(script);
+        return true;
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+}
+
+void save_compiled(const std::experimental::filesystem::path& cache, uint64_t source_hash, const CompiledScript& script)
+{
+    // Written under a private name and renamed into place, so a concurrent reader, such as another server session
+    // loading the same script, sees either the previous cache or the complete new one.
+    auto temp = cache;
+    temp += fmt::format(".{:x}.tmp", std::random_device{}());
+    try
+    {
+        auto out_file = CFile::open_wb(temp);
+        FILE* f = out_file.get();
+        auto write = [&](const void* p, size_t n) {
+            if (n != 0 && fwrite(p, 1, n, f) != n) throw std::runtime_error("failed to write bytecode cache");
+        };
+        auto write_string = [&](const std::string& s) {
+            uint32_t n = (uint32_t)s.size();
+            write(&n, sizeof(n));
+            write(s.data(), s.size());
+        };
+
+        BytecodeHeader h = {};
+        memcpy(h.magic, BYTECODE_MAGIC, sizeof(h.magic));
+        h.version = BYTECODE_VERSION;
+        h.source_hash = source_hash;
+        h.command_fingerprint = script.command_fingerprint;
+        h.code_count = script.code.size();
+        h.number_count = script.numbers.size();
+        h.string_count = script.strings.size();
+        h.symbol_count = script.symbols.size();
+        h.command_count = script.command_names.size();
+        write(&h, sizeof(h));
+        write(script.code.data(), script.code.size() * sizeof(Instruction));
+        write(script.numbers.data(), script.numbers.size() * sizeof(double));
+        for (auto&& s : script.strings)
+            write_string(s);
+        for (auto&& s : script.symbols)
+            write_string(s);
+        for (auto&& s : script.command_names)
+            write_string(s);
+    }
+    catch (...)
+    {
+        std::error_code ec;
+        fs::remove(temp, ec);
+        throw;
+    }
+    fs::rename(temp, cache);
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "engine.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+enum class TokenKind
+{
+    NUMBER,
+    SYMBOL,
+    STRING,
+    VARIABLE,
+    STACK_COPY,
+    WORD,
+};
+
+// One lexed script token. `text` is the symbol, string or variable name without its sigils, or the whole word.
+struct Token
+{
+    TokenKind kind;
+    std::string_view text;
+    double number = 0.0;
+    int index = 0;
+};
+
+// Classifies a token exactly as the interpreter reads it. Throws on malformed literals.
+Token classify_token(std::string_view sv);
+
+// Words handled by the interpreter itself rather than by the engine.
+bool is_interpreter_word(std::string_view sv);
+
+enum class OpCode : uint32_t
+{
+    PUSH_NUMBER,
+    PUSH_SYMBOL,
+    PUSH_STRING,
+    LOAD_VARIABLE,
+    PUSH_STACK_COPY,
+    CALL,
+    WORD,
+};
+
+// `arg` indexes CompiledScript::numbers for PUSH_NUMBER, CompiledScript::symbols for PUSH_SYMBOL and LOAD_VARIABLE,
+// CompiledScript::strings for PUSH_STRING and WORD, the engine command table for CALL, and is the stack depth for
+// PUSH_STACK_COPY.
+struct Instruction
+{
+    OpCode op;
+    uint32_t arg;
+};
+
+// A script lowered to one instruction per token, with literals pre-parsed and engine commands resolved to their index
+// in the command table the script was compiled against. Tokens that cannot be resolved ahead of time (interpreter
+// words, unknown or malformed tokens) become WORD and are passed back to the interpreter when reached.
+struct CompiledScript
+{
+    std::vector<Instruction> code;
+    std::vector<double> numbers;
+    std::vector<std::string> strings;
+    // Symbol and variable names, interned into the running environment once per run.
+    std::vector<std::string> symbols;
+
+    // Names of the command table CALL indices refer to, for when a script changes the loaded engine.
+    std::vector<std::string> command_names;
+    uint64_t command_fingerprint = 0;
+};
+
+uint64_t hash_bytes(const void* data, size_t size);
+uint64_t command_fingerprint(const Commands& commands);
+
+CompiledScript compile_script(std::string_view source, const Commands& commands);
+
+// Bytecode caches live next to their script and are keyed by a hash of its text and of the command table.
+std::experimental::filesystem::path compiled_cache_path(const std::experimental::filesystem::path& script);
+bool load_compiled(const std::experimental::filesystem::path& cache,
+                   uint64_t source_hash,
+                   uint64_t fingerprint,
+                   CompiledScript& out);
+void save_compiled(const std::experimental::filesystem::path& cache,
+                   uint64_t source_hash,
+                   const CompiledScript& script);
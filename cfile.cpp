@@ -4,17 +4,27 @@
 
 void CFile::CFileDeleter::operator()(FILE* f) { fclose(f); }
 
-int CFileView::scan_string(char* buf, int size) { return fscanf_s(m_ptr, "%s", buf, size); }
+// `mode` is a two-character fopen mode such as "rb".
+static FILE* open_file(const std::experimental::filesystem::path& filename, const char* mode)
+{
+#if defined(_WIN32)
+    wchar_t wide_mode[] = {(wchar_t)mode[0], (wchar_t)mode[1], L'\0'};
+    FILE* out = nullptr;
+    return _wfopen_s(&out, filename.native().c_str(), wide_mode) ? nullptr : out;
+#else
+    return std::fopen(filename.c_str(), mode);
+#endif
+}
 
 CFile CFile::open_wb(const std::experimental::filesystem::path& filename)
 {
-    FILE* out = nullptr;
-    if (_wfopen_s(&out, filename.native().c_str(), L"wb")) throw std::runtime_error("Could not open file for writing");
+    FILE* out = open_file(filename, "wb");
+    if (!out) throw std::runtime_error("Could not open file for writing");
     return CFile(out);
 }
 CFile CFile::open_rb(const std::experimental::filesystem::path& filename)
 {
-    FILE* out = nullptr;
-    if (_wfopen_s(&out, filename.native().c_str(), L"rb")) throw std::runtime_error("Could not open file for reading");
+    FILE* out = open_file(filename, "rb");
+    if (!out) throw std::runtime_error("Could not open file for reading");
     return CFile(out);
 }
@@ -31,8 +31,6 @@ struct CFileView
     constexpr CFileView(FILE* ptr) : m_ptr(ptr) {}
     CFileView(const CFile& file) : m_ptr(file.get()) {}
 
-    int scan_string(char* buf, int size);
-
     template<class... Ts>
     void printf(Ts&&... ts)
     {
@@ -2,23 +2,73 @@
 
 #include "cfile.h"
 #include "engine.h"
+#include "snapshot.h"
 
 static void help_command(Environment& e);
 
+// Pushes f(a, b) for two values popped with pop_any_matrix, calling f with the MatrixData or SparseMatrix each holds
+// so that overload resolution picks the dense or sparse kernel.
+template<class F>
+static void push_product(Environment& e, const Value& a, const Value& b, F f)
+{
+    auto with_b = [&](auto& x) {
+        if (b.type() == ValueType::SPARSE)
+            e.stack.push(f(x, b.sparse()));
+        else
+            e.stack.push(f(x, b.matrix()));
+    };
+    if (a.type() == ValueType::SPARSE)
+        with_b(a.sparse());
+    else
+        with_b(a.matrix());
+}
+
 static void inner_command(Environment& e)
 {
     auto stride2 = (int)e.stack.pop_double();
     auto stride1 = (int)e.stack.pop_double();
     auto extent = (int)e.stack.pop_double();
-    auto m2 = e.stack.pop_matrix();
-    auto m1 = e.stack.pop_matrix();
-    e.stack.push(inner_product(m1, m2, extent, stride1, stride2));
+    auto m2 = e.stack.pop_any_matrix();
+    auto m1 = e.stack.pop_any_matrix();
+    push_product(e, m1, m2, [&](auto& a, auto& b) { return inner_product(a, b, extent, stride1, stride2, &e.pool); });
     e.auto_display();
 }
 
-static void exit_command(Environment& e) { std::exit(0); }
+static void mmul_command(Environment& e)
+{
+    auto extent = (int)e.stack.pop_double();
+    auto right = e.stack.pop_any_matrix();
+    auto left = e.stack.pop_any_matrix();
+    push_product(e, left, right, [&](auto& a, auto& b) { return multiply_matrix(a, b, extent); });
+    e.auto_display();
+}
 
-static void stack_command(Environment& e) { e.stack.display(); }
+static void exit_command(Environment& e)
+{
+    // Background jobs use the pools and the engine that exiting tears down.
+    e.wait_jobs();
+    if (e.on_exit)
+        e.on_exit();
+    else
+        std::exit(0);
+}
+
+static void stack_command(Environment& e) { e.stack.display(e.symbols, e.display_limit, e.out); }
+
+static void print_command(Environment& e)
+{
+    e.stack.display_top(e.symbols, e.display_limit, e.out);
+    std::fflush(e.out);
+}
+
+static void display_full_command(Environment& e) { e.stack.display_top(e.symbols, 0, e.out); }
+
+static void display_limit_command(Environment& e)
+{
+    auto n = e.stack.pop_double();
+    if (n < 0) throw std::runtime_error("display limit must not be negative");
+    e.display_limit = (size_t)n;
+}
 
 static void pop_command(Environment& e)
 {
@@ -58,18 +108,19 @@ static void div_command(Environment& e)
 static void matrix_command(Environment& e)
 {
     auto extent = (int)e.stack.pop_double();
-    MatrixData m;
-    m.data.resize(extent, 0);
+    if (extent < 0) throw std::runtime_error("matrix length must not be negative");
+    MatrixData m(extent);
+    double* data = m.mutable_data();
     for (int x = extent - 1; x >= 0; --x)
-        m.data[x] = e.stack.pop_double();
+        data[x] = e.stack.pop_double();
     e.stack.push(std::move(m));
     e.auto_display();
 }
 static void ones_command(Environment& e)
 {
     auto extent = (int)e.stack.pop_double();
-    MatrixData m;
-    m.data.resize(extent, 1.0);
+    if (extent < 0) throw std::runtime_error("matrix length must not be negative");
+    MatrixData m(extent, 1.0);
     e.stack.push(std::move(m));
     e.auto_display();
 }
@@ -78,24 +129,42 @@ static void store_command(Environment& e)
 {
     auto sym = e.stack.pop_symbol();
     auto v = e.stack.pop();
-    e.varmap.emplace(sym.c_str(), std::move(v));
+    v.evaluate();
+    e.varmap.set(sym, std::move(v));
 
     e.auto_display();
 }
 static void load_command(Environment& e)
 {
     auto sym = e.stack.pop_symbol();
-    e.stack.push(e.varmap.at(sym.c_str()).clone());
+    e.stack.push(e.variable(sym));
+
+    e.auto_display();
+}
+
+// Replaces every element x of m with f(x). f is generic over the element type, so F32 matrices stay in float.
+template<class F>
+static void update_elements(MatrixData& m, F f)
+{
+    dispatch_element_type(m.element_type(), [&](auto zero) {
+        auto data = m.mutable_data_as<decltype(zero)>();
+        for (size_t i = 0; i < m.size(); ++i)
+            data[i] = f(data[i]);
+    });
+}
 
+static void push_scalar_op(Environment& e, ElementExpr::Op op, double d)
+{
+    e.stack.push(ElementExpr::scalar_op(op, e.stack.pop_expression(), d));
     e.auto_display();
 }
 
 static void mat_mul_command(Environment& e)
 {
     auto d = e.stack.pop_double();
+    if (e.lazy_flag) return push_scalar_op(e, ElementExpr::Op::MUL_SCALAR, d);
     auto m = e.stack.pop_matrix();
-    for (auto&& x : m.data)
-        x *= d;
+    update_elements(m, [d](auto x) { return x * (decltype(x))d; });
     e.stack.push(std::move(m));
 
     e.auto_display();
@@ -104,9 +173,9 @@ static void mat_mul_command(Environment& e)
 static void mat_pow_command(Environment& e)
 {
     auto d = e.stack.pop_double();
+    if (e.lazy_flag) return push_scalar_op(e, ElementExpr::Op::POW_SCALAR, d);
     auto m = e.stack.pop_matrix();
-    for (auto&& x : m.data)
-        x = pow(x, d);
+    update_elements(m, [d](auto x) { return (decltype(x))std::pow(x, (decltype(x))d); });
     e.stack.push(std::move(m));
 
     e.auto_display();
@@ -115,9 +184,9 @@ static void mat_pow_command(Environment& e)
 static void mat_add_command(Environment& e)
 {
     auto d = e.stack.pop_double();
+    if (e.lazy_flag) return push_scalar_op(e, ElementExpr::Op::ADD_SCALAR, d);
     auto m = e.stack.pop_matrix();
-    for (auto&& x : m.data)
-        x += d;
+    update_elements(m, [d](auto x) { return x + (decltype(x))d; });
     e.stack.push(std::move(m));
 
     e.auto_display();
@@ -125,14 +194,31 @@ static void mat_add_command(Environment& e)
 
 static void mat_add_mat_command(Environment& e)
 {
-    auto m1 = e.stack.pop_matrix();
-    auto m2 = e.stack.pop_matrix();
-    if (m1.data.size() != m2.data.size()) throw std::runtime_error("matricies do not have equal extents");
-    for (size_t i = 0; i < m1.data.size(); ++i)
+    if (e.lazy_flag)
     {
-        m1.data[i] += m2.data[i];
+        auto m1 = e.stack.pop_expression();
+        auto m2 = e.stack.pop_expression();
+        e.stack.push(ElementExpr::add(std::move(m1), std::move(m2)));
+        e.auto_display();
+        return;
     }
 
+    auto m1 = e.stack.pop_matrix();
+    auto m2 = e.stack.pop_matrix();
+    if (m1.size() != m2.size()) throw std::runtime_error("matricies do not have equal extents");
+    auto type = common_type(m1.element_type(), m2.element_type());
+    if (m1.element_type() != type) m1 = m1.contiguous(type);
+    auto src = m2.contiguous(type, &e.pool);
+    dispatch_element_type(type, [&](auto zero) {
+        using T = decltype(zero);
+        const T* p2 = src.data_as<T>();
+        T* p1 = m1.mutable_data_as<T>();
+        for (size_t i = 0; i < m1.size(); ++i)
+        {
+            p1[i] += p2[i];
+        }
+    });
+
     e.stack.push(std::move(m1));
 
     e.auto_display();
@@ -140,9 +226,7 @@ static void mat_add_mat_command(Environment& e)
 
 static void size_command(Environment& e)
 {
-    auto m = e.stack.pop_matrix();
-    auto s = m.data.size();
-    e.stack.push(std::move(m));
+    auto s = e.stack.top_matrix().size();
     e.stack.push(s);
 
     e.auto_display();
@@ -151,65 +235,327 @@ static void size_command(Environment& e)
 static std::string serialize_helper(MatrixData const& m)
 {
     std::string ret;
-    for (auto&& x : m.data)
-        ret += fmt::sprintf("%.16f ", x);
-    ret += fmt::sprintf("%d matrix", (int)m.data.size());
+    auto c = m.contiguous();
+    dispatch_element_type(c.element_type(), [&](auto zero) {
+        auto data = c.data_as<decltype(zero)>();
+        for (size_t i = 0; i < c.size(); ++i)
+            ret += fmt::sprintf("%.16f ", (double)data[i]);
+    });
+    ret += fmt::sprintf("%d matrix", (int)c.size());
+    if (c.rank() > 1)
+    {
+        for (auto x : c.extents().extents)
+            ret += fmt::sprintf(" %d", x);
+        ret += fmt::sprintf(" %d reshape", c.rank());
+    }
+    if (c.element_type() == ElementType::F32) ret += " to-f32";
+    return ret;
+}
+// Rebuilt with coo from the nonzeros, so the text stays proportional to them rather than to the dense size.
+static std::string serialize_helper(SparseMatrix const& m)
+{
+    std::string ret;
+    auto vector = [&](auto element) {
+        for (int r = 0; r < m.rows(); ++r)
+            for (size_t k = m.row_ptr()[r]; k < m.row_ptr()[r + 1]; ++k)
+                ret += element(r, k);
+        ret += fmt::sprintf("%d matrix ", (int)m.nonzeros());
+    };
+    vector([&](int r, size_t) { return fmt::sprintf("%d ", r); });
+    vector([&](int, size_t k) { return fmt::sprintf("%d ", m.col_index()[k]); });
+    vector([&](int, size_t k) { return fmt::sprintf("%.16f ", m.values()[k]); });
+    ret += fmt::sprintf("%d %d coo", m.rows(), m.cols());
     return ret;
 }
 static std::string serialize_helper(double d) { return fmt::sprintf("%.16f", d); }
-static std::string serialize_helper(const Value& v)
+static std::string serialize_helper(const SymbolTable& symbols, const Value& v)
 {
-    switch (v.type)
+    switch (v.type())
     {
-        case ValueType::MATRIX: return serialize_helper(v.m);
-        case ValueType::SCALAR: return serialize_helper(v.d);
-        case ValueType::SYMBOL: return fmt::sprintf("$$%s", v.s.c_str());
-        case ValueType::STRING: return fmt::sprintf("\"%s\"", v.s.c_str());
+        case ValueType::MATRIX: return serialize_helper(v.matrix());
+        case ValueType::SCALAR: return serialize_helper(v.scalar());
+        case ValueType::SYMBOL: return fmt::sprintf("$$%s", symbols.name(v.symbol()));
+        case ValueType::STRING: return fmt::sprintf("\"%s\"", v.string().c_str());
+        case ValueType::EXPRESSION: return serialize_helper(v.expression()->evaluate());
+        case ValueType::FUTURE: return serialize_helper(symbols, v.future()->result());
+        case ValueType::SPARSE: return serialize_helper(v.sparse());
         default: std::terminate();
     }
 }
 
-static void serialize_command(Environment& e) { fmt::printf("%s\n", serialize_helper(e.stack.at_from_top(0))); }
+static void shape_command(Environment& e)
+{
+    auto extents = e.stack.top_matrix().extents().extents;
+    for (auto x : extents)
+        e.stack.push(x);
+    e.stack.push(extents.size());
+
+    e.auto_display();
+}
+
+static void reshape_command(Environment& e)
+{
+    auto rank = (int)e.stack.pop_double();
+    if (rank < 1) throw std::runtime_error("rank must be at least 1");
+    MatrixExtents extents;
+    extents.extents.resize(rank);
+    for (int x = rank - 1; x >= 0; --x)
+        extents.extents[x] = (int)e.stack.pop_double();
+    auto m = e.stack.pop_matrix();
+    e.stack.push(m.reshape(std::move(extents)));
 
-static void pwd_command(Environment&)
+    e.auto_display();
+}
+
+static void transpose_command(Environment& e)
 {
-    std::array<wchar_t, 1024> cwd;
-    cwd[0] = L'\0';
-    auto hr = GetCurrentDirectoryW(cwd.size(), cwd.data());
-    if (FAILED(hr))
-    {
-        throw std::runtime_error("GetCurrentDirectoryW failed");
-    }
-    std::array<char, 1024> utf8_cwd;
-    utf8_cwd[0] = '\0';
-    auto z = WideCharToMultiByte(CP_UTF8, 0, cwd.data(), -1, utf8_cwd.data(), utf8_cwd.size(), nullptr, nullptr);
-    fmt::printf("%s\n", utf8_cwd.data());
+    auto m = e.stack.pop_matrix();
+    e.stack.push(m.swap_axes(0, 1));
+
+    e.auto_display();
+}
+
+static void swap_axes_command(Environment& e)
+{
+    auto axis2 = (int)e.stack.pop_double();
+    auto axis1 = (int)e.stack.pop_double();
+    auto m = e.stack.pop_matrix();
+    e.stack.push(m.swap_axes(axis1, axis2));
+
+    e.auto_display();
+}
+
+static void slice_command(Environment& e)
+{
+    auto end = (int)e.stack.pop_double();
+    auto begin = (int)e.stack.pop_double();
+    auto axis = (int)e.stack.pop_double();
+    auto m = e.stack.pop_matrix();
+    e.stack.push(m.slice(axis, begin, end));
+
+    e.auto_display();
+}
+
+static void serialize_command(Environment& e)
+{
+    fmt::fprintf(e.out, "%s\n", serialize_helper(e.symbols, e.stack.at_from_top(0)));
+}
+
+static void pwd_command(Environment& e)
+{
+    fmt::fprintf(e.out, "%s\n", fs::current_path().u8string());
 }
 
 static void fswrite(std::string_view sv, FILE* f) { fwrite(sv.data(), 1, sv.size(), f); }
 
 static void dump_command(Environment& e)
 {
-    fmt::printf("Filename>");
+    e.prompt("Filename>");
 
-    std::string filename = read_line();
+    std::string filename = e.read_line();
 
     auto p = fs::absolute(filename);
     auto out_file_holder = CFile::open_wb(p);
     CFileView out_file = out_file_holder;
 
-    for (auto&& p : e.varmap)
+    e.varmap.for_each([&](int sym, const Value& v) {
+        auto s = serialize_helper(e.symbols, v);
+        out_file.printf("%s\n$$%s store\n", s, e.symbols.name(sym));
+    });
+
+    for (int x = e.stack.size() - 1; x >= 0; --x)
     {
-        auto s = serialize_helper(p.second);
-        out_file.printf("%s\n$$%s store\n", s, p.first);
+        out_file.printf("%s\n", serialize_helper(e.symbols, e.stack.at_from_top(x)));
     }
 
-    for (int x = e.stack.size() - 1; x >= 0; --x)
+    fmt::fprintf(e.out, "Wrote state to \"%s\".\n", p.u8string());
+}
+
+static void threads_command(Environment& e)
+{
+    auto n = (int)e.stack.pop_double();
+    if (n < 1) throw std::runtime_error("thread count must be at least 1");
+    e.wait_jobs();
+    e.pool.resize(n);
+}
+
+static void wait_command(Environment& e) { e.wait_jobs(); }
+
+static void jobs_command(Environment& e)
+{
+    bool any = false;
+    for (auto&& j : e.jobs)
     {
-        out_file.printf("%s\n", serialize_helper(e.stack.at_from_top(x)));
+        auto job = j.lock();
+        if (!job) continue;
+        any = true;
+        auto ms = std::chrono::duration<double, std::milli>(job->elapsed()).count();
+        if (!job->done())
+            fmt::fprintf(e.out, "  %d %s: running for %.1f ms\n", job->id, job->command, ms);
+        else if (!job->error().empty())
+            fmt::fprintf(e.out, "  %d %s: failed after %.1f ms: %s\n", job->id, job->command, ms, job->error());
+        else
+            fmt::fprintf(e.out, "  %d %s: done in %.1f ms\n", job->id, job->command, ms);
     }
+    if (!any) fmt::fprintf(e.out, "No jobs\n");
+}
+
+static void bayes_command(Environment& e)
+{
+    auto div = e.stack.pop_matrix();
+    auto mult = e.stack.pop_matrix();
+    auto src = e.stack.pop_matrix();
+    e.stack.push(bayes_rule(src, mult, div));
+
+    e.auto_display();
+}
+
+static void dot_command(Environment& e)
+{
+    auto v = e.stack.pop_any_matrix();
+    auto m = e.stack.pop_any_matrix();
+    push_product(e, m, v, [](auto& a, auto& b) { return dot(a, b); });
+
+    e.auto_display();
+}
+
+static void sparse_command(Environment& e)
+{
+    e.stack.push(SparseMatrix::from_dense(e.stack.pop_matrix(), &e.pool));
+    e.auto_display();
+}
+
+static void dense_command(Environment& e)
+{
+    e.stack.push(e.stack.pop_sparse().to_dense());
+    e.auto_display();
+}
+
+static void coo_command(Environment& e)
+{
+    auto cols = (int)e.stack.pop_double();
+    auto rows = (int)e.stack.pop_double();
+    auto values = e.stack.pop_matrix().contiguous(ElementType::F64);
+    auto col_index = e.stack.pop_matrix().contiguous(ElementType::F64);
+    auto row_index = e.stack.pop_matrix().contiguous(ElementType::F64);
+    if (row_index.size() != values.size() || col_index.size() != values.size())
+        throw std::runtime_error("coo needs as many rows and columns as values");
+
+    std::vector<SparseMatrix::Triplet> triplets(values.size());
+    for (size_t i = 0; i < values.size(); ++i)
+        triplets[i] = {(int)row_index.data()[i], (int)col_index.data()[i], values.data()[i]};
+    e.stack.push(SparseMatrix::from_triplets(rows, cols, std::move(triplets)));
+    e.auto_display();
+}
+
+static Summation summation(const Environment& e)
+{
+    return e.compensated_flag ? Summation::COMPENSATED : Summation::FAST;
+}
+
+static void sum_command(Environment& e)
+{
+    e.stack.push(sum(e.stack.pop_matrix(), summation(e)));
+    e.auto_display();
+}
+
+static void mean_command(Environment& e)
+{
+    e.stack.push(mean(e.stack.pop_matrix(), summation(e)));
+    e.auto_display();
+}
+
+static void min_command(Environment& e)
+{
+    e.stack.push(minimum(e.stack.pop_matrix()));
+    e.auto_display();
+}
+
+static void max_command(Environment& e)
+{
+    e.stack.push(maximum(e.stack.pop_matrix()));
+    e.auto_display();
+}
+
+static void argmax_command(Environment& e)
+{
+    e.stack.push((double)argmax(e.stack.pop_matrix()));
+    e.auto_display();
+}
+
+static void norm_command(Environment& e)
+{
+    e.stack.push(norm(e.stack.pop_matrix(), summation(e)));
+    e.auto_display();
+}
+
+static void reduce_axis_helper(Environment& e, Reduction op)
+{
+    auto axis = (int)e.stack.pop_double();
+    auto m = e.stack.pop_matrix();
+    e.stack.push(reduce_axis(m, op, axis, summation(e)));
+
+    e.auto_display();
+}
+
+static void sum_axis_command(Environment& e) { reduce_axis_helper(e, Reduction::SUM); }
+static void mean_axis_command(Environment& e) { reduce_axis_helper(e, Reduction::MEAN); }
+static void min_axis_command(Environment& e) { reduce_axis_helper(e, Reduction::MIN); }
+static void max_axis_command(Environment& e) { reduce_axis_helper(e, Reduction::MAX); }
+static void argmax_axis_command(Environment& e) { reduce_axis_helper(e, Reduction::ARGMAX); }
+static void norm_axis_command(Environment& e) { reduce_axis_helper(e, Reduction::NORM); }
+
+static void compensated_command(Environment& e) { e.compensated_flag = e.stack.pop_double() != 0.0; }
+
+static void pool_command(Environment& e)
+{
+    auto s = MatrixPool::global().stats();
+    auto requests = s.hits + s.misses;
+    fmt::fprintf(e.out,
+                 "Matrix pool: %zu hits, %zu misses (%.1f%% hit rate), %zu blocks / %.1f MiB cached\n",
+                 s.hits,
+                 s.misses,
+                 requests ? 100.0 * s.hits / requests : 0.0,
+                 s.cached_blocks,
+                 s.cached_bytes / (1024.0 * 1024.0));
+}
+
+static void to_f32_command(Environment& e)
+{
+    e.stack.push(e.stack.pop_matrix().contiguous(ElementType::F32, &e.pool));
+    e.auto_display();
+}
 
-    fmt::printf("Wrote state to \"%s\".\n", p.u8string());
+static void to_f64_command(Environment& e)
+{
+    e.stack.push(e.stack.pop_matrix().contiguous(ElementType::F64, &e.pool));
+    e.auto_display();
+}
+
+static void lazy_command(Environment& e) { e.lazy_flag = e.stack.pop_double() != 0.0; }
+
+static void dump_bin_command(Environment& e)
+{
+    e.prompt("Filename>");
+
+    std::string filename = e.read_line();
+
+    auto p = fs::absolute(filename);
+    save_snapshot(e, p);
+
+    fmt::fprintf(e.out, "Wrote state to \"%s\".\n", p.u8string());
+}
+
+static void load_bin_command(Environment& e)
+{
+    e.prompt("Filename>");
+
+    std::string filename = e.read_line();
+
+    auto p = fs::absolute(filename);
+    load_snapshot(e, p);
+
+    fmt::fprintf(e.out, "Loaded state from \"%s\".\n", p.u8string());
 }
 
 static void clear_command(Environment& env) { env.stack.clear(); }
@@ -218,6 +564,8 @@ using namespace std::string_view_literals;
 
 static constexpr Command commands[] = {
     {"dump"sv, "dump"sv, &dump_command},
+    {"dump-bin"sv, "dump-bin"sv, &dump_bin_command},
+    {"load-bin"sv, "load-bin"sv, &load_bin_command},
     {"exit"sv, "exit"sv, &exit_command},
     {"help"sv, "help"sv, &help_command},
     {"pwd"sv, "pwd"sv, &pwd_command},
@@ -225,16 +573,50 @@ static constexpr Command commands[] = {
     {"inner"sv, "inner :: m1 m2 dExtent dStride1 dStride2 -> m"sv, &inner_command},
     {"load"sv, "load :: y -> *"sv, &load_command},
     {"matrix"sv, "matrix :: d... dLen -> m"sv, &matrix_command},
+    {"mmul"sv, "mmul :: m1 m2 dExtent -> m"sv, &mmul_command},
     {"serialize"sv, "serialize :: * -> *"sv, &serialize_command},
     {"ones"sv, "ones :: dLen -> m"sv, &ones_command},
     {"m+"sv, "m+ :: m d -> m"sv, &mat_add_command},
     {"m*"sv, "m* :: m d -> m"sv, &mat_mul_command},
     {"m**"sv, "m** :: m d -> m"sv, &mat_pow_command},
     {"m+m"sv, "m+m :: m m -> m"sv, &mat_add_mat_command},
+    {"bayes"sv, "bayes :: mSrc mMult mDiv -> m"sv, &bayes_command},
+    {"dot"sv, "dot :: m mVector -> m"sv, &dot_command},
+    {"sum"sv, "sum :: m -> d"sv, &sum_command},
+    {"mean"sv, "mean :: m -> d"sv, &mean_command},
+    {"min"sv, "min :: m -> d"sv, &min_command},
+    {"max"sv, "max :: m -> d"sv, &max_command},
+    {"argmax"sv, "argmax :: m -> dIndex"sv, &argmax_command},
+    {"norm"sv, "norm :: m -> d"sv, &norm_command},
+    {"sum-axis"sv, "sum-axis :: m dAxis -> m"sv, &sum_axis_command},
+    {"mean-axis"sv, "mean-axis :: m dAxis -> m"sv, &mean_axis_command},
+    {"min-axis"sv, "min-axis :: m dAxis -> m"sv, &min_axis_command},
+    {"max-axis"sv, "max-axis :: m dAxis -> m"sv, &max_axis_command},
+    {"argmax-axis"sv, "argmax-axis :: m dAxis -> m"sv, &argmax_axis_command},
+    {"norm-axis"sv, "norm-axis :: m dAxis -> m"sv, &norm_axis_command},
     {"pop"sv, "pop :: * ->"sv, &pop_command},
     {"size"sv, "size :: m -> m d"sv, &size_command},
+    {"shape"sv, "shape :: m -> m d... dRank"sv, &shape_command},
+    {"reshape"sv, "reshape :: m d... dRank -> m"sv, &reshape_command},
+    {"transpose"sv, "transpose :: m -> m"sv, &transpose_command},
+    {"swap-axes"sv, "swap-axes :: m dAxis1 dAxis2 -> m"sv, &swap_axes_command},
+    {"slice"sv, "slice :: m dAxis dBegin dEnd -> m"sv, &slice_command},
+    {"to-f32"sv, "to-f32 :: m -> m"sv, &to_f32_command},
+    {"to-f64"sv, "to-f64 :: m -> m"sv, &to_f64_command},
+    {"sparse"sv, "sparse :: m -> s"sv, &sparse_command},
+    {"dense"sv, "dense :: s -> m"sv, &dense_command},
+    {"coo"sv, "coo :: mRow mColumn mValue dRows dColumns -> s"sv, &coo_command},
     {"stack"sv, "stack :: ->"sv, &stack_command},
+    {"print"sv, "print :: ->"sv, &print_command},
+    {"display-full"sv, "display-full :: ->"sv, &display_full_command},
+    {"display-limit"sv, "display-limit :: dElements ->"sv, &display_limit_command},
     {"store"sv, "store :: * y ->"sv, &store_command},
+    {"lazy"sv, "lazy :: dEnabled ->"sv, &lazy_command},
+    {"compensated"sv, "compensated :: dEnabled ->"sv, &compensated_command},
+    {"threads"sv, "threads :: dCount ->"sv, &threads_command},
+    {"pool"sv, "pool :: ->"sv, &pool_command},
+    {"wait"sv, "wait :: ->"sv, &wait_command},
+    {"jobs"sv, "jobs :: ->"sv, &jobs_command},
     {"+"sv, "+ :: d d -> d"sv, &plus_command},
     {"-"sv, "- :: d d -> d"sv, &minus_command},
     {"*"sv, "* :: d d -> d"sv, &mult_command},
@@ -243,17 +625,35 @@ static constexpr Command commands[] = {
 
 static void help_command(Environment& e)
 {
-    fmt::printf("Commands:\n");
+    fmt::fprintf(e.out, "Commands:\n");
     for (auto&& command : commands)
     {
-        fmt::printf("  %s\n", command.signature);
+        fmt::fprintf(e.out, "  %s\n", command.signature);
     }
-    fmt::printf("\nSpecial operations:\n"
-                "  load-file - interpret a file\n"
-                "  <N> - push literal number N\n"
-                "  @<N> - push Nth stack element, from the top\n"
-                "  $<name> - push value of variable <name>\n"
-                "  $$<name> - push symbol for variable <name>\n");
+    fmt::fprintf(e.out,
+                 "\nSpecial operations:\n"
+                 "  load-file - interpret a file\n"
+                 "  <0|1> profile - stop (printing a report) or start per-command profiling\n"
+                 "  profile-reset - clear the profiling counters\n"
+                 "  profile-dump - print the profiling counters as JSON\n"
+                 "  &<command> - run <command> in the background, pushing a future for its result\n"
+                 "  <N> - push literal number N\n"
+                 "  @<N> - push Nth stack element, from the top\n"
+                 "  $<name> - push value of variable <name>\n"
+                 "  $$<name> - push symbol for variable <name>\n");
 }
 
-extern "C" Commands __cdecl get_commands() { return {sizeof(commands) / sizeof(commands[0]), commands}; }
+static uint64_t allocated_bytes() { return MatrixPool::global().stats().allocated_bytes; }
+
+static constexpr auto command_table =
+    make_command_hash_table<command_slot_count(sizeof(commands) / sizeof(commands[0]))>(commands);
+
+extern "C" Commands SH_ENGINE_API get_commands()
+{
+    return {sizeof(commands) / sizeof(commands[0]),
+            commands,
+            command_table.slots.data(),
+            command_table.slots.size() - 1,
+            command_table.seed,
+            &allocated_bytes};
+}
@@ -2,12 +2,96 @@
 
 #include "environment.h"
 
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+
+constexpr uint64_t command_hash(std::string_view name, uint64_t seed)
+{
+    uint64_t h = 0xcbf29ce484222325ull ^ (seed * 0x9e3779b97f4a7c15ull);
+    for (size_t i = 0; i < name.size(); ++i)
+        h = (h ^ (unsigned char)name[i]) * 0x100000001b3ull;
+    return h ^ (h >> 32);
+}
+
 struct Commands
 {
-    size_t size;
-    const Command* begin;
+    static constexpr uint16_t NO_COMMAND = 0xffff;
+
+    size_t size = 0;
+    const Command* begin = nullptr;
+
+    // Perfect hash of the command names: each name hashes to its own slot, which holds that command's index.
+    const uint16_t* slots = nullptr;
+    size_t slot_mask = 0;
+    uint64_t seed = 0;
+    // Total bytes the engine's matrix pool has handed out, for the interpreter's profiler.
+    uint64_t (*allocated_bytes)() = nullptr;
+
+    const Command* find(std::string_view name) const
+    {
+        if (slots == nullptr) return nullptr;
+        auto i = slots[command_hash(name, seed) & slot_mask];
+        if (i == NO_COMMAND || begin[i].name != name) return nullptr;
+        return begin + i;
+    }
+};
+
+template<size_t SlotCount>
+struct CommandHashTable
+{
+    std::array<uint16_t, SlotCount> slots;
+    uint64_t seed;
 };
 
-extern "C" Commands __cdecl get_commands();
+// Searches for a seed under which every command name lands in a distinct slot. Evaluated at compile time by the
+// engine, so lookup is one hash, one load and one string compare.
+template<size_t SlotCount, size_t N>
+constexpr CommandHashTable<SlotCount> make_command_hash_table(const Command (&commands)[N])
+{
+    static_assert((SlotCount & (SlotCount - 1)) == 0, "slot count must be a power of two");
+    static_assert(N < SlotCount && N < Commands::NO_COMMAND, "too many commands for the hash table");
+
+    for (size_t i = 0; i < N; ++i)
+        for (size_t j = i + 1; j < N; ++j)
+            if (commands[i].name == commands[j].name) throw std::logic_error("duplicate command name");
+
+    for (uint64_t seed = 0;; ++seed)
+    {
+        CommandHashTable<SlotCount> t = {};
+        for (size_t s = 0; s < SlotCount; ++s)
+            t.slots[s] = Commands::NO_COMMAND;
+        t.seed = seed;
+
+        bool ok = true;
+        for (size_t i = 0; i < N && ok; ++i)
+        {
+            auto s = command_hash(commands[i].name, seed) & (SlotCount - 1);
+            if (t.slots[s] != Commands::NO_COMMAND)
+                ok = false;
+            else
+                t.slots[s] = (uint16_t)i;
+        }
+        if (ok) return t;
+    }
+}
+
+// Eight slots per command keeps the expected seed search to a handful of attempts.
+constexpr size_t command_slot_count(size_t n)
+{
+    size_t slots = 1;
+    while (slots < n * 8)
+        slots *= 2;
+    return slots;
+}
+
+#if defined(_WIN32)
+#define SH_ENGINE_API __cdecl
+#else
+#define SH_ENGINE_API
+#endif
+
+extern "C" Commands SH_ENGINE_API get_commands();
 
 using get_commands_t = decltype(&get_commands);
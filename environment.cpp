@@ -2,22 +2,131 @@
 
 #include "environment.h"
 
-void Environment::auto_display() const
+#include <algorithm>
+
+void Environment::auto_display()
+{
+    if (auto_display_flag) stack.display_top(symbols, display_limit, out);
+}
+
+void Environment::prompt(std::string_view text)
+{
+    if (interactive) fmt::fprintf(out, "%s", text);
+}
+
+std::shared_ptr<Job> Environment::new_job(std::string_view command)
+{
+    jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [](const std::weak_ptr<Job>& j) { return j.expired(); }),
+               jobs.end());
+    auto job = std::make_shared<Job>(next_job_id++, command);
+    jobs.push_back(job);
+    return job;
+}
+
+void Environment::wait_jobs()
+{
+    for (auto&& j : jobs)
+        if (auto job = j.lock()) job->wait();
+}
+
+Value Environment::variable(int symbol)
+{
+    if (auto v = varmap.find(symbol)) return v->clone();
+    if (globals)
+    {
+        auto id = globals->symbols.find(symbols.name(symbol));
+        if (auto v = id >= 0 ? globals->varmap.find(id) : nullptr)
+        {
+            if (v->type() == ValueType::SYMBOL)
+                return {symbols.intern(globals->symbols.name(v->symbol())), Value::symbol_tag};
+            return v->clone();
+        }
+    }
+    throw std::runtime_error(fmt::sprintf("variable not defined: %s", symbols.name(symbol)));
+}
+
+int SymbolTable::intern(std::string_view name)
+{
+    auto it = m_ids.find(name);
+    if (it != m_ids.end()) return it->second;
+    int id = (int)m_names.size();
+    m_names.emplace_back(name);
+    m_ids.emplace(m_names.back(), id);
+    return id;
+}
+
+int SymbolTable::find(std::string_view name) const
+{
+    auto it = m_ids.find(name);
+    return it == m_ids.end() ? -1 : it->second;
+}
+
+void VarMap::set(int symbol, Value v)
 {
-    if (auto_display_flag) stack.display_top();
+    if ((size_t)symbol >= m_slots.size()) m_slots.resize(symbol + 1);
+    if (!m_slots[symbol]) ++m_bound;
+    m_slots[symbol] = std::move(v);
+}
+
+void Job::finish(Value result)
+{
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_result = std::move(result);
+        m_finished = Clock::now();
+        m_done = true;
+    }
+    m_cv.notify_all();
+}
+
+void Job::fail(std::string message)
+{
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_error = std::move(message);
+        m_finished = Clock::now();
+        m_done = true;
+    }
+    m_cv.notify_all();
+}
+
+bool Job::done() const
+{
+    std::lock_guard<std::mutex> lk(m_mutex);
+    return m_done;
+}
+
+void Job::wait() const
+{
+    std::unique_lock<std::mutex> lk(m_mutex);
+    m_cv.wait(lk, [this] { return m_done; });
+}
+
+const Value& Job::result() const
+{
+    wait();
+    // Nothing changes once the job is done, so the result can be read without the lock.
+    if (!m_error.empty()) throw std::runtime_error(fmt::sprintf("&%s failed: %s", command, m_error));
+    return m_result;
+}
+
+Job::Clock::duration Job::elapsed() const
+{
+    std::lock_guard<std::mutex> lk(m_mutex);
+    return (m_done ? m_finished : Clock::now()) - started;
 }
 
 std::string read_line()
 {
     std::string str;
-    auto ch = _fgetchar();
+    auto ch = std::getchar();
     while (ch == '\b' || ch == ' ' || ch == '\n' || ch == '\r' || ch == '\t')
-        ch = _fgetchar();
+        ch = std::getchar();
 
     while (ch > 0 && ch < 256 && ch != '\n' && ch != '\r')
     {
         str += ch;
-        ch = _fgetchar();
+        ch = std::getchar();
     }
 
     if (ch <= 0 || ch >= 256) throw std::runtime_error("unexpected EOF");
@@ -25,34 +134,98 @@ std::string read_line()
     return str;
 }
 
-Value::Value(std::string_view a, Value::SymbolTag) : type(ValueType::SYMBOL), s(a) {}
-Value::Value(std::string_view a, Value::StringTag) : type(ValueType::STRING), s(a) {}
+void Value::destroy_payload()
+{
+    switch (m_type)
+    {
+        case ValueType::STRING: delete m_u.s; break;
+        case ValueType::MATRIX: delete m_u.m; break;
+        case ValueType::EXPRESSION: delete m_u.e; break;
+        case ValueType::FUTURE: delete m_u.f; break;
+        case ValueType::SPARSE: delete m_u.sp; break;
+        default: break;
+    }
+    m_type = ValueType::SCALAR;
+}
+
 Value Value::clone() const
 {
-    switch (type)
+    switch (m_type)
     {
-        case ValueType::SCALAR: return d;
-        case ValueType::MATRIX: return m.clone();
-        case ValueType::SYMBOL: return {s.to_string_view(), Value::symbol_tag};
-        case ValueType::STRING: return {s.to_string_view(), Value::string_tag};
+        case ValueType::SCALAR: return m_u.d;
+        case ValueType::MATRIX: return m_u.m->clone();
+        case ValueType::SYMBOL: return {m_u.sym, Value::symbol_tag};
+        case ValueType::STRING: return {m_u.s->to_string_view(), Value::string_tag};
+        case ValueType::EXPRESSION: return *m_u.e;
+        case ValueType::FUTURE: return *m_u.f;
+        case ValueType::SPARSE: return SparseMatrix(*m_u.sp);
         default: throw std::runtime_error("unknown value type");
     }
 }
 
-void Value::display() const
+void Value::format(fmt::memory_buffer& out, const SymbolTable& symbols, size_t limit, FILE* stream) const
 {
-    switch (type)
+    auto it = std::back_inserter(out);
+    switch (m_type)
     {
-        case ValueType::SCALAR: fmt::printf("= %f\n", d); return;
+        case ValueType::SCALAR: fmt::format_to(it, "= {:f}\n", m_u.d); return;
         case ValueType::MATRIX:
-            fmt::printf("= ");
-            ::display(m);
+            fmt::format_to(it, "= ");
+            format_matrix(out, *m_u.m, limit, 0, stream);
+            return;
+        case ValueType::SYMBOL: fmt::format_to(it, "= ${}\n", symbols.name(m_u.sym)); return;
+        case ValueType::STRING: fmt::format_to(it, "= \"{}\"\n", m_u.s->c_str()); return;
+        case ValueType::EXPRESSION:
+            fmt::format_to(it, "= ");
+            format_matrix(out, (*m_u.e)->evaluate(), limit, 0, stream);
+            return;
+        case ValueType::FUTURE:
+        {
+            // Displaying a value must not block on it, so a job still running shows as pending.
+            auto& job = **m_u.f;
+            if (!job.done())
+                fmt::format_to(it, "= <job {} {}: running>\n", job.id, job.command);
+            else if (!job.error().empty())
+                fmt::format_to(it, "= <job {} {}: failed: {}>\n", job.id, job.command, job.error());
+            else
+                job.result().format(out, symbols, limit, stream);
             return;
-        case ValueType::SYMBOL: fmt::printf("= $%s\n", s.c_str()); return;
-        default: std::terminate();
+        }
+        case ValueType::SPARSE:
+            fmt::format_to(it, "= ");
+            format_sparse(out, *m_u.sp, limit, stream);
+            return;
+        default: throw std::runtime_error("unknown value type");
     }
 }
 
+void Value::display(const SymbolTable& symbols, size_t limit, FILE* stream) const
+{
+    fmt::memory_buffer out;
+    format(out, symbols, limit, stream);
+    std::fwrite(out.data(), 1, out.size(), stream);
+}
+
+void Value::evaluate()
+{
+    if (m_type != ValueType::EXPRESSION) return;
+    *this = (*m_u.e)->evaluate();
+}
+
+void Value::resolve()
+{
+    if (m_type != ValueType::FUTURE) return;
+    auto job = *m_u.f;
+    *this = job->result().clone();
+}
+
+Value& Stack::resolved_top()
+{
+    if (m_stack.size() < 1) throw std::runtime_error("stack underflow");
+    m_stack.back().resolve();
+    return m_stack.back();
+}
+
 Value Stack::pop()
 {
     if (m_stack.size() < 1) throw std::runtime_error("stack underflow");
@@ -61,39 +234,76 @@ Value Stack::pop()
     return ret;
 }
 
-double Stack::pop_double()
+double Stack::pop_resolved_double()
 {
-    if (m_stack.size() < 1) throw std::runtime_error("stack underflow");
-    if (m_stack.back().type != ValueType::SCALAR) throw std::runtime_error("type error: expected number");
-    auto r = m_stack.back().d;
+    if (resolved_top().type() != ValueType::SCALAR) throw std::runtime_error("type error: expected number");
+    auto r = m_stack.back().scalar();
     m_stack.pop_back();
     return r;
 }
 
-CString Stack::pop_symbol()
+int Stack::pop_symbol()
 {
-    if (m_stack.size() < 1) throw std::runtime_error("stack underflow");
-    if (m_stack.back().type != ValueType::SYMBOL) throw std::runtime_error("type error: expected symbol");
-    auto s = std::move(m_stack.back().s);
+    if (resolved_top().type() != ValueType::SYMBOL) throw std::runtime_error("type error: expected symbol");
+    auto s = m_stack.back().symbol();
     m_stack.pop_back();
     return s;
 }
 
 CString Stack::pop_string()
 {
-    if (m_stack.size() < 1) throw std::runtime_error("stack underflow");
-    if (m_stack.back().type != ValueType::STRING) throw std::runtime_error("type error: expected string");
-    auto s = std::move(m_stack.back().s);
+    if (resolved_top().type() != ValueType::STRING) throw std::runtime_error("type error: expected string");
+    auto s = std::move(m_stack.back().string());
     m_stack.pop_back();
     return s;
 }
 
 MatrixData Stack::pop_matrix()
 {
-    if (m_stack.size() < 1) throw std::runtime_error("stack underflow");
-    if (m_stack.back().type != ValueType::MATRIX) throw std::runtime_error("type error: expected matrix");
+    auto& top = resolved_top();
+    top.evaluate();
+    if (top.type() != ValueType::MATRIX) throw std::runtime_error("type error: expected matrix");
+
+    auto r = std::move(top.matrix());
+    m_stack.pop_back();
+    return r;
+}
 
-    auto r = std::move(m_stack.back().m);
+SparseMatrix Stack::pop_sparse()
+{
+    if (resolved_top().type() != ValueType::SPARSE) throw std::runtime_error("type error: expected sparse matrix");
+    auto r = m_stack.back().sparse();
+    m_stack.pop_back();
+    return r;
+}
+
+Value Stack::pop_any_matrix()
+{
+    auto& top = resolved_top();
+    top.evaluate();
+    if (top.type() != ValueType::MATRIX && top.type() != ValueType::SPARSE)
+        throw std::runtime_error("type error: expected matrix");
+    return pop();
+}
+
+const MatrixData& Stack::top_matrix()
+{
+    auto& top = resolved_top();
+    top.evaluate();
+    if (top.type() != ValueType::MATRIX) throw std::runtime_error("type error: expected matrix");
+    return top.matrix();
+}
+
+ElementExpr::Ptr Stack::pop_expression()
+{
+    auto& top = resolved_top();
+    ElementExpr::Ptr r;
+    if (top.type() == ValueType::EXPRESSION)
+        r = std::move(top.expression());
+    else if (top.type() == ValueType::MATRIX)
+        r = ElementExpr::leaf(std::move(top.matrix()));
+    else
+        throw std::runtime_error("type error: expected matrix");
     m_stack.pop_back();
     return r;
 }
@@ -104,24 +314,31 @@ const Value& Stack::at_from_top(int index) const
     return m_stack[m_stack.size() - index - 1];
 }
 
-void Stack::display_top() const
+void Stack::display_top(const SymbolTable& symbols, size_t limit, FILE* stream)
 {
     if (m_stack.empty())
-        fmt::printf("Stack Empty\n");
-    else
-        m_stack.back().display();
+    {
+        fmt::fprintf(stream, "Stack Empty\n");
+        return;
+    }
+    m_stack.back().evaluate();
+    m_stack.back().display(symbols, limit, stream);
 }
-void Stack::display() const
+void Stack::display(const SymbolTable& symbols, size_t limit, FILE* stream)
 {
     if (m_stack.empty())
     {
-        fmt::printf("Stack Empty\n");
+        fmt::fprintf(stream, "Stack Empty\n");
         return;
     }
     int i = m_stack.size();
+    fmt::memory_buffer out;
     for (auto&& k : m_stack)
     {
-        fmt::printf("%d) ", --i);
-        k.display();
+        k.evaluate();
+        out.clear();
+        fmt::format_to(std::back_inserter(out), "{}) ", --i);
+        k.format(out, symbols, limit, stream);
+        std::fwrite(out.data(), 1, out.size(), stream);
     }
 }
@@ -1,9 +1,18 @@
 #pragma once
 
 #include "cstring.h"
+#include "expression.h"
 #include "matrix.h"
+#include "sparse.h"
+#include "thread_pool.h"
 
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <unordered_map>
@@ -12,14 +21,35 @@
 // TODO: move to another file
 std::string read_line();
 
+// Interns names to small dense ids, so symbols carry an id and variables live in a slot vector indexed by it.
+struct SymbolTable
+{
+    int intern(std::string_view name);
+    // The id of an already interned name, or -1.
+    int find(std::string_view name) const;
+    const std::string& name(int id) const { return m_names[id]; }
+    int size() const { return (int)m_names.size(); }
+
+private:
+    std::deque<std::string> m_names;
+    std::unordered_map<std::string_view, int> m_ids;
+};
+
 enum class ValueType
 {
     SCALAR,
     MATRIX,
     SYMBOL,
     STRING,
+    EXPRESSION,
+    FUTURE,
+    SPARSE,
 };
 
+struct Job;
+
+// A tagged union: scalars and symbols are stored inline; strings, matrices, expressions, futures and sparse matrices
+// behind one owning pointer. Moving a Value copies 16 bytes, so scalar pushes and pops never touch the heap.
 struct Value
 {
     struct SymbolTag
@@ -32,18 +62,106 @@ struct Value
     };
     static constexpr StringTag string_tag = {};
 
-    Value(double a) : type(ValueType::SCALAR), d(a) {}
-    Value(std::string_view a, SymbolTag);
-    Value(std::string_view a, StringTag);
-    Value(MatrixData&& a) : type(ValueType::MATRIX), m(std::move(a)) {}
+    Value(double a) : m_type(ValueType::SCALAR) { m_u.d = a; }
+    Value(int symbol, SymbolTag) : m_type(ValueType::SYMBOL) { m_u.sym = symbol; }
+    Value(std::string_view a, StringTag) : m_type(ValueType::STRING) { m_u.s = new CString(a); }
+    Value(MatrixData&& a) : m_type(ValueType::MATRIX) { m_u.m = new MatrixData(std::move(a)); }
+    Value(ElementExpr::Ptr a) : m_type(ValueType::EXPRESSION) { m_u.e = new ElementExpr::Ptr(std::move(a)); }
+    Value(std::shared_ptr<Job> a) : m_type(ValueType::FUTURE) { m_u.f = new std::shared_ptr<Job>(std::move(a)); }
+    Value(SparseMatrix&& a) : m_type(ValueType::SPARSE) { m_u.sp = new SparseMatrix(std::move(a)); }
+
+    Value(Value&& o) noexcept : m_type(o.m_type), m_u(o.m_u) { o.m_type = ValueType::SCALAR; }
+    Value& operator=(Value&& o) noexcept
+    {
+        if (this != &o)
+        {
+            destroy();
+            m_type = o.m_type;
+            m_u = o.m_u;
+            o.m_type = ValueType::SCALAR;
+        }
+        return *this;
+    }
+    ~Value() { destroy(); }
 
     Value clone() const;
-    void display() const;
+    // Appends "= <value>\n" to `out`; see format_matrix for `limit` and `stream`.
+    void format(fmt::memory_buffer& out, const SymbolTable& symbols, size_t limit, FILE* stream = nullptr) const;
+    // Formats into one buffer and writes it to `stream`; a limit of 0 shows matrices in full.
+    void display(const SymbolTable& symbols, size_t limit, FILE* stream) const;
+    // Replaces a deferred expression with its value.
+    void evaluate();
+    // Replaces a future with its job's result, waiting for the job if it is still running.
+    void resolve();
+
+    ValueType type() const { return m_type; }
+    // The accessors below require type() to match.
+    double scalar() const { return m_u.d; }
+    int symbol() const { return m_u.sym; }
+    const CString& string() const { return *m_u.s; }
+    CString& string() { return *m_u.s; }
+    const MatrixData& matrix() const { return *m_u.m; }
+    MatrixData& matrix() { return *m_u.m; }
+    const ElementExpr::Ptr& expression() const { return *m_u.e; }
+    ElementExpr::Ptr& expression() { return *m_u.e; }
+    const std::shared_ptr<Job>& future() const { return *m_u.f; }
+    const SparseMatrix& sparse() const { return *m_u.sp; }
+
+private:
+    void destroy()
+    {
+        if (m_type != ValueType::SCALAR && m_type != ValueType::SYMBOL) destroy_payload();
+    }
+    void destroy_payload();
+
+    ValueType m_type;
+    union
+    {
+        double d;
+        int sym;
+        CString* s;
+        MatrixData* m;
+        ElementExpr::Ptr* e;
+        std::shared_ptr<Job>* f;
+        SparseMatrix* sp;
+    } m_u;
+};
+
+static_assert(sizeof(Value) == 16, "Value should stay two words");
+
+// A command running on a background thread, started with the & prefix. The FUTURE values that refer to it share it;
+// popping one as an argument waits for the result.
+struct Job
+{
+    using Clock = std::chrono::steady_clock;
+
+    Job(int id, std::string_view command) : id(id), command(command), started(Clock::now()) {}
+
+    const int id;
+    const std::string command;
+    const Clock::time_point started;
 
-    ValueType type;
-    double d;
-    CString s;
-    MatrixData m;
+    // Called once, by the thread running the command.
+    void finish(Value result);
+    void fail(std::string message);
+
+    bool done() const;
+    // Blocks until the command has finished.
+    void wait() const;
+    // The command's result once it has finished; rethrows its error if it failed.
+    const Value& result() const;
+    // Only meaningful once done: empty if the command succeeded.
+    const std::string& error() const { return m_error; }
+    // Run time so far, or in total once done.
+    Clock::duration elapsed() const;
+
+private:
+    mutable std::mutex m_mutex;
+    mutable std::condition_variable m_cv;
+    bool m_done = false;
+    Value m_result = 0.0;
+    std::string m_error;
+    Clock::time_point m_finished;
 };
 
 struct Stack
@@ -55,32 +173,117 @@ struct Stack
     }
 
     Value pop();
-    double pop_double();
-    CString pop_symbol();
+    // Scalars are never deferred or futures, so the common case is inline and skips resolved_top.
+    double pop_double()
+    {
+        if (m_stack.empty() || m_stack.back().type() != ValueType::SCALAR) return pop_resolved_double();
+        auto r = m_stack.back().scalar();
+        m_stack.pop_back();
+        return r;
+    }
+    int pop_symbol();
     CString pop_string();
     MatrixData pop_matrix();
+    SparseMatrix pop_sparse();
+    // Pops a dense or sparse matrix, evaluating it if it is deferred, for commands that take either.
+    Value pop_any_matrix();
+    // The matrix on top of the stack, evaluated if it is deferred, without popping it.
+    const MatrixData& top_matrix();
+    // Pops a matrix or deferred expression as an expression, without evaluating it.
+    ElementExpr::Ptr pop_expression();
 
     void clear() { m_stack.clear(); }
     const Value& at_from_top(int index) const;
     int size() const { return m_stack.size(); }
 
-    void display_top() const;
-    void display() const;
+    void display_top(const SymbolTable& symbols, size_t limit, FILE* stream);
+    void display(const SymbolTable& symbols, size_t limit, FILE* stream);
 
 private:
+    // The top value with any future resolved, for the typed pops.
+    Value& resolved_top();
+    double pop_resolved_double();
+
     std::vector<Value> m_stack;
 };
 
-using VarMap = std::unordered_map<std::string, Value>;
+// Variable bindings, indexed by symbol id.
+struct VarMap
+{
+    // nullptr when the symbol is unbound.
+    const Value* find(int symbol) const
+    {
+        return (size_t)symbol < m_slots.size() && m_slots[symbol] ? &*m_slots[symbol] : nullptr;
+    }
+    void set(int symbol, Value v);
+    size_t size() const { return m_bound; }
+
+    template<class F>
+    void for_each(F&& f) const
+    {
+        for (size_t i = 0; i < m_slots.size(); ++i)
+            if (m_slots[i]) f((int)i, *m_slots[i]);
+    }
+
+private:
+    std::vector<std::optional<Value>> m_slots;
+    size_t m_bound = 0;
+};
 
 struct Environment
 {
+    explicit Environment(unsigned threads = std::thread::hardware_concurrency())
+        : m_own_pool(std::make_unique<ThreadPool>(threads))
+        , pool(*m_own_pool)
+    {
+    }
+    // The environment a background job runs its command in, which shares its session's pool.
+    explicit Environment(ThreadPool& shared_pool) : pool(shared_pool) {}
+    ~Environment() { wait_jobs(); }
+
+private:
+    std::unique_ptr<ThreadPool> m_own_pool;
+
+public:
     Stack stack;
+    SymbolTable symbols;
     VarMap varmap;
+    ThreadPool& pool;
 
     bool auto_display_flag = true;
+    // Matrices with more elements than this are displayed as a summary; 0 displays everything.
+    size_t display_limit = 1000;
+    // Cleared in batch mode, which prints no prompts.
+    bool interactive = true;
+    // When set, element-wise commands push deferred expressions instead of evaluating.
+    bool lazy_flag = false;
+    // When set, sum, mean and norm use compensated summation.
+    bool compensated_flag = false;
+    // Where commands print; a server session points this at its connection.
+    FILE* out = stdout;
+    // Read-only variables shared by every session of a server, consulted for names that are not bound here.
+    const Environment* globals = nullptr;
+    // Run by the exit command in place of ending the process, when set.
+    std::function<void()> on_exit;
+    // Background jobs started from this environment, for as long as a future still refers to them.
+    std::vector<std::weak_ptr<Job>> jobs;
+    int next_job_id = 1;
+
+    std::shared_ptr<Job> new_job(std::string_view command);
+    // Blocks until every background job has finished. Called before anything the jobs depend on changes: the thread
+    // pool, the engine, or the process itself.
+    void wait_jobs();
+
+    void auto_display();
+    void prompt(std::string_view text);
+    // Reads an argument such as a file name: from line_source when one is set (batch mode takes the next token of
+    // the script), otherwise from the console.
+    std::string read_line() { return line_source ? line_source() : ::read_line(); }
 
-    void auto_display() const;
+    std::function<std::string()> line_source;
+    // A copy of the value bound to `symbol`, here or in `globals`; throws if there is none. A symbol-valued global is
+    // interned in this environment's table, since symbol ids differ between tables.
+    Value variable(int symbol);
 };
 
 struct Command
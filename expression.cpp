@@ -0,0 +1,138 @@
+#include "pch.h"
+
+#include "expression.h"
+
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+
+// Elements per evaluation block; every live block of a tree stays resident in L1.
+static constexpr size_t EXPR_BLOCK = 256;
+
+ElementExpr::Ptr ElementExpr::leaf(MatrixData m)
+{
+    auto ret = std::make_shared<ElementExpr>();
+    ret->op = Op::LEAF;
+    ret->m = m.contiguous();
+    ret->type = ret->m.element_type();
+    return ret;
+}
+
+// `e` itself, or its value as a leaf when a node built on it would be deeper than MAX_DEPTH.
+static ElementExpr::Ptr shallow_operand(ElementExpr::Ptr e)
+{
+    if (e->depth < ElementExpr::MAX_DEPTH) return e;
+    return ElementExpr::leaf(e->evaluate());
+}
+
+ElementExpr::Ptr ElementExpr::scalar_op(Op op, Ptr arg, double d)
+{
+    auto ret = std::make_shared<ElementExpr>();
+    ret->op = op;
+    ret->scalar = d;
+    ret->lhs = shallow_operand(std::move(arg));
+    ret->depth = ret->lhs->depth + 1;
+    ret->type = ret->lhs->type;
+    return ret;
+}
+
+ElementExpr::Ptr ElementExpr::add(Ptr lhs, Ptr rhs)
+{
+    if (lhs->size() != rhs->size()) throw std::runtime_error("matricies do not have equal extents");
+    auto ret = std::make_shared<ElementExpr>();
+    ret->op = Op::ADD;
+    ret->lhs = shallow_operand(std::move(lhs));
+    ret->rhs = shallow_operand(std::move(rhs));
+    ret->depth = std::max(ret->lhs->depth, ret->rhs->depth) + 1;
+    ret->type = common_type(ret->lhs->type, ret->rhs->type);
+    return ret;
+}
+
+const MatrixExtents& ElementExpr::extents() const { return op == Op::LEAF ? m.extents() : lhs->extents(); }
+size_t ElementExpr::size() const { return op == Op::LEAF ? m.size() : lhs->size(); }
+ElementType ElementExpr::element_type() const { return type; }
+
+MatrixData ElementExpr::evaluate() const
+{
+    if (op == Op::LEAF) return m.contiguous();
+
+    MatrixData ret(extents(), type);
+    size_t n = size();
+    dispatch_element_type(type, [&](auto zero) {
+        auto out = ret.mutable_data_as<decltype(zero)>();
+        for (size_t begin = 0; begin < n; begin += EXPR_BLOCK)
+            eval_block(begin, std::min(EXPR_BLOCK, n - begin), out + begin);
+    });
+    return ret;
+}
+
+// Adds elements [begin, begin + n) of the leaf `m` to out.
+template<class T>
+static void add_leaf(const MatrixData& m, size_t begin, size_t n, T* out)
+{
+    dispatch_element_type(m.element_type(), [&](auto zero) {
+        auto r = m.data_as<decltype(zero)>() + begin;
+        for (size_t i = 0; i < n; ++i)
+            out[i] += r[i];
+    });
+}
+
+template<class T>
+void ElementExpr::eval_operand(const ElementExpr& e, size_t begin, size_t n, T* out)
+{
+    if (std::is_same<T, float>::value || e.type == ElementType::F64 || e.op == Op::LEAF)
+    {
+        e.eval_block(begin, n, out);
+        return;
+    }
+
+    // An F32 operand of an F64 node: computed in float, as the eager command would have, then widened.
+    float tmp[EXPR_BLOCK];
+    e.eval_block(begin, n, tmp);
+    std::copy(tmp, tmp + n, out);
+}
+
+template<class T>
+void ElementExpr::eval_block(size_t begin, size_t n, T* out) const
+{
+    auto s = (T)scalar;
+    switch (op)
+    {
+        case Op::LEAF:
+            dispatch_element_type(m.element_type(), [&](auto zero) {
+                auto p = m.data_as<decltype(zero)>() + begin;
+                std::copy(p, p + n, out);
+            });
+            return;
+        case Op::ADD_SCALAR:
+            eval_operand(*lhs, begin, n, out);
+            for (size_t i = 0; i < n; ++i)
+                out[i] += s;
+            return;
+        case Op::MUL_SCALAR:
+            eval_operand(*lhs, begin, n, out);
+            for (size_t i = 0; i < n; ++i)
+                out[i] *= s;
+            return;
+        case Op::POW_SCALAR:
+            eval_operand(*lhs, begin, n, out);
+            for (size_t i = 0; i < n; ++i)
+                out[i] = (T)std::pow(out[i], s);
+            return;
+        case Op::ADD:
+            eval_operand(*lhs, begin, n, out);
+            if (rhs->op == Op::LEAF)
+            {
+                add_leaf(rhs->m, begin, n, out);
+            }
+            else
+            {
+                T tmp[EXPR_BLOCK];
+                eval_operand(*rhs, begin, n, tmp);
+                for (size_t i = 0; i < n; ++i)
+                    out[i] += tmp[i];
+            }
+            return;
+        default: throw std::runtime_error("unknown expression op");
+    }
+}
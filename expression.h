@@ -0,0 +1,56 @@
+#pragma once
+
+#include "matrix.h"
+
+#include <memory>
+
+// A deferred element-wise computation over one or more matrices. Leaves hold dense matrices and interior nodes combine
+// their operands element by element, so a chain such as `m* m+ m+m` becomes a tree that evaluate() computes in one
+// pass over the output, a cache-sized block at a time, instead of allocating and writing a matrix per step. Each node
+// computes in its own element type, F32 only when every leaf below it is, with the same arithmetic as the eager
+// commands, so a lazy chain gives the same result as running it eagerly.
+//
+// Evaluation recurses once per level with a block of stack per binary node, so trees are kept shallow: an operand that
+// is already MAX_DEPTH levels deep is evaluated into a leaf before a node is built on it.
+struct ElementExpr
+{
+    enum class Op
+    {
+        LEAF,
+        ADD_SCALAR,
+        MUL_SCALAR,
+        POW_SCALAR,
+        ADD,
+    };
+
+    using Ptr = std::shared_ptr<const ElementExpr>;
+
+    static constexpr int MAX_DEPTH = 32;
+
+    static Ptr leaf(MatrixData m);
+    static Ptr scalar_op(Op op, Ptr arg, double d);
+    static Ptr add(Ptr lhs, Ptr rhs);
+
+    const MatrixExtents& extents() const;
+    size_t size() const;
+    ElementType element_type() const;
+
+    MatrixData evaluate() const;
+
+    Op op;
+    double scalar = 0.0;
+    Ptr lhs;
+    Ptr rhs;
+    MatrixData m;
+    // Levels of nodes below and including this one; a leaf is 1.
+    int depth = 1;
+    ElementType type = ElementType::F64;
+
+private:
+    // Computes elements [begin, begin + n) into `out`; T is this node's element type.
+    template<class T>
+    void eval_block(size_t begin, size_t n, T* out) const;
+    // The same for an operand, converting to the caller's type T when the operand's differs.
+    template<class T>
+    static void eval_operand(const ElementExpr& e, size_t begin, size_t n, T* out);
+};
@@ -0,0 +1,592 @@
+#include "pch.h"
+
+#include "interpreter.h"
+#include "mapped_file.h"
+#include "tokenizer.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#if !defined(_WIN32)
+#include <dlfcn.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64)
+#if defined(_MSC_VER)
+#include <immintrin.h>
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+using namespace std::string_view_literals;
+
+// Engine builds, widest first.
+static constexpr std::string_view ENGINE_VARIANTS[] = {"avx512"sv, "avx2"sv, "generic"sv};
+
+#if defined(__x86_64__) || defined(_M_X64)
+static void cpuid(unsigned leaf, unsigned regs[4])
+{
+#if defined(_MSC_VER)
+    __cpuidex((int*)regs, (int)leaf, 0);
+#else
+    __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// The register state the OS saves on context switches (XCR0).
+static uint64_t saved_register_state()
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned lo, hi;
+    __asm__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((uint64_t)hi << 32) | lo;
+#endif
+}
+
+// Whether a build can run here. An instruction set counts only if the OS also saves its registers, which cpuid alone
+// does not say: AVX needs the YMM state enabled in XCR0, and AVX-512 the opmask and ZMM state as well.
+static bool cpu_supports(std::string_view variant)
+{
+    if (variant == "generic") return true;
+
+    unsigned regs[4];
+    cpuid(0, regs);
+    if (regs[0] < 7) return false;
+    cpuid(1, regs);
+    bool osxsave = regs[2] & (1u << 27);
+    bool avx = regs[2] & (1u << 28);
+    bool fma = regs[2] & (1u << 12);
+    if (!osxsave || !avx || !fma) return false;
+    uint64_t xcr0 = saved_register_state();
+    if ((xcr0 & 0x6) != 0x6) return false;
+
+    cpuid(7, regs);
+    bool avx2 = regs[1] & (1u << 5);
+    if (variant == "avx2") return avx2;
+
+    // F, DQ, BW and VL: the subset every AVX-512 part since Skylake-SP has.
+    const unsigned avx512 = (1u << 16) | (1u << 17) | (1u << 30) | (1u << 31);
+    return variant == "avx512" && avx2 && (regs[1] & avx512) == avx512 && (xcr0 & 0xe6) == 0xe6;
+}
+#else
+static bool cpu_supports(std::string_view variant) { return variant == "generic"; }
+#endif
+
+// sh-engine for the baseline build, sh-engine-<variant> for the others.
+static std::string engine_library_name(std::string_view variant)
+{
+    if (variant.empty() || variant == "generic") return "sh-engine";
+    return fmt::format("sh-engine-{}", variant);
+}
+
+static bool engine_installed(std::string_view variant);
+
+std::string_view Engine::choose_variant() const
+{
+#if !defined(_WIN32)
+    if (std::getenv("SH_ENGINE")) return "$SH_ENGINE"sv;
+#endif
+    std::string_view requested = variant;
+    auto env = std::getenv("SH_ENGINE_VARIANT");
+    if (requested.empty() && env) requested = env;
+    if (!requested.empty())
+    {
+        for (auto v : ENGINE_VARIANTS)
+        {
+            if (v != requested) continue;
+            if (!cpu_supports(v))
+                throw std::runtime_error(fmt::format("This CPU cannot run the {} engine.", requested));
+            return v;
+        }
+        throw std::runtime_error(
+            fmt::format("Unknown engine variant {}; expected avx512, avx2 or generic.", requested));
+    }
+    for (auto v : ENGINE_VARIANTS)
+        if (cpu_supports(v) && engine_installed(v)) return v;
+    // Let loading the baseline build report what is missing.
+    return "generic"sv;
+}
+
+#if defined(_WIN32)
+static std::wstring engine_module_name(std::string_view variant)
+{
+    auto name = engine_library_name(variant);
+    return std::wstring(name.begin(), name.end());
+}
+
+static bool engine_installed(std::string_view variant)
+{
+    auto dll = LoadLibraryW(engine_module_name(variant).c_str());
+    if (dll != NULL) FreeLibrary(dll);
+    return dll != NULL;
+}
+
+Engine::Module Engine::open_module(std::string_view variant, Commands& out) const
+{
+    auto dll = LoadLibraryW(engine_module_name(variant).c_str());
+    if (dll == NULL)
+        throw std::runtime_error(fmt::format("Failed to load engine DLL {}.", engine_library_name(variant)));
+    get_commands_t get_commands_proc = (get_commands_t)GetProcAddress(dll, "get_commands");
+    if (!get_commands_proc)
+    {
+        FreeLibrary(dll);
+        throw std::runtime_error("Failed to load commands from engine DLL.");
+    }
+    out = get_commands_proc();
+    return dll;
+}
+
+void Engine::watch() { throw std::runtime_error("Watching the engine is not supported on this platform."); }
+
+bool Engine::poll_reload() { return false; }
+
+Engine::~Engine() {}
+#else
+// $SH_ENGINE, or the variant's library next to the executable.
+static fs::path engine_path(std::string_view variant)
+{
+    if (auto env = std::getenv("SH_ENGINE")) return env;
+    return fs::read_symlink("/proc/self/exe").parent_path() / fmt::format("lib{}.so", engine_library_name(variant));
+}
+
+static bool engine_installed(std::string_view variant) { return fs::exists(engine_path(variant)); }
+
+Engine::Module Engine::open_module(std::string_view variant, Commands& out) const
+{
+    static std::atomic<unsigned> copies{0};
+    auto source = engine_path(variant);
+    auto copy = fs::temp_directory_path() / fmt::format("sh-engine-{}-{}.so", getpid(), copies++);
+    std::error_code ec;
+    if (!fs::copy_file(source, copy, fs::copy_options::overwrite_existing, ec))
+        throw std::runtime_error(fmt::format("Failed to copy engine library {}: {}", source.string(), ec.message()));
+
+    void* dll = dlopen(copy.c_str(), RTLD_NOW | RTLD_LOCAL);
+    // The mapping keeps the library alive; the copy itself is no longer needed.
+    fs::remove(copy, ec);
+    if (!dll) throw std::runtime_error(fmt::format("Failed to load engine library: {}", dlerror()));
+
+    auto get_commands_proc = (get_commands_t)dlsym(dll, "get_commands");
+    if (!get_commands_proc)
+    {
+        dlclose(dll);
+        throw std::runtime_error("Failed to load commands from engine library.");
+    }
+    out = get_commands_proc();
+    return dll;
+}
+
+void Engine::watch()
+{
+    if (m_watch_fd >= 0) return;
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) throw std::runtime_error("inotify_init1 failed");
+    // Watch the directory rather than the file: builds often replace the library with a new file.
+    auto dir = engine_path(loaded_variant).parent_path();
+    if (inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)
+    {
+        close(fd);
+        throw std::runtime_error(fmt::format("Failed to watch {}", dir.string()));
+    }
+    m_watch_fd = fd;
+}
+
+bool Engine::poll_reload()
+{
+    if (m_watch_fd < 0) return false;
+
+    // Drain every pending event; a build usually produces several for one library.
+    auto name = engine_path(loaded_variant).filename().string();
+    bool changed = false;
+    alignas(inotify_event) char buf[4096];
+    ssize_t n;
+    while ((n = read(m_watch_fd, buf, sizeof(buf))) > 0)
+    {
+        for (char* p = buf; p < buf + n;)
+        {
+            auto ev = (const inotify_event*)p;
+            if (ev->len && name == ev->name) changed = true;
+            p += sizeof(inotify_event) + ev->len;
+        }
+    }
+    if (!changed) return false;
+
+    auto start = std::chrono::steady_clock::now();
+    Commands next;
+    Module next_dll;
+    try
+    {
+        next_dll = open_module(loaded_variant, next);
+    }
+    catch (const std::exception& e)
+    {
+        fmt::printf("Engine reload failed, keeping the current engine: %s\n", e.what());
+        return false;
+    }
+    if (dll) m_retired.push_back(dll);
+    dll = next_dll;
+    commands = next;
+    fingerprint = command_fingerprint(commands);
+    auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    fmt::printf("Reloaded engine in %.2f ms (%zu commands).\n", ms, commands.size);
+    return true;
+}
+
+Engine::~Engine()
+{
+    if (m_watch_fd >= 0) close(m_watch_fd);
+}
+#endif
+
+void Engine::load()
+{
+    if (dll) throw std::runtime_error("Engine is already loaded.");
+    auto chosen = choose_variant();
+    dll = open_module(chosen, commands);
+    loaded_variant = chosen;
+    fingerprint = command_fingerprint(commands);
+}
+void Engine::unload()
+{
+    if (!dll) throw std::runtime_error("Engine is not loaded.");
+    commands = {};
+    fingerprint = command_fingerprint(commands);
+    // Retired rather than closed: the stack and variables may still hold values this engine created.
+    m_retired.push_back(dll);
+    dll = nullptr;
+}
+
+uint64_t Interpreter::allocated_bytes() const
+{
+    auto bytes = MatrixPool::global().stats().allocated_bytes;
+    if (m_engine->commands.allocated_bytes) bytes += (*m_engine->commands.allocated_bytes)();
+    return bytes;
+}
+
+Interpreter::Sample Interpreter::begin_sample() const { return {Profiler::Clock::now(), allocated_bytes()}; }
+
+void Interpreter::end_sample(std::string_view label, const Sample& sample)
+{
+    auto elapsed = Profiler::Clock::now() - sample.start;
+    // `0 profile` stops profiling from inside its own run; leave it out, as `1 profile` is.
+    if (!m_profiler.enabled()) return;
+    // Loading or unloading the engine swaps the counter being read, so the difference may run backwards.
+    auto bytes = allocated_bytes();
+    m_profiler.record(label, elapsed, bytes > sample.bytes ? bytes - sample.bytes : 0);
+}
+
+// Runs `f`, which returns the label its run is recorded under. The sampling is kept out of line so that, with
+// profiling off, this inlines to a branch around `f`.
+template<typename F>
+void Interpreter::profiled(F&& f)
+{
+    if (!m_profiler.enabled())
+    {
+        f();
+        return;
+    }
+    auto sample = begin_sample();
+    std::string_view label = f();
+    end_sample(label, sample);
+}
+
+// The number of values a command pops, read from its signature "name :: inputs -> outputs", or -1 unless it pops a
+// fixed number and pushes exactly one. Commands that take symbols are refused too: those name session variables,
+// which a background job cannot see.
+static int background_arity(std::string_view signature)
+{
+    auto colons = signature.find("::");
+    auto arrow = signature.find("->");
+    if (colons == std::string_view::npos || arrow == std::string_view::npos || arrow < colons) return -1;
+
+    int inputs = 0;
+    Tokenizer in(signature.substr(colons + 2, arrow - colons - 2));
+    std::string_view token;
+    while (in.next(token))
+    {
+        if (token[0] == 'y' || token.find("...") != std::string_view::npos) return -1;
+        ++inputs;
+    }
+
+    int outputs = 0;
+    Tokenizer out(signature.substr(arrow + 2));
+    while (out.next(token))
+    {
+        if (token == "*" || token.find("...") != std::string_view::npos) return -1;
+        ++outputs;
+    }
+    return outputs == 1 ? inputs : -1;
+}
+
+void Interpreter::start_job(std::string_view name)
+{
+    auto command = m_engine->commands.find(name);
+    if (!command)
+        throw std::runtime_error(fmt::sprintf("Input not recognized: %s. Use 'help' for command list.\n", name));
+    int arity = background_arity(command->signature);
+    if (arity < 0)
+        throw std::runtime_error(
+            fmt::sprintf("%s cannot run in the background: it must take a fixed number of values and push one.", name));
+    if (m_env.stack.size() < arity) throw std::runtime_error("stack underflow");
+
+    // Futures among the arguments are passed on unresolved, so a job that depends on another waits on its own thread.
+    std::vector<Value> args;
+    args.reserve(arity);
+    for (int i = 0; i < arity; ++i)
+        args.push_back(m_env.stack.pop());
+    std::reverse(args.begin(), args.end());
+
+    auto job = m_env.new_job(name);
+    std::thread([job,
+                 args = std::move(args),
+                 function = command->function,
+                 &pool = m_env.pool,
+                 out = m_env.out,
+                 compensated = m_env.compensated_flag]() mutable {
+        Environment env(pool);
+        env.auto_display_flag = false;
+        env.interactive = false;
+        env.out = out;
+        env.compensated_flag = compensated;
+        try
+        {
+            for (auto&& a : args)
+                env.stack.push(std::move(a));
+            (*function)(env);
+            auto result = env.stack.pop();
+            // Lazy mode is off here, but an argument may have been a deferred expression passed through.
+            result.evaluate();
+            job->finish(std::move(result));
+        }
+        catch (const std::exception& e)
+        {
+            job->fail(e.what());
+        }
+    }).detach();
+
+    m_env.stack.push(std::move(job));
+    m_env.auto_display();
+}
+
+void Interpreter::handle_command(std::string_view sv)
+{
+    profiled([&]() { return execute(sv); });
+}
+
+std::string_view Interpreter::execute(std::string_view sv)
+{
+    auto t = classify_token(sv);
+    switch (t.kind)
+    {
+        case TokenKind::NUMBER:
+            m_env.stack.push(t.number);
+            m_env.auto_display();
+            return "<number>"sv;
+        case TokenKind::SYMBOL:
+            m_env.stack.push(m_env.symbols.intern(t.text), Value::symbol_tag);
+            m_env.auto_display();
+            return "<symbol>"sv;
+        case TokenKind::VARIABLE:
+            m_env.stack.push(m_env.variable(m_env.symbols.intern(t.text)));
+            m_env.auto_display();
+            return "$variable"sv;
+        case TokenKind::STACK_COPY:
+            m_env.stack.push(m_env.stack.at_from_top(t.index).clone());
+            m_env.auto_display();
+            return "@copy"sv;
+        case TokenKind::STRING: m_env.stack.push(t.text, Value::string_tag); return "<string>"sv;
+        case TokenKind::WORD: break;
+    }
+
+    if (sv.size() > 1 && sv[0] == '&')
+    {
+        start_job(sv.substr(1));
+    }
+    else if (sv == "load-engine" || sv == "unload-engine")
+    {
+        if (m_shared_engine) throw std::runtime_error("The engine is shared with other sessions.");
+        // Running jobs call into the engine's code.
+        m_env.wait_jobs();
+        if (sv == "load-engine")
+            m_engine->load();
+        else
+            m_engine->unload();
+    }
+    else if (sv == "load-file")
+    {
+        m_env.prompt("Filename>");
+
+        std::string filename = m_env.read_line();
+
+        auto p = fs::absolute(filename);
+        load_file(p);
+
+        fmt::fprintf(m_env.out, "Loaded file \"%s\".\n", p.u8string());
+    }
+    else if (sv == "profile")
+    {
+        bool enable = m_env.stack.pop_double() != 0.0;
+        if (!enable && m_profiler.enabled()) fmt::fprintf(m_env.out, "%s", m_profiler.table());
+        m_profiler.set_enabled(enable);
+    }
+    else if (sv == "profile-reset")
+    {
+        m_profiler.reset();
+    }
+    else if (sv == "profile-dump")
+    {
+        fmt::fprintf(m_env.out, "%s", m_profiler.json());
+        std::fflush(m_env.out);
+    }
+    else if (auto command = m_engine->commands.find(sv))
+    {
+        (*command->function)(m_env);
+    }
+    else
+    {
+        throw std::runtime_error(fmt::sprintf("Input not recognized: %s. Use 'help' for command list.\n", sv));
+    }
+    return sv;
+}
+
+void Interpreter::load_file(const fs::path& p)
+{
+    auto in_file = MappedFile::open(p);
+    auto source_hash = hash_bytes(in_file->data(), in_file->size());
+    auto cache = compiled_cache_path(p);
+
+    CompiledScript script;
+    if (!load_compiled(cache, source_hash, m_engine->fingerprint, script))
+    {
+        script = compile_script({in_file->data(), in_file->size()}, m_engine->commands);
+        try
+        {
+            save_compiled(cache, source_hash, script);
+        }
+        catch (const std::exception&)
+        {
+            // A read-only script directory only costs us the cache.
+        }
+    }
+    in_file.reset();
+
+    auto old_flag = m_env.auto_display_flag;
+    m_env.auto_display_flag = false;
+
+    try
+    {
+        run(script);
+    }
+    catch (...)
+    {
+        m_env.auto_display_flag = old_flag;
+        throw;
+    }
+
+    m_env.auto_display_flag = old_flag;
+}
+
+void Interpreter::run(const CompiledScript& script)
+{
+    // CALL indices are only meaningful against the command table the script was compiled for; a script that reloads
+    // the engine falls back to looking commands up by name.
+    bool resolved = script.command_fingerprint == m_engine->fingerprint;
+    std::vector<int> symbols;
+    symbols.reserve(script.symbols.size());
+    for (auto&& name : script.symbols)
+        symbols.push_back(m_env.symbols.intern(name));
+
+    for (auto&& insn : script.code)
+    {
+        switch (insn.op)
+        {
+            case OpCode::PUSH_NUMBER:
+                profiled([&]() {
+                    m_env.stack.push(script.numbers[insn.arg]);
+                    m_env.auto_display();
+                    return "<number>"sv;
+                });
+                break;
+            case OpCode::PUSH_SYMBOL:
+                profiled([&]() {
+                    m_env.stack.push(symbols[insn.arg], Value::symbol_tag);
+                    m_env.auto_display();
+                    return "<symbol>"sv;
+                });
+                break;
+            case OpCode::PUSH_STRING:
+                profiled([&]() {
+                    m_env.stack.push(script.strings[insn.arg], Value::string_tag);
+                    return "<string>"sv;
+                });
+                break;
+            case OpCode::LOAD_VARIABLE:
+                profiled([&]() {
+                    m_env.stack.push(m_env.variable(symbols[insn.arg]));
+                    m_env.auto_display();
+                    return "$variable"sv;
+                });
+                break;
+            case OpCode::PUSH_STACK_COPY:
+                profiled([&]() {
+                    m_env.stack.push(m_env.stack.at_from_top(insn.arg).clone());
+                    m_env.auto_display();
+                    return "@copy"sv;
+                });
+                break;
+            case OpCode::CALL:
+                if (resolved)
+                    profiled([&]() {
+                        (*m_engine->commands.begin[insn.arg].function)(m_env);
+                        return std::string_view(script.command_names[insn.arg]);
+                    });
+                else
+                    handle_command(script.command_names[insn.arg]);
+                break;
+            case OpCode::WORD:
+                handle_command(script.strings[insn.arg]);
+                resolved = script.command_fingerprint == m_engine->fingerprint;
+                break;
+        }
+    }
+}
+
+void Interpreter::run_batch(std::string_view source)
+{
+    Tokenizer in(source);
+    auto old_flag = m_env.auto_display_flag;
+    m_env.auto_display_flag = false;
+    m_env.interactive = false;
+    m_env.line_source = [&in]() {
+        std::string_view token;
+        if (!in.next(token)) throw std::runtime_error("unexpected end of input");
+        return std::string(token);
+    };
+
+    try
+    {
+        std::string_view token;
+        while (in.next(token))
+        {
+            poll_engine();
+            handle_command(token);
+        }
+    }
+    catch (...)
+    {
+        m_env.line_source = nullptr;
+        m_env.interactive = true;
+        m_env.auto_display_flag = old_flag;
+        throw;
+    }
+
+    m_env.line_source = nullptr;
+    m_env.interactive = true;
+    m_env.auto_display_flag = old_flag;
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "bytecode.h"
+#include "engine.h"
+#include "environment.h"
+#include "profile.h"
+
+#include <filesystem>
+
+// The engine library and the command table it exports. On POSIX the library is opened from a private temporary copy,
+// so a rebuilt engine at the same path loads as a new library instead of returning the already-open handle. Engines
+// replaced by a reload or unloaded stay loaded, since values their commands created may still refer to their code.
+//
+// The engine is built once per instruction set, from the same sources: sh-engine for baseline x86-64, and
+// sh-engine-avx2 and sh-engine-avx512 where the compiler targets x86-64. load() picks one at startup.
+struct Engine
+{
+#if defined(_WIN32)
+    using Module = HMODULE;
+#else
+    using Module = void*;
+#endif
+
+    Engine() = default;
+    Engine(const Engine&) = delete;
+    Engine& operator=(const Engine&) = delete;
+    ~Engine();
+
+    Commands commands;
+    uint64_t fingerprint = command_fingerprint({});
+    Module dll = nullptr;
+    // The build to load: "generic", "avx2" or "avx512". When empty, $SH_ENGINE_VARIANT is used if it is set, and
+    // otherwise the widest build that the CPU supports and that is installed. Asking for a build the CPU cannot run is
+    // an error rather than a crash on the first wide instruction.
+    std::string variant;
+    // The build the current engine came from, or "$SH_ENGINE" when that names the library directly.
+    std::string_view loaded_variant;
+
+    void load();
+    // Drops the command table. The library stays loaded, like one replaced by a reload.
+    void unload();
+
+    // Starts watching the engine library for rebuilds (inotify; POSIX only).
+    void watch();
+    // If the watched library has changed since the last call, loads it next to the current engine and swaps in its
+    // command table. A library that fails to load leaves the current engine in place. Returns true after a swap.
+    bool poll_reload();
+
+private:
+    std::string_view choose_variant() const;
+    Module open_module(std::string_view variant, Commands& out) const;
+
+    std::vector<Module> m_retired;
+    int m_watch_fd = -1;
+};
+
+struct Interpreter
+{
+    Interpreter() : m_engine(std::make_shared<Engine>()) {}
+    // A session on an engine shared with other interpreters, such as one connection of the server. It cannot load or
+    // unload the engine, and runs parallel kernels on `threads` threads.
+    Interpreter(std::shared_ptr<Engine> engine, unsigned threads)
+        : m_env(threads)
+        , m_engine(std::move(engine))
+        , m_shared_engine(true)
+    {
+    }
+
+    // Runs one token; a word prefixed with & runs that command in the background. While profiling is on, each token,
+    // literals included, is timed under its command name or a label for its kind of literal.
+    void handle_command(std::string_view sv);
+
+    // Runs a script, from its bytecode cache when that is current and otherwise compiling and caching it first.
+    void load_file(const std::experimental::filesystem::path& p);
+    void run(const CompiledScript& script);
+    // Runs the whitespace-separated commands in `source` without prompts or auto-display. Arguments that commands
+    // read with read_line, such as file names, are taken from the tokens that follow them. Stops at the first error.
+    void run_batch(std::string_view source);
+
+    Environment& environment() { return m_env; }
+
+    void load_engine(std::string variant = {})
+    {
+        m_engine->variant = std::move(variant);
+        m_engine->load();
+    }
+    void watch_engine() { m_engine->watch(); }
+    // Called between top-level tokens, so a rebuilt engine never replaces the command table mid-command.
+    void poll_engine() { m_engine->poll_reload(); }
+
+private:
+    // Runs one token and returns the label it is profiled under.
+    std::string_view execute(std::string_view sv);
+    // The & prefix: pops the command's arguments, runs it on a new thread and pushes a future for its result.
+    void start_job(std::string_view name);
+    struct Sample
+    {
+        Profiler::Clock::time_point start;
+        uint64_t bytes;
+    };
+
+    template<typename F>
+    void profiled(F&& f);
+    Sample begin_sample() const;
+    void end_sample(std::string_view label, const Sample& sample);
+    // Bytes handed out by the interpreter's and the engine's matrix pools so far.
+    uint64_t allocated_bytes() const;
+
+    Environment m_env;
+    std::shared_ptr<Engine> m_engine;
+    Profiler m_profiler;
+    bool m_shared_engine = false;
+};
@@ -0,0 +1,190 @@
+#include "pch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// sh-loadgen: drives a server started with `sh-interpreter --serve <socket>`. Each client thread opens sessions one
+// after another; each session sends the request line a number of times, waiting for every response, then
+// disconnects. Reports sessions and requests per second and the request latency distribution as JSON on stdout.
+//
+// Usage: sh-loadgen --socket <path> [--clients N] [--sessions N] [--requests N] [--request "<line>"]
+
+using Clock = std::chrono::steady_clock;
+
+struct Options
+{
+    std::string socket_path;
+    int clients = 8;
+    // Per client.
+    int sessions = 100;
+    // Per session.
+    int requests = 10;
+    std::string request = "1 2 + 3 * print pop";
+};
+
+struct ClientStats
+{
+    std::vector<double> latencies_us;
+    uint64_t errors = 0;
+};
+
+static int connect_to(const std::string& path)
+{
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) throw std::runtime_error("socket path too long");
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) throw std::runtime_error("socket failed");
+    if (connect(fd, (const sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        throw std::runtime_error(fmt::format("Failed to connect to {}: {}", path, std::strerror(errno)));
+    }
+    return fd;
+}
+
+static void send_all(int fd, std::string_view data)
+{
+    while (!data.empty())
+    {
+        auto n = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            throw std::runtime_error("send failed");
+        }
+        data.remove_prefix(n);
+    }
+}
+
+// Reads one response, up to and including its terminating NUL, into `response`.
+static void read_response(int fd, std::string& response)
+{
+    response.clear();
+    char buf[4096];
+    while (true)
+    {
+        auto n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) throw std::runtime_error("server closed the connection");
+        response.append(buf, n);
+        // Requests are sent one at a time, so a NUL can only end the last chunk.
+        if (buf[n - 1] == '\0') return;
+    }
+}
+
+static void run_client(const Options& options, ClientStats& stats)
+{
+    auto line = options.request + "\n";
+    std::string response;
+    stats.latencies_us.reserve((size_t)options.sessions * options.requests);
+    for (int s = 0; s < options.sessions; ++s)
+    {
+        int fd = connect_to(options.socket_path);
+        for (int r = 0; r < options.requests; ++r)
+        {
+            auto start = Clock::now();
+            send_all(fd, line);
+            read_response(fd, response);
+            stats.latencies_us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+            if (response.find("error: ") != std::string::npos) ++stats.errors;
+        }
+        close(fd);
+    }
+}
+
+static double percentile(const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty()) return 0;
+    auto i = (size_t)(p / 100 * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string_view arg = argv[i];
+        if (arg == "--socket" && i + 1 < argc)
+            options.socket_path = argv[++i];
+        else if (arg == "--clients" && i + 1 < argc)
+            options.clients = std::atoi(argv[++i]);
+        else if (arg == "--sessions" && i + 1 < argc)
+            options.sessions = std::atoi(argv[++i]);
+        else if (arg == "--requests" && i + 1 < argc)
+            options.requests = std::atoi(argv[++i]);
+        else if (arg == "--request" && i + 1 < argc)
+            options.request = argv[++i];
+        else
+        {
+            options.socket_path.clear();
+            break;
+        }
+    }
+    if (options.socket_path.empty() || options.clients <= 0 || options.sessions <= 0 || options.requests <= 0)
+    {
+        fmt::fprintf(stderr,
+                     "Usage: %s --socket <path> [--clients N] [--sessions N] [--requests N] [--request \"<line>\"]\n",
+                     argv[0]);
+        return 2;
+    }
+
+    std::vector<ClientStats> stats(options.clients);
+    std::vector<std::thread> clients;
+    std::atomic<int> failed{0};
+    auto start = Clock::now();
+    for (int c = 0; c < options.clients; ++c)
+    {
+        clients.emplace_back([&, c] {
+            try
+            {
+                run_client(options, stats[c]);
+            }
+            catch (const std::exception& e)
+            {
+                if (failed++ == 0) fmt::fprintf(stderr, "%s\n", e.what());
+            }
+        });
+    }
+    for (auto&& t : clients)
+        t.join();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    if (failed) return 1;
+
+    std::vector<double> latencies;
+    uint64_t errors = 0;
+    for (auto&& s : stats)
+    {
+        latencies.insert(latencies.end(), s.latencies_us.begin(), s.latencies_us.end());
+        errors += s.errors;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    uint64_t sessions = (uint64_t)options.clients * options.sessions;
+
+    fmt::printf("{\"clients\":%d,\"sessions\":%d,\"requests\":%d,\"errors\":%d,\"seconds\":%.3f,"
+                "\"sessions_per_sec\":%.1f,\"requests_per_sec\":%.1f,"
+                "\"latency_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f}}\n",
+                options.clients,
+                sessions,
+                latencies.size(),
+                errors,
+                seconds,
+                sessions / seconds,
+                latencies.size() / seconds,
+                percentile(latencies, 50),
+                percentile(latencies, 90),
+                percentile(latencies, 99),
+                latencies.empty() ? 0.0 : latencies.back());
+    return 0;
+}
@@ -1,160 +1,161 @@
 #include "pch.h"
 
-#include "cfile.h"
-#include "engine.h"
-#include "environment.h"
-#include "matrix.h"
+#include "interpreter.h"
+#include "mapped_file.h"
 
-struct Engine
+#include <cstring>
+
+#if defined(_WIN32)
+#include <io.h>
+#define isatty _isatty
+#define fileno _fileno
+#else
+#include "server.h"
+#include <unistd.h>
+#endif
+
+// Batch input is read, and batch output buffered, in blocks of this size.
+static constexpr size_t BATCH_BLOCK = 1 << 20;
+
+static std::string read_stdin()
 {
-    Commands commands = {0, nullptr};
-    HMODULE dll = NULL;
+    std::string text;
+    size_t n = 0;
+    do
+    {
+        text.resize(n + BATCH_BLOCK);
+        n += std::fread(&text[n], 1, BATCH_BLOCK, stdin);
+    } while (n == text.size());
+    text.resize(n);
+    return text;
+}
 
-    void load()
+// Runs the files, or stdin when there are none, with output collected in one large buffer that is written out by
+// the print command and at exit.
+static int run_batch(Interpreter& interpreter, const std::vector<std::string>& files)
+{
+    std::setvbuf(stdout, nullptr, _IOFBF, BATCH_BLOCK);
+    try
     {
-        if (dll != NULL) throw std::runtime_error("Engine is already loaded.");
-        dll = LoadLibraryW(L"sh-engine");
-        if (dll == NULL) throw std::runtime_error("Failed to load engine DLL.");
-        get_commands_t get_commands_proc = (get_commands_t)GetProcAddress(dll, "get_commands");
-        if (!get_commands_proc) throw std::runtime_error("Failed to load commands from engine DLL.");
-        commands = get_commands_proc();
+        if (files.empty()) interpreter.run_batch(read_stdin());
+        for (auto&& file : files)
+        {
+            auto in_file = MappedFile::open(fs::absolute(file));
+            interpreter.run_batch({in_file->data(), in_file->size()});
+        }
     }
-    void unload()
+    catch (const std::exception& e)
     {
-        if (dll == NULL) throw std::runtime_error("Engine is not loaded.");
-        commands = {0, nullptr};
-        FreeLibrary(dll);
-        dll = NULL;
+        std::fflush(stdout);
+        fmt::fprintf(stderr, "%s\n", e.what());
+        return 1;
     }
-};
+    return 0;
+}
 
-struct Interpreter
+static int run_interactive(Interpreter& interpreter)
 {
-    void handle_command(std::string_view sv)
+    char buf[128];
+    while (1)
     {
-        if (sv.size() == 1 && isdigit(sv[0]) != 0)
-        {
-            m_env.stack.push(sv[0] - '0');
-            m_env.auto_display();
-        }
-        else if ((isdigit(sv[0]) != 0 || (sv[0] == '-' && sv.size() > 1)) &&
-                 std::all_of(sv.begin() + 1, sv.end(), [](char ch) { return isdigit(ch) != 0 || ch == '.'; }))
-        {
-            double i = 0;
-            auto err = sscanf_s(sv.data(), "%lf", &i);
-            if (err != 1) throw std::runtime_error("failed to sscanf.");
-            m_env.stack.push(i);
-            m_env.auto_display();
-        }
-        else if (sv.size() >= 1 && sv[0] == '$')
-        {
-            if (sv.size() == 1) throw std::runtime_error("expected variable name");
-            if (sv[1] == '$')
-            {
-                if (sv.size() == 2) throw std::runtime_error("expected variable name");
-                m_env.stack.push(sv.substr(2), Value::symbol_tag);
-            }
-            else
-            {
-                m_env.stack.push(m_env.varmap.at(sv.data() + 1).clone());
-            }
-            m_env.auto_display();
-        }
-        else if (sv.size() >= 1 && sv[0] == '@')
+        try
         {
-            if (sv.size() == 1) throw std::runtime_error("expected stack index");
-            if (!std::all_of(sv.begin() + 1, sv.end(), [](char ch) { return isdigit(ch) != 0; }))
-                throw std::runtime_error("expected stack index");
-
-            int i = 0;
-            auto err = sscanf_s(sv.data() + 1, "%d", &i);
-            if (err != 1) throw std::runtime_error("failed to sscanf.");
+            fmt::printf(">");
+            std::fflush(nullptr);
+#if defined(_WIN32)
+            if (scanf_s("%s", buf, (unsigned)sizeof(buf)) != 1) return 0;
+#else
+            if (std::scanf("%127s", buf) != 1) return 0;
+#endif
 
-            m_env.stack.push(m_env.stack.at_from_top(i).clone());
-            m_env.auto_display();
-        }
-        else if (sv[0] == '"')
-        {
-            if (sv.size() < 2 || sv.back() != '"') throw std::runtime_error("unterminated string literal");
-            auto str = sv;
-            str.remove_prefix(1);
-            str.remove_suffix(1);
-            m_env.stack.push(str, Value::string_tag);
-        }
-        else if (sv == "load-engine")
-        {
-            m_engine.load();
+            interpreter.poll_engine();
+            interpreter.handle_command(std::string_view{buf, strlen(buf)});
         }
-        else if (sv == "unload-engine")
+        catch (const std::exception& e)
         {
-            m_engine.unload();
+            fmt::printf("%s\n", e.what());
+            std::fflush(stdin);
         }
-        else if (sv == "load-file")
-        {
-            fmt::printf("Filename>");
-
-            std::string filename = read_line();
-
-            auto p = fs::absolute(filename);
-            auto in_file = CFile::open_rb(p);
-            CFileView in = in_file;
-
-            auto old_flag = m_env.auto_display_flag;
-            m_env.auto_display_flag = false;
-
-            try
-            {
-                char buf[128];
-                while (in.scan_string(buf, sizeof(buf)) != -1)
-                {
-                    handle_command({buf, strlen(buf)});
-                }
-            }
-            catch (...)
-            {
-                m_env.auto_display_flag = old_flag;
-                throw;
-            }
+    }
+}
 
-            m_env.auto_display_flag = old_flag;
+static const char USAGE[] = "Usage: %1$s [--engine <variant>] [--batch | --interactive] [--watch] [file...]\n"
+                            "       %1$s [--engine <variant>] --serve <socket> [--workers <N>] [--globals <file>]\n";
 
-            fmt::printf("Loaded file \"%s\".\n", p.u8string());
-        }
-        else
+#if !defined(_WIN32)
+static int serve(const ServerOptions& options)
+{
+    try
+    {
+        run_server(options);
+    }
+    catch (const std::exception& e)
+    {
+        fmt::fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
+#endif
+
+// Usage: sh-interpreter [--engine <variant>] [--batch | --interactive] [--watch] [file...]
+//        sh-interpreter [--engine <variant>] --serve <socket> [--workers <N>] [--globals <file>]
+// Runs in batch mode when given files, --batch, or a stdin that is not a terminal. --watch reloads the engine library
+// whenever it is rebuilt. --serve serves sessions on a Unix socket instead (see server.h); the variables bound by the
+// --globals script are shared, read-only, by every session. --engine loads the generic, avx2 or avx512 build of the
+// engine instead of the widest one the CPU supports (see Engine::variant).
+int main(int argc, char** argv)
+{
+    bool batch = !isatty(fileno(stdin));
+    bool watch = false;
+    std::vector<std::string> files;
+    std::string socket_path;
+    std::string globals;
+    std::string engine_variant;
+    unsigned workers = std::thread::hardware_concurrency();
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string_view arg = argv[i];
+        if (arg == "--batch" || arg == "-b")
+            batch = true;
+        else if (arg == "--interactive" || arg == "-i")
+            batch = false;
+        else if (arg == "--watch" || arg == "-w")
+            watch = true;
+        else if (arg == "--serve" && i + 1 < argc)
+            socket_path = argv[++i];
+        else if (arg == "--workers" && i + 1 < argc)
+            workers = (unsigned)std::atoi(argv[++i]);
+        else if (arg == "--globals" && i + 1 < argc)
+            globals = argv[++i];
+        else if (arg == "--engine" && i + 1 < argc)
+            engine_variant = argv[++i];
+        else if (!arg.empty() && arg[0] == '-')
         {
-            bool found = false;
-            for (size_t i = 0; i < m_engine.commands.size; ++i)
-            {
-                auto&& command = m_engine.commands.begin[i];
-
-                if (command.name == sv)
-                {
-                    (*command.function)(m_env);
-                    found = true;
-                    break;
-                }
-            }
-            if (!found)
-            {
-                throw std::runtime_error(fmt::sprintf("Input not recognized: %s. Use 'help' for command list.\n", sv));
-            }
+            fmt::fprintf(stderr, "Unknown option %s.\n", arg);
+            fmt::fprintf(stderr, USAGE, argv[0]);
+            return 2;
         }
+        else
+            files.emplace_back(arg);
     }
 
-    void load_engine() { m_engine.load(); }
-
-private:
-    Environment m_env;
-    Engine m_engine;
-};
+    if (!socket_path.empty())
+    {
+#if defined(_WIN32)
+        fmt::fprintf(stderr, "Server mode is not supported on this platform.\n");
+        return 2;
+#else
+        return serve({socket_path, workers, globals, engine_variant});
+#endif
+    }
 
-int main()
-{
     Interpreter interpreter;
 
     try
     {
-        interpreter.load_engine();
+        interpreter.load_engine(engine_variant);
+        if (watch) interpreter.watch_engine();
     }
     catch (std::exception& e)
     {
@@ -162,21 +163,6 @@ int main()
         return 1;
     }
 
-    char buf[128];
-    while (1)
-    {
-        try
-        {
-            fmt::printf(">");
-            std::fflush(nullptr);
-            if (scanf_s("%s", buf, sizeof(buf)) != 1) return 0;
-
-            interpreter.handle_command(std::string_view{buf, strlen(buf)});
-        }
-        catch (const std::exception& e)
-        {
-            fmt::printf("%s\n", e.what());
-            std::fflush(stdin);
-        }
-    }
+    if (batch || !files.empty()) return run_batch(interpreter, files);
+    return run_interactive(interpreter);
 }
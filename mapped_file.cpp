@@ -0,0 +1,87 @@
+#include "pch.h"
+
+#include "mapped_file.h"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(_WIN32)
+std::shared_ptr<MappedFile> MappedFile::open(const std::experimental::filesystem::path& filename)
+{
+    std::shared_ptr<MappedFile> ret(new MappedFile());
+
+    HANDLE file = CreateFileW(filename.native().c_str(),
+                              GENERIC_READ,
+                              FILE_SHARE_READ,
+                              nullptr,
+                              OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL,
+                              nullptr);
+    if (file == INVALID_HANDLE_VALUE) throw std::runtime_error("Could not open file for reading");
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size))
+    {
+        CloseHandle(file);
+        throw std::runtime_error("Could not determine file size");
+    }
+    ret->m_size = (size_t)size.QuadPart;
+    if (ret->m_size == 0)
+    {
+        CloseHandle(file);
+        return ret;
+    }
+
+    HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (mapping == NULL) throw std::runtime_error("Could not map file");
+
+    ret->m_data = (char*)MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+    CloseHandle(mapping);
+    if (ret->m_data == nullptr) throw std::runtime_error("Could not map file");
+
+    return ret;
+}
+
+MappedFile::~MappedFile()
+{
+    if (m_data) UnmapViewOfFile(m_data);
+}
+#else
+std::shared_ptr<MappedFile> MappedFile::open(const std::experimental::filesystem::path& filename)
+{
+    std::shared_ptr<MappedFile> ret(new MappedFile());
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Could not open file for reading");
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        throw std::runtime_error("Could not determine file size");
+    }
+    ret->m_size = (size_t)st.st_size;
+    if (ret->m_size == 0)
+    {
+        close(fd);
+        return ret;
+    }
+
+    void* p = mmap(nullptr, ret->m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) throw std::runtime_error("Could not map file");
+    ret->m_data = (char*)p;
+
+    return ret;
+}
+
+MappedFile::~MappedFile()
+{
+    if (m_data) munmap(m_data, m_size);
+}
+#endif
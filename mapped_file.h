@@ -0,0 +1,24 @@
+#pragma once
+
+#include <filesystem>
+#include <memory>
+
+// A private, copy-on-write memory mapping of a whole file. Pages are shared with the page cache until written, and
+// writes are never carried back to the file.
+struct MappedFile
+{
+    static std::shared_ptr<MappedFile> open(const std::experimental::filesystem::path& filename);
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+
+    char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    MappedFile() = default;
+
+    char* m_data = nullptr;
+    size_t m_size = 0;
+};
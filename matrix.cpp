@@ -1,138 +1,1100 @@
 #include "pch.h"
 
 #include "matrix.h"
+#include "thread_pool.h"
 
 #include <fmt/printf.h>
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
+#include <new>
+#include <stdexcept>
 
-void display(const MatrixData& m, int columns)
+// The GEMM micro-kernel has an AVX2/FMA form. Builds that target AVX2 (the sh-engine-avx2 and sh-engine-avx512
+// variants) call it directly; other GCC and Clang x86 builds compile it with target("avx2,fma") and pick it at run time
+// when the CPU supports both.
+#if defined(__AVX2__) && (defined(__FMA__) || defined(_MSC_VER))
+#define SH_GEMM_AVX2
+#define SH_GEMM_AVX2_TARGET
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define SH_GEMM_AVX2
+#define SH_GEMM_AVX2_DISPATCH
+#define SH_GEMM_AVX2_TARGET __attribute__((target("avx2,fma")))
+#endif
+
+#if defined(__AVX2__) || defined(SH_GEMM_AVX2)
+#include <immintrin.h>
+#endif
+
+#if defined(SH_GEMM_AVX2_DISPATCH)
+// Whether the CPU (and OS) can run the target("avx2,fma") kernels; probed once.
+static bool cpu_has_avx2_fma()
+{
+    static const bool supported = [] {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    }();
+    return supported;
+}
+#endif
+
+size_t MatrixExtents::size() const
+{
+    size_t n = 1;
+    for (auto e : extents)
+        n *= e;
+    return n;
+}
+
+// Maps a block of `lines` 64-byte lines to its size class, rounding `lines` up to the class size. Classes up to four
+// lines are exact; above that, the top three bits of lines - 1 are kept, giving four classes per octave.
+static int size_class(size_t& lines)
+{
+    if (lines <= 4)
+    {
+        lines = lines == 0 ? 1 : lines;
+        return (int)lines - 1;
+    }
+    int shift = 0;
+    while (((lines - 1) >> shift) >= 8)
+        ++shift;
+    auto top = ((lines - 1) >> shift) + 1;
+    lines = top << shift;
+    return shift * 4 + (int)top - 1;
+}
+
+MatrixPool& MatrixPool::global()
+{
+    static auto pool = new MatrixPool(size_t(256) << 20);
+    return *pool;
+}
+
+double* MatrixPool::allocate(size_t n, size_t& capacity)
+{
+    auto lines = (n + LINE_DOUBLES - 1) / LINE_DOUBLES;
+    auto c = size_class(lines);
+    capacity = lines * LINE_DOUBLES;
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_allocated_bytes += capacity * sizeof(double);
+        auto& free_list = m_free[c];
+        if (!free_list.empty())
+        {
+            auto p = free_list.back();
+            free_list.pop_back();
+            ++m_hits;
+            m_cached_bytes -= capacity * sizeof(double);
+            --m_cached_blocks;
+            return p;
+        }
+        ++m_misses;
+    }
+    return static_cast<double*>(::operator new(capacity * sizeof(double), std::align_val_t(ALIGNMENT)));
+}
+
+void MatrixPool::release(double* p, size_t capacity)
+{
+    auto lines = capacity / LINE_DOUBLES;
+    auto c = size_class(lines);
+    auto bytes = capacity * sizeof(double);
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        if (m_cached_bytes + bytes <= m_max_cached_bytes)
+        {
+            m_free[c].push_back(p);
+            m_cached_bytes += bytes;
+            ++m_cached_blocks;
+            return;
+        }
+    }
+    ::operator delete(p, std::align_val_t(ALIGNMENT));
+}
+
+void MatrixPool::trim()
+{
+    std::lock_guard<std::mutex> lk(m_mutex);
+    for (auto&& free_list : m_free)
+    {
+        for (auto p : free_list)
+            ::operator delete(p, std::align_val_t(ALIGNMENT));
+        free_list.clear();
+    }
+    m_cached_bytes = 0;
+    m_cached_blocks = 0;
+}
+
+MatrixPool::Stats MatrixPool::stats() const
+{
+    std::lock_guard<std::mutex> lk(m_mutex);
+    return {m_hits, m_misses, m_cached_bytes, m_cached_blocks, m_allocated_bytes};
+}
+
+void MatrixPool::reset_stats()
+{
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_hits = 0;
+    m_misses = 0;
+}
+
+MatrixBuffer::MatrixBuffer(size_t n, double fill, MatrixPool& pool) : m_size(n), m_pool(&pool)
+{
+    m_data = pool.allocate(n, m_capacity);
+    std::fill(m_data, m_data + n, fill);
+    std::fill(m_data + n, m_data + m_capacity, 0.0);
+}
+
+MatrixBuffer::~MatrixBuffer()
+{
+    if (m_pool) m_pool->release(m_data, m_capacity);
+}
+
+static std::vector<ptrdiff_t> dense_strides(const MatrixExtents& e)
 {
-    if (m.data.empty())
+    std::vector<ptrdiff_t> strides(e.extents.size());
+    ptrdiff_t stride = 1;
+    for (size_t i = 0; i < strides.size(); ++i)
     {
-        printf("[ ]\n");
+        strides[i] = stride;
+        stride *= e.extents[i];
+    }
+    return strides;
+}
+
+// Doubles of buffer storage that hold n elements of `type`.
+static size_t storage_size(size_t n, ElementType type) { return type == ElementType::F32 ? (n + 1) / 2 : n; }
+
+MatrixData::MatrixData(size_t size, double fill) : MatrixData(MatrixExtents{(int)size}, fill) {}
+MatrixData::MatrixData(MatrixExtents extents, double fill) : MatrixData(std::move(extents), ElementType::F64, fill) {}
+MatrixData::MatrixData(MatrixExtents extents, ElementType type, double fill)
+    : m_extents(std::move(extents))
+    , m_strides(dense_strides(m_extents))
+    , m_size(m_extents.size())
+    , m_type(type)
+{
+    if (m_extents.rank() == 0) throw std::runtime_error("matrix must have at least one extent");
+    for (auto e : m_extents.extents)
+        if (e < 0) throw std::runtime_error("matrix extents must not be negative");
+    if (type == ElementType::F64)
+    {
+        m_buffer = std::make_shared<MatrixBuffer>(m_size, fill);
         return;
     }
-    fmt::printf("[ %2.3f", m.data[0]);
-    for (size_t x = 1; x < m.data.size(); ++x)
+    // The buffer fills whole doubles, so a nonzero float fill is written separately.
+    m_buffer = std::make_shared<MatrixBuffer>(storage_size(m_size, type));
+    if (fill != 0.0) std::fill_n(reinterpret_cast<float*>(m_buffer->data()), m_size, (float)fill);
+}
+MatrixData::MatrixData(MatrixExtents extents, std::shared_ptr<MatrixBuffer> buffer, ElementType type)
+    : m_extents(std::move(extents))
+    , m_strides(dense_strides(m_extents))
+    , m_size(m_extents.size())
+    , m_type(type)
+    , m_buffer(std::move(buffer))
+{
+    if (m_extents.rank() == 0) throw std::runtime_error("matrix must have at least one extent");
+    for (auto e : m_extents.extents)
+        if (e < 0) throw std::runtime_error("matrix extents must not be negative");
+    if (m_buffer->size() < storage_size(m_size, m_type))
+        throw std::runtime_error("matrix buffer is too small for its extents");
+}
+MatrixData::MatrixData(std::initializer_list<double> ilist) : MatrixData(ilist.size())
+{
+    std::copy(ilist.begin(), ilist.end(), mutable_data());
+}
+
+MatrixData::MatrixData(const MatrixData& src, AliasTag)
+    : m_extents(src.m_extents)
+    , m_strides(src.m_strides)
+    , m_offset(src.m_offset)
+    , m_size(src.m_size)
+    , m_type(src.m_type)
+    , m_buffer(src.m_buffer)
+{
+}
+
+MatrixData MatrixData::copy(ThreadPool* pool) const
+{
+    if (!m_buffer) return {};
+    MatrixData ret(m_extents, m_type);
+    dispatch_element_type(m_type, [&](auto zero) { copy_to(ret.mutable_data_as<decltype(zero)>(), pool); });
+    return ret;
+}
+
+bool MatrixData::is_contiguous() const
+{
+    ptrdiff_t stride = 1;
+    for (size_t i = 0; i < m_strides.size(); ++i)
     {
-        if (x % columns == 0)
-            fmt::printf("\n  %2.3f", m.data[x]);
-        else
-            fmt::printf(" %2.3f", m.data[x]);
+        if (m_extents.extents[i] != 1 && m_strides[i] != stride) return false;
+        stride *= m_extents.extents[i];
+    }
+    return true;
+}
+
+MatrixData MatrixData::contiguous(ThreadPool* pool) const
+{
+    if (is_contiguous()) return alias();
+    return copy(pool);
+}
+
+MatrixData MatrixData::contiguous(ElementType type, ThreadPool* pool) const
+{
+    if (type == m_type || !m_buffer) return contiguous(pool);
+    auto src = contiguous(pool);
+    MatrixData ret(m_extents, type);
+    dispatch_element_type(m_type, [&](auto from) {
+        dispatch_element_type(type, [&](auto to) {
+            using To = decltype(to);
+            auto p = src.data_as<decltype(from)>();
+            auto out = ret.mutable_data_as<To>();
+            for (size_t i = 0; i < m_size; ++i)
+                out[i] = (To)p[i];
+        });
+    });
+    return ret;
+}
+
+void MatrixData::check_element_type(ElementType type) const
+{
+    if (type != m_type) throw std::logic_error("matrix element type does not match");
+}
+
+const void* MatrixData::raw_data() const
+{
+    if (!is_contiguous()) throw std::logic_error("matrix view is not contiguous");
+    if (!m_buffer) return nullptr;
+    if (m_type == ElementType::F32) return reinterpret_cast<const float*>(m_buffer->data()) + m_offset;
+    return m_buffer->data() + m_offset;
+}
+
+void* MatrixData::mutable_raw_data()
+{
+    if (!m_buffer) return nullptr;
+    if (!is_contiguous() || m_buffer.use_count() > 1) *this = copy();
+    return const_cast<void*>(raw_data());
+}
+
+template<class T>
+void MatrixData::copy_to(T* out, ThreadPool* pool) const
+{
+    check_element_type(ElementTraits<T>::type);
+    if (m_size == 0) return;
+    const T* p = reinterpret_cast<const T*>(m_buffer->data()) + m_offset;
+    if (is_contiguous())
+    {
+        std::copy(p, p + m_size, out);
+        return;
+    }
+
+    int rank = m_extents.rank();
+    int n0 = m_extents.extents[0];
+    ptrdiff_t s0 = m_strides[0];
+    std::vector<int> index(rank, 0);
+
+    // The second axis is dense in memory (a transposed view): copy each plane over the first two axes with the tiled
+    // transpose kernel, walking the remaining axes with an odometer.
+    if (rank >= 2 && m_strides[1] == 1 && m_extents.extents[1] > 1)
+    {
+        int n1 = m_extents.extents[1];
+        size_t plane = (size_t)n0 * n1;
+        for (size_t done = 0; done < m_size; done += plane)
+        {
+            transpose_copy(p, s0, out, n0, n0, n1, pool);
+            out += plane;
+            for (int d = 2; d < rank; ++d)
+            {
+                p += m_strides[d];
+                if (++index[d] < m_extents.extents[d]) break;
+                p -= m_strides[d] * m_extents.extents[d];
+                index[d] = 0;
+            }
+        }
+        return;
+    }
+
+    // Otherwise walk the view with an odometer over every axis but the innermost one.
+    for (size_t done = 0; done < m_size; done += n0)
+    {
+        for (int i = 0; i < n0; ++i)
+            *out++ = p[i * s0];
+        for (int d = 1; d < rank; ++d)
+        {
+            p += m_strides[d];
+            if (++index[d] < m_extents.extents[d]) break;
+            p -= m_strides[d] * m_extents.extents[d];
+            index[d] = 0;
+        }
+    }
+}
+
+template void MatrixData::copy_to(double* out, ThreadPool* pool) const;
+template void MatrixData::copy_to(float* out, ThreadPool* pool) const;
+
+double MatrixData::element(size_t index) const
+{
+    ptrdiff_t offset = m_offset;
+    for (size_t i = 0; i < m_strides.size(); ++i)
+    {
+        size_t extent = m_extents.extents[i];
+        offset += (ptrdiff_t)(index % extent) * m_strides[i];
+        index /= extent;
+    }
+    if (m_type == ElementType::F32) return reinterpret_cast<const float*>(m_buffer->data())[offset];
+    return m_buffer->data()[offset];
+}
+
+MatrixData MatrixData::reshape(MatrixExtents extents) const
+{
+    if (extents.rank() == 0) throw std::runtime_error("matrix must have at least one extent");
+    for (auto e : extents.extents)
+        if (e < 0) throw std::runtime_error("matrix extents must not be negative");
+    if (extents.size() != m_size) throw std::runtime_error("reshape must preserve the number of elements");
+    auto ret = contiguous();
+    ret.m_strides = dense_strides(extents);
+    ret.m_extents = std::move(extents);
+    return ret;
+}
+
+MatrixData MatrixData::swap_axes(int axis1, int axis2) const
+{
+    if (axis1 < 0 || axis2 < 0) throw std::runtime_error("axis out of range");
+    auto ret = alias();
+    // Axes past the rank are implicit extents of 1, so a vector can be transposed into a row.
+    while (ret.rank() <= std::max(axis1, axis2))
+    {
+        ret.m_extents.extents.push_back(1);
+        ret.m_strides.push_back((ptrdiff_t)m_size);
+    }
+    std::swap(ret.m_extents.extents[axis1], ret.m_extents.extents[axis2]);
+    std::swap(ret.m_strides[axis1], ret.m_strides[axis2]);
+    return ret;
+}
+
+MatrixData MatrixData::slice(int axis, int begin, int end) const
+{
+    if (axis < 0 || axis >= rank()) throw std::runtime_error("axis out of range");
+    if (begin < 0 || begin > end || end > m_extents.extents[axis]) throw std::runtime_error("slice out of range");
+    auto ret = alias();
+    ret.m_offset += begin * m_strides[axis];
+    ret.m_extents.extents[axis] = end - begin;
+    ret.m_size = ret.m_extents.size();
+    return ret;
+}
+
+// Rows and columns kept at each end of an elided matrix.
+static constexpr size_t DISPLAY_EDGE = 3;
+// A streamed display is written out whenever its buffer grows past this.
+static constexpr size_t DISPLAY_FLUSH = 1 << 20;
+
+void format_matrix(fmt::memory_buffer& out, const MatrixData& m, size_t limit, int columns, FILE* stream)
+{
+    auto it = std::back_inserter(out);
+    if (m.size() == 0)
+    {
+        fmt::format_to(it, "[ ]\n");
+        return;
+    }
+    if (columns <= 0) columns = m.rank() > 1 ? std::max(m.extents().extents[0], 1) : 4;
+    bool f32 = m.element_type() == ElementType::F32;
+    size_t n = m.size();
+    size_t cols = columns;
+    size_t rows = (n + cols - 1) / cols;
+    bool elide = limit != 0 && n > limit;
+    bool elide_rows = elide && rows > 2 * DISPLAY_EDGE;
+    bool elide_cols = elide && cols > 2 * DISPLAY_EDGE;
+    // An elided display shows only the edge rows and columns, which are read through the view's strides rather than
+    // copying a whole strided view to make it contiguous.
+    auto c = elide ? MatrixData() : m.contiguous();
+    const double* data = elide || f32 ? nullptr : c.data();
+    const float* data_f32 = !elide && f32 ? c.data_as<float>() : nullptr;
+
+    fmt::format_to(it, "[");
+    for (size_t r = 0; r < rows; ++r)
+    {
+        if (elide_rows && r == DISPLAY_EDGE)
+        {
+            fmt::format_to(it, "\n  ...");
+            r = rows - DISPLAY_EDGE;
+        }
+        if (r > 0) fmt::format_to(it, "\n ");
+        size_t begin = r * cols;
+        size_t end = std::min(n, begin + cols);
+        for (size_t x = begin; x < end; ++x)
+        {
+            if (elide_cols && x == begin + DISPLAY_EDGE && end - begin > 2 * DISPLAY_EDGE)
+            {
+                fmt::format_to(it, " ...");
+                x = end - DISPLAY_EDGE;
+            }
+            fmt::format_to(it, " {:2.3f}", data ? data[x] : data_f32 ? (double)data_f32[x] : m.element(x));
+        }
+        if (stream && out.size() >= DISPLAY_FLUSH)
+        {
+            std::fwrite(out.data(), 1, out.size(), stream);
+            out.clear();
+        }
     }
-    fmt::printf(" ]\n");
+    fmt::format_to(it, f32 ? " ] f32" : " ]");
+    if (elide_rows || elide_cols)
+    {
+        const char* sep = " (";
+        for (auto e : m.extents().extents)
+        {
+            fmt::format_to(it, "{}{}", sep, e);
+            sep = "x";
+        }
+        fmt::format_to(it, ", {} elements)", n);
+    }
+    fmt::format_to(it, "\n");
+}
+
+void display(const MatrixData& m, int columns)
+{
+    fmt::memory_buffer out;
+    format_matrix(out, m, 0, columns, stdout);
+    std::fwrite(out.data(), 1, out.size(), stdout);
+}
+
+void check_by_element(const MatrixData& m, const MatrixData& v)
+{
+    if (v.size() == 0 || m.size() % v.size() != 0)
+        throw std::runtime_error("matrix size is not a multiple of the vector size");
 }
 
 MatrixData multiply(const MatrixData& m, const MatrixData& v)
 {
-    return by_element(m, v, [](double a, double b) { return a * b; });
+    return by_element(m, v, [](auto a, auto b) { return a * b; });
+}
+MatrixData multiply(MatrixData&& m, const MatrixData& v)
+{
+    return by_element(std::move(m), v, [](auto a, auto b) { return a * b; });
 }
 MatrixData transpose(const MatrixData& v1, int extent)
 {
-    MatrixData ret;
-    ret.data.resize(v1.data.size());
-    int imax = extent;
-    int jmax = v1.data.size() / imax;
-    for (int i = 0; i < imax; ++i)
-        for (int j = 0; j < jmax; ++j)
-            ret.data[j + i * jmax] = v1.data[i + j * imax];
-    return ret;
+    if (extent <= 0) throw std::runtime_error("matrix extent must be positive");
+    return v1.reshape({extent, (int)(v1.size() / extent)}).swap_axes(0, 1);
 }
 MatrixData transpose2(const MatrixData& v1, int extent1, int extent2)
 {
-    MatrixData ret;
-    ret.data.resize(v1.data.size());
-    int imax = extent1;
-    int jmax = extent2;
-    int kmax = v1.data.size() / imax / jmax;
-    for (int k = 0; k < kmax; ++k)
-        for (int j = 0; j < jmax; ++j)
-            for (int i = 0; i < imax; ++i)
-                ret.data[j + i * jmax + k * imax * jmax] = v1.data[i + j * imax + k * imax * jmax];
-    return ret;
+    if (extent1 <= 0 || extent2 <= 0) throw std::runtime_error("matrix extent must be positive");
+    return v1.reshape({extent1, extent2, (int)(v1.size() / extent1 / extent2)}).swap_axes(0, 1);
+}
+
+// Tile edge for transpose_copy: a source tile and a destination tile fit in L1 together.
+static constexpr size_t TRANSPOSE_TILE = 16;
+// Blocks with fewer elements than this are transposed on the calling thread.
+static constexpr size_t TRANSPOSE_PARALLEL_MIN = 1 << 16;
+
+// Edge of the register transposes: one AVX2 vector of elements.
+template<class T>
+static constexpr size_t TRANSPOSE_BLOCK = 32 / sizeof(T);
+
+template<class T>
+static inline void transpose_block_generic(const T* src, ptrdiff_t ld_src, T* dst, ptrdiff_t ld_dst)
+{
+    constexpr size_t B = TRANSPOSE_BLOCK<T>;
+    for (size_t c = 0; c < B; ++c)
+        for (size_t r = 0; r < B; ++r)
+            dst[c * ld_dst + r] = src[r * ld_src + c];
+}
+
+// The register transposes have AVX2 forms, which are chosen the same way as the GEMM micro-kernel.
+#if defined(SH_GEMM_AVX2)
+static SH_GEMM_AVX2_TARGET inline void transpose_block_avx2(const double* src,
+                                                            ptrdiff_t ld_src,
+                                                            double* dst,
+                                                            ptrdiff_t ld_dst)
+{
+    __m256d r0 = _mm256_loadu_pd(src);
+    __m256d r1 = _mm256_loadu_pd(src + ld_src);
+    __m256d r2 = _mm256_loadu_pd(src + 2 * ld_src);
+    __m256d r3 = _mm256_loadu_pd(src + 3 * ld_src);
+    // t0 = a0 b0 a2 b2, t1 = a1 b1 a3 b3, t2 = c0 d0 c2 d2, t3 = c1 d1 c3 d3
+    __m256d t0 = _mm256_unpacklo_pd(r0, r1);
+    __m256d t1 = _mm256_unpackhi_pd(r0, r1);
+    __m256d t2 = _mm256_unpacklo_pd(r2, r3);
+    __m256d t3 = _mm256_unpackhi_pd(r2, r3);
+    _mm256_storeu_pd(dst, _mm256_permute2f128_pd(t0, t2, 0x20));
+    _mm256_storeu_pd(dst + ld_dst, _mm256_permute2f128_pd(t1, t3, 0x20));
+    _mm256_storeu_pd(dst + 2 * ld_dst, _mm256_permute2f128_pd(t0, t2, 0x31));
+    _mm256_storeu_pd(dst + 3 * ld_dst, _mm256_permute2f128_pd(t1, t3, 0x31));
+}
+
+static SH_GEMM_AVX2_TARGET inline void transpose_block_avx2(const float* src,
+                                                            ptrdiff_t ld_src,
+                                                            float* dst,
+                                                            ptrdiff_t ld_dst)
+{
+    __m256 r[8];
+    for (int i = 0; i < 8; ++i)
+        r[i] = _mm256_loadu_ps(src + i * ld_src);
+    // Interleave pairs of rows, then pairs of pairs; each 128-bit half then holds a 4x4 block of the result.
+    __m256 t[8];
+    for (int i = 0; i < 8; i += 2)
+    {
+        t[i] = _mm256_unpacklo_ps(r[i], r[i + 1]);
+        t[i + 1] = _mm256_unpackhi_ps(r[i], r[i + 1]);
+    }
+    __m256 u[8];
+    for (int i = 0; i < 8; i += 4)
+    {
+        u[i] = _mm256_shuffle_ps(t[i], t[i + 2], _MM_SHUFFLE(1, 0, 1, 0));
+        u[i + 1] = _mm256_shuffle_ps(t[i], t[i + 2], _MM_SHUFFLE(3, 2, 3, 2));
+        u[i + 2] = _mm256_shuffle_ps(t[i + 1], t[i + 3], _MM_SHUFFLE(1, 0, 1, 0));
+        u[i + 3] = _mm256_shuffle_ps(t[i + 1], t[i + 3], _MM_SHUFFLE(3, 2, 3, 2));
+    }
+    for (int i = 0; i < 4; ++i)
+    {
+        _mm256_storeu_ps(dst + i * ld_dst, _mm256_permute2f128_ps(u[i], u[i + 4], 0x20));
+        _mm256_storeu_ps(dst + (i + 4) * ld_dst, _mm256_permute2f128_ps(u[i], u[i + 4], 0x31));
+    }
+}
+#endif
+
+// Transposes a tile of at most TRANSPOSE_TILE x TRANSPOSE_TILE elements, in register blocks where they fit whole.
+// Inlined into each tile kernel below, so `block` is inlined with the kernel's instruction set.
+#if defined(__GNUC__) || defined(__clang__)
+// Left alone, GCC keeps the 8x8 float block out of line and calls it once per block.
+#define SH_TRANSPOSE_FLATTEN __attribute__((flatten))
+#else
+#define SH_TRANSPOSE_FLATTEN
+#endif
+
+template<class T, class Block>
+static inline void transpose_tile(
+    const T* src, ptrdiff_t ld_src, T* dst, ptrdiff_t ld_dst, size_t rows, size_t cols, Block block)
+{
+    constexpr size_t B = TRANSPOSE_BLOCK<T>;
+    size_t r = 0;
+    for (; r + B <= rows; r += B)
+    {
+        size_t c = 0;
+        for (; c + B <= cols; c += B)
+            block(src + r * ld_src + c, ld_src, dst + c * ld_dst + r, ld_dst);
+        for (; c < cols; ++c)
+            for (size_t i = r; i < r + B; ++i)
+                dst[c * ld_dst + i] = src[i * ld_src + c];
+    }
+    for (; r < rows; ++r)
+        for (size_t c = 0; c < cols; ++c)
+            dst[c * ld_dst + r] = src[r * ld_src + c];
+}
+
+template<class T>
+static SH_TRANSPOSE_FLATTEN void transpose_tile_generic(
+    const T* src, ptrdiff_t ld_src, T* dst, ptrdiff_t ld_dst, size_t rows, size_t cols)
+{
+    transpose_tile(src, ld_src, dst, ld_dst, rows, cols, [](const T* s, ptrdiff_t ls, T* d, ptrdiff_t ld) {
+        transpose_block_generic(s, ls, d, ld);
+    });
+}
+
+#if defined(SH_GEMM_AVX2)
+// A function object rather than a lambda, since a lambda would not carry the target attribute.
+struct TransposeBlockAvx2
+{
+    template<class T>
+    SH_GEMM_AVX2_TARGET void operator()(const T* src, ptrdiff_t ld_src, T* dst, ptrdiff_t ld_dst) const
+    {
+        transpose_block_avx2(src, ld_src, dst, ld_dst);
+    }
+};
+
+template<class T>
+static SH_GEMM_AVX2_TARGET SH_TRANSPOSE_FLATTEN void transpose_tile_avx2(
+    const T* src, ptrdiff_t ld_src, T* dst, ptrdiff_t ld_dst, size_t rows, size_t cols)
+{
+    transpose_tile(src, ld_src, dst, ld_dst, rows, cols, TransposeBlockAvx2{});
+}
+#endif
+
+template<class T>
+using TransposeTileKernel = void (*)(const T*, ptrdiff_t, T*, ptrdiff_t, size_t rows, size_t cols);
+
+// The tile kernel for this build and CPU.
+template<class T>
+static TransposeTileKernel<T> select_transpose_tile()
+{
+#if defined(SH_GEMM_AVX2_DISPATCH)
+    if (cpu_has_avx2_fma()) return transpose_tile_avx2<T>;
+    return transpose_tile_generic<T>;
+#elif defined(SH_GEMM_AVX2)
+    return transpose_tile_avx2<T>;
+#else
+    return transpose_tile_generic<T>;
+#endif
+}
+
+template<class T>
+static void transpose_copy_tiled(
+    const T* src, ptrdiff_t ld_src, T* dst, ptrdiff_t ld_dst, size_t rows, size_t cols, ThreadPool* pool)
+{
+    // Tiles are numbered down each column strip of the source, so a chunk of consecutive tiles fills whole rows of
+    // the destination in order.
+    size_t row_tiles = (rows + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE;
+    size_t col_tiles = (cols + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE;
+    auto tile = select_transpose_tile<T>();
+    auto tiles = [&](size_t begin, size_t end) {
+        for (size_t t = begin; t < end; ++t)
+        {
+            size_t r0 = t % row_tiles * TRANSPOSE_TILE;
+            size_t c0 = t / row_tiles * TRANSPOSE_TILE;
+            tile(src + r0 * ld_src + c0,
+                 ld_src,
+                 dst + c0 * ld_dst + r0,
+                 ld_dst,
+                 std::min(TRANSPOSE_TILE, rows - r0),
+                 std::min(TRANSPOSE_TILE, cols - c0));
+        }
+    };
+    if (pool && rows * cols >= TRANSPOSE_PARALLEL_MIN)
+        pool->parallel_for(row_tiles * col_tiles, 16, tiles);
+    else
+        tiles(0, row_tiles * col_tiles);
+}
+
+void transpose_copy(
+    const double* src, ptrdiff_t ld_src, double* dst, ptrdiff_t ld_dst, size_t rows, size_t cols, ThreadPool* pool)
+{
+    transpose_copy_tiled(src, ld_src, dst, ld_dst, rows, cols, pool);
+}
+
+void transpose_copy(
+    const float* src, ptrdiff_t ld_src, float* dst, ptrdiff_t ld_dst, size_t rows, size_t cols, ThreadPool* pool)
+{
+    transpose_copy_tiled(src, ld_src, dst, ld_dst, rows, cols, pool);
 }
 
 MatrixData divide(const MatrixData& m, const MatrixData& v)
 {
-    return by_element(m, v, [](double a, double b) { return a / b; });
+    return by_element(m, v, [](auto a, auto b) { return a / b; });
+}
+MatrixData divide(MatrixData&& m, const MatrixData& v)
+{
+    return by_element(std::move(m), v, [](auto a, auto b) { return a / b; });
+}
+
+// Tile edge for bayes_rule; a tile of src and of the output both stay in L1.
+static constexpr size_t BAYES_TILE = 32;
+
+// out[k * rows + r] = src[r * cols + k] * mult[k] / div[(k * rows + r) % div_size], walked in square tiles so the
+// transposed reads of src stay in cache.
+template<class T>
+static void bayes_kernel(const T* ps, const T* pm, const T* pd, size_t rows, size_t cols, size_t div_size, T* out)
+{
+    for (size_t k0 = 0; k0 < cols; k0 += BAYES_TILE)
+    {
+        size_t k1 = std::min(k0 + BAYES_TILE, cols);
+        for (size_t r0 = 0; r0 < rows; r0 += BAYES_TILE)
+        {
+            size_t r1 = std::min(r0 + BAYES_TILE, rows);
+            for (size_t k = k0; k < k1; ++k)
+            {
+                T scale = pm[k];
+                size_t j = (k * rows + r0) % div_size;
+                for (size_t r = r0; r < r1; ++r)
+                {
+                    out[k * rows + r] = ps[r * cols + k] * scale / pd[j];
+                    if (++j == div_size) j = 0;
+                }
+            }
+        }
+    }
 }
 
 MatrixData bayes_rule(const MatrixData& src, const MatrixData& mult, const MatrixData& div)
 {
-    return divide(transpose(multiply(src, mult), mult.data.size()), div);
+    check_by_element(src, mult);
+    check_by_element(src, div);
+    auto type = common_type(common_type(src.element_type(), mult.element_type()), div.element_type());
+    auto a = src.contiguous(type);
+    auto m = mult.contiguous(type);
+    auto d = div.contiguous(type);
+    size_t cols = m.size();
+    size_t rows = a.size() / cols;
+
+    MatrixData ret(MatrixExtents{(int)rows, (int)cols}, type);
+    dispatch_element_type(type, [&](auto zero) {
+        using T = decltype(zero);
+        bayes_kernel(a.data_as<T>(), m.data_as<T>(), d.data_as<T>(), rows, cols, d.size(), ret.mutable_data_as<T>());
+    });
+    return ret;
+}
+
+// Dot product of n elements. The vector versions keep two accumulators of a full register each: 8 double or 16 float
+// lanes.
+static double dot_row(const double* a, const double* b, size_t n)
+{
+    size_t i = 0;
+    double d = 0;
+#if defined(__AVX2__)
+    __m256d s0 = _mm256_setzero_pd();
+    __m256d s1 = _mm256_setzero_pd();
+    for (; i + 8 <= n; i += 8)
+    {
+        s0 = _mm256_add_pd(s0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        s1 = _mm256_add_pd(s1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(s0, s1));
+    d = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+    for (; i < n; ++i)
+        d += a[i] * b[i];
+    return d;
+}
+
+static float dot_row(const float* a, const float* b, size_t n)
+{
+    size_t i = 0;
+    float d = 0;
+#if defined(__AVX2__)
+    __m256 s0 = _mm256_setzero_ps();
+    __m256 s1 = _mm256_setzero_ps();
+    for (; i + 16 <= n; i += 16)
+    {
+        s0 = _mm256_add_ps(s0, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+        s1 = _mm256_add_ps(s1, _mm256_mul_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8)));
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, _mm256_add_ps(s0, s1));
+    d = ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+#endif
+    for (; i < n; ++i)
+        d += a[i] * b[i];
+    return d;
 }
 
 MatrixData dot(const MatrixData& v1, const MatrixData& v2)
 {
-    MatrixData out;
-    out.data.resize(v1.data.size() / v2.data.size(), 0);
+    if (v2.size() == 0 || v1.size() % v2.size() != 0)
+        throw std::runtime_error("matrix size is not a multiple of the vector size");
+    auto type = common_type(v1.element_type(), v2.element_type());
+    auto a = v1.contiguous(type);
+    auto b = v2.contiguous(type);
+
+    MatrixData out(MatrixExtents{(int)(v1.size() / v2.size())}, type);
+    dispatch_element_type(type, [&](auto zero) {
+        using T = decltype(zero);
+        const T* pa = a.data_as<T>();
+        const T* pb = b.data_as<T>();
+        T* po = out.mutable_data_as<T>();
+        size_t n = b.size();
+        for (size_t k = 0; k < out.size(); ++k)
+            po[k] = dot_row(pa + k * n, pb, n);
+    });
+    return out;
+}
+
+// Blocked GEMM in the style of Goto/BLIS: C is walked in NC x KC x MC blocks, the current A and B blocks are packed
+// into contiguous MR- and NR-wide panels, and a register-blocked micro-kernel computes one MR x NR tile of C at a time.
+// Block sizes are tuned for double precision on AVX2 parts (L1 holds one KC x NR sliver of B, L2 one MC x KC block of
+// A). A row of the tile is two AVX2 vectors, so float tiles are twice as wide and the slivers stay the same size.
+static constexpr int GEMM_MR = 6;
+template<class T>
+static constexpr int GEMM_NR = 64 / sizeof(T);
+static constexpr int GEMM_MC = 72;
+static constexpr int GEMM_KC = 256;
+static constexpr int GEMM_NC = 4080;
 
-    int k = 0;
-    for (size_t i = 0; i < v1.data.size();)
+// Below this many multiply-adds the packing overhead outweighs the blocked kernel.
+static constexpr size_t GEMM_NAIVE_THRESHOLD = 32 * 32 * 32;
+
+// Packs the mc x kc block of A at `a` (row stride lda) into MR-row panels laid out k-major, zero-padding the last
+// panel.
+template<class T>
+static void pack_a(int mc, int kc, const T* a, size_t lda, T* out)
+{
+    for (int i = 0; i < mc; i += GEMM_MR)
     {
-        double d = 0;
-        for (size_t j = 0; j < v2.data.size(); ++j, ++i)
+        int mr = std::min(GEMM_MR, mc - i);
+        for (int k = 0; k < kc; ++k)
         {
-            d += v1.data[i] * v2.data[j];
+            int r = 0;
+            for (; r < mr; ++r)
+                *out++ = a[(i + r) * lda + k];
+            for (; r < GEMM_MR; ++r)
+                *out++ = 0;
         }
-        out.data[k++] = d;
     }
+}
 
-    return out;
+// Packs the kc x nc block of B at `b` (row stride ldb) into NR-column panels laid out k-major, zero-padding the last
+// panel.
+template<class T>
+static void pack_b(int kc, int nc, const T* b, size_t ldb, T* out)
+{
+    constexpr int NR = GEMM_NR<T>;
+    for (int j = 0; j < nc; j += NR)
+    {
+        int nr = std::min(NR, nc - j);
+        for (int k = 0; k < kc; ++k)
+        {
+            const T* row = b + k * ldb + j;
+            int c = 0;
+            for (; c < nr; ++c)
+                *out++ = row[c];
+            for (; c < NR; ++c)
+                *out++ = 0;
+        }
+    }
 }
 
-MatrixData multiply_matrix(const MatrixData& left, const MatrixData& right, int extent)
+// Computes the full MR x NR product of one A panel and one B panel into `ab` (row-major, row stride NR).
+template<class T>
+static void gemm_micro_kernel_generic(int kc, const T* a, const T* b, T* ab)
 {
-    auto left_extent = left.data.size() / extent;
-    auto right_extent = right.data.size() / extent;
-    MatrixData ret;
-    ret.data.resize(left_extent * right_extent, 0.0);
-    for (size_t i = 0; i < left_extent; ++i)
+    constexpr int NR = GEMM_NR<T>;
+    T c[GEMM_MR][NR] = {};
+    for (int k = 0; k < kc; ++k, a += GEMM_MR, b += NR)
     {
-        for (size_t j = 0; j < right_extent; ++j)
+        for (int r = 0; r < GEMM_MR; ++r)
         {
-            for (int k = 0; k < extent; ++k)
-            {
-                ret.data[j + i * right_extent] += left.data[k + i * extent] * right.data[j + k * right_extent];
-            }
+            T ar = a[r];
+            for (int j = 0; j < NR; ++j)
+                c[r][j] += ar * b[j];
         }
     }
-    return ret;
+    for (int r = 0; r < GEMM_MR; ++r)
+        for (int j = 0; j < NR; ++j)
+            ab[r * NR + j] = c[r][j];
 }
 
-MatrixData inner_product(const MatrixData& m1, const MatrixData& m2, int inner_extent, int stride1, int stride2)
+#if defined(SH_GEMM_AVX2)
+static SH_GEMM_AVX2_TARGET void gemm_micro_kernel_avx2(int kc, const double* a, const double* b, double* ab)
 {
-    auto m1_d1 = stride1;
-    auto m1_d2 = inner_extent;
-    auto m1_d3 = m1.data.size() / m1_d1 / m1_d2;
+    constexpr int NR = GEMM_NR<double>;
+    __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+    __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+    __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+    __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+    __m256d c40 = _mm256_setzero_pd(), c41 = _mm256_setzero_pd();
+    __m256d c50 = _mm256_setzero_pd(), c51 = _mm256_setzero_pd();
+
+    for (int k = 0; k < kc; ++k, a += GEMM_MR, b += NR)
+    {
+        __m256d b0 = _mm256_loadu_pd(b);
+        __m256d b1 = _mm256_loadu_pd(b + 4);
+        __m256d ai;
+
+        ai = _mm256_broadcast_sd(a + 0);
+        c00 = _mm256_fmadd_pd(ai, b0, c00);
+        c01 = _mm256_fmadd_pd(ai, b1, c01);
+        ai = _mm256_broadcast_sd(a + 1);
+        c10 = _mm256_fmadd_pd(ai, b0, c10);
+        c11 = _mm256_fmadd_pd(ai, b1, c11);
+        ai = _mm256_broadcast_sd(a + 2);
+        c20 = _mm256_fmadd_pd(ai, b0, c20);
+        c21 = _mm256_fmadd_pd(ai, b1, c21);
+        ai = _mm256_broadcast_sd(a + 3);
+        c30 = _mm256_fmadd_pd(ai, b0, c30);
+        c31 = _mm256_fmadd_pd(ai, b1, c31);
+        ai = _mm256_broadcast_sd(a + 4);
+        c40 = _mm256_fmadd_pd(ai, b0, c40);
+        c41 = _mm256_fmadd_pd(ai, b1, c41);
+        ai = _mm256_broadcast_sd(a + 5);
+        c50 = _mm256_fmadd_pd(ai, b0, c50);
+        c51 = _mm256_fmadd_pd(ai, b1, c51);
+    }
 
-    auto m2_d1 = stride2;
-    auto m2_d2 = inner_extent;
-    auto m2_d3 = m2.data.size() / m2_d1 / m2_d2;
+    _mm256_storeu_pd(ab + 0 * NR, c00);
+    _mm256_storeu_pd(ab + 0 * NR + 4, c01);
+    _mm256_storeu_pd(ab + 1 * NR, c10);
+    _mm256_storeu_pd(ab + 1 * NR + 4, c11);
+    _mm256_storeu_pd(ab + 2 * NR, c20);
+    _mm256_storeu_pd(ab + 2 * NR + 4, c21);
+    _mm256_storeu_pd(ab + 3 * NR, c30);
+    _mm256_storeu_pd(ab + 3 * NR + 4, c31);
+    _mm256_storeu_pd(ab + 4 * NR, c40);
+    _mm256_storeu_pd(ab + 4 * NR + 4, c41);
+    _mm256_storeu_pd(ab + 5 * NR, c50);
+    _mm256_storeu_pd(ab + 5 * NR + 4, c51);
+}
 
-    MatrixData ret;
-    ret.data.resize(m1.data.size() / inner_extent * m2.data.size() / inner_extent);
+static SH_GEMM_AVX2_TARGET void gemm_micro_kernel_avx2(int kc, const float* a, const float* b, float* ab)
+{
+    constexpr int NR = GEMM_NR<float>;
+    __m256 c[GEMM_MR][2];
+    for (int r = 0; r < GEMM_MR; ++r)
+        c[r][0] = c[r][1] = _mm256_setzero_ps();
 
-    for (int i1 = 0; i1 < m1_d1; ++i1)
+    for (int k = 0; k < kc; ++k, a += GEMM_MR, b += NR)
     {
-        for (int i2 = 0; i2 < m2_d1; ++i2)
+        __m256 b0 = _mm256_loadu_ps(b);
+        __m256 b1 = _mm256_loadu_ps(b + 8);
+        for (int r = 0; r < GEMM_MR; ++r)
         {
-            for (size_t k2 = 0; k2 < m2_d3; ++k2)
+            __m256 ai = _mm256_broadcast_ss(a + r);
+            c[r][0] = _mm256_fmadd_ps(ai, b0, c[r][0]);
+            c[r][1] = _mm256_fmadd_ps(ai, b1, c[r][1]);
+        }
+    }
+
+    for (int r = 0; r < GEMM_MR; ++r)
+    {
+        _mm256_storeu_ps(ab + r * NR, c[r][0]);
+        _mm256_storeu_ps(ab + r * NR + 8, c[r][1]);
+    }
+}
+#endif
+
+template<class T>
+using GemmMicroKernel = void (*)(int kc, const T* a, const T* b, T* ab);
+
+// The micro-kernel for this build and CPU.
+template<class T>
+static GemmMicroKernel<T> select_gemm_micro_kernel()
+{
+#if defined(SH_GEMM_AVX2_DISPATCH)
+    if (cpu_has_avx2_fma()) return gemm_micro_kernel_avx2;
+    return gemm_micro_kernel_generic<T>;
+#elif defined(SH_GEMM_AVX2)
+    return gemm_micro_kernel_avx2;
+#else
+    return gemm_micro_kernel_generic<T>;
+#endif
+}
+
+template<class T>
+static void multiply_matrix_naive(const T* a, const T* b, T* c, size_t m, size_t n, size_t k)
+{
+    for (size_t i = 0; i < m; ++i)
+    {
+        T* c_row = c + i * n;
+        for (size_t p = 0; p < k; ++p)
+        {
+            T a_ip = a[p + i * k];
+            const T* b_row = b + p * n;
+            for (size_t j = 0; j < n; ++j)
+                c_row[j] += a_ip * b_row[j];
+        }
+    }
+}
+
+template<class T>
+static void multiply_matrix_blocked(const T* a, const T* b, T* c, size_t m, size_t n, size_t k)
+{
+    constexpr int NR = GEMM_NR<T>;
+    std::vector<T> packed_a((size_t)GEMM_MC * GEMM_KC);
+    std::vector<T> packed_b((size_t)GEMM_KC * (GEMM_NC + NR));
+    T ab[GEMM_MR * NR];
+    auto micro_kernel = select_gemm_micro_kernel<T>();
+
+    for (size_t jc = 0; jc < n; jc += GEMM_NC)
+    {
+        int nc = (int)std::min<size_t>(GEMM_NC, n - jc);
+        for (size_t pc = 0; pc < k; pc += GEMM_KC)
+        {
+            int kc = (int)std::min<size_t>(GEMM_KC, k - pc);
+            pack_b(kc, nc, b + pc * n + jc, n, packed_b.data());
+
+            for (size_t ic = 0; ic < m; ic += GEMM_MC)
             {
-                for (size_t k1 = 0; k1 < m1_d3; ++k1)
+                int mc = (int)std::min<size_t>(GEMM_MC, m - ic);
+                pack_a(mc, kc, a + ic * k + pc, k, packed_a.data());
+
+                for (int jr = 0; jr < nc; jr += NR)
                 {
-                    double v = 0.0;
-                    for (int j = 0; j < inner_extent; ++j)
+                    int nr = std::min(NR, nc - jr);
+                    for (int ir = 0; ir < mc; ir += GEMM_MR)
                     {
-                        v +=
-                            m1.data[i1 + j * m1_d1 + k1 * m1_d1 * m1_d2] * m2.data[i2 + j * m2_d1 + k2 * m2_d1 * m2_d2];
+                        int mr = std::min(GEMM_MR, mc - ir);
+                        micro_kernel(kc, packed_a.data() + ir * kc, packed_b.data() + jr * kc, ab);
+
+                        T* c_tile = c + (ic + ir) * n + jc + jr;
+                        for (int r = 0; r < mr; ++r)
+                            for (int j = 0; j < nr; ++j)
+                                c_tile[r * n + j] += ab[r * NR + j];
                     }
-                    ret.data[i1 + m1_d1 * (i2 + m2_d1 * (k2 + m2_d3 * k1))] = v;
                 }
             }
         }
     }
+}
+
+MatrixData multiply_matrix(const MatrixData& left, const MatrixData& right, int extent)
+{
+    if (extent <= 0) throw std::runtime_error("matrix extent must be positive");
+    auto left_extent = left.size() / extent;
+    auto right_extent = right.size() / extent;
+    auto type = common_type(left.element_type(), right.element_type());
+    auto a = left.contiguous(type);
+    auto b = right.contiguous(type);
+    MatrixData ret(MatrixExtents{(int)right_extent, (int)left_extent}, type);
+    dispatch_element_type(type, [&](auto zero) {
+        using T = decltype(zero);
+        const T* pa = a.data_as<T>();
+        const T* pb = b.data_as<T>();
+        T* pc = ret.mutable_data_as<T>();
+        if (left_extent * right_extent * extent < GEMM_NAIVE_THRESHOLD)
+            multiply_matrix_naive(pa, pb, pc, left_extent, right_extent, extent);
+        else
+            multiply_matrix_blocked(pa, pb, pc, left_extent, right_extent, extent);
+    });
+    return ret;
+}
+
+MatrixData inner_product(
+    const MatrixData& m1, const MatrixData& m2, int inner_extent, int stride1, int stride2, ThreadPool* pool)
+{
+    if (inner_extent <= 0 || stride1 <= 0 || stride2 <= 0)
+        throw std::runtime_error("inner product extents must be positive");
+    size_t m1_d1 = stride1;
+    size_t m1_d2 = inner_extent;
+    size_t m1_d3 = m1.size() / m1_d1 / m1_d2;
+
+    size_t m2_d1 = stride2;
+    size_t m2_d2 = inner_extent;
+    size_t m2_d3 = m2.size() / m2_d1 / m2_d2;
+
+    auto type = common_type(m1.element_type(), m2.element_type());
+    auto a1 = m1.contiguous(type, pool);
+    auto a2 = m2.contiguous(type, pool);
+    MatrixData ret(MatrixExtents{(int)m1_d1, (int)m2_d1, (int)m2_d3, (int)m1_d3}, type);
+
+    // The output is laid out as ret[i1 + m1_d1 * (i2 + m2_d1 * (k2 + m2_d3 * k1))], so each (k1, k2, i2) triple owns a
+    // contiguous row of m1_d1 outputs. Rows are independent and are handed out to the pool; within a row, i1 is the
+    // unit-stride index of both m1 and ret, so it goes innermost and vectorizes at the full width of the element type.
+    dispatch_element_type(type, [&](auto zero) {
+        using T = decltype(zero);
+        const T* a_base = a1.data_as<T>();
+        const T* b_base = a2.data_as<T>();
+        T* out_base = ret.mutable_data_as<T>();
+        auto rows = [&](size_t begin, size_t end) {
+            for (size_t r = begin; r < end; ++r)
+            {
+                size_t i2 = r % m2_d1;
+                size_t k2 = r / m2_d1 % m2_d3;
+                size_t k1 = r / m2_d1 / m2_d3;
+
+                const T* a = a_base + k1 * m1_d1 * m1_d2;
+                const T* b = b_base + i2 + k2 * m2_d1 * m2_d2;
+                T* out = out_base + r * m1_d1;
+
+                if (m1_d1 == 1)
+                {
+                    T v = 0;
+                    for (size_t j = 0; j < m1_d2; ++j)
+                        v += a[j] * b[j * m2_d1];
+                    out[0] = v;
+                    continue;
+                }
+
+                for (size_t j = 0; j < m1_d2; ++j)
+                {
+                    const T* a_j = a + j * m1_d1;
+                    T b_j = b[j * m2_d1];
+                    for (size_t i1 = 0; i1 < m1_d1; ++i1)
+                        out[i1] += a_j[i1] * b_j;
+                }
+            }
+        };
+
+        size_t row_count = m1_d3 * m2_d3 * m2_d1;
+        if (pool)
+            pool->parallel_for(row_count, std::max<size_t>(1, 16384 / (m1_d1 * m1_d2)), rows);
+        else
+            rows(0, row_count);
+    });
     return ret;
 }
@@ -1,22 +1,162 @@
 #pragma once
 
+#include <fmt/format.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
 #include <initializer_list>
+#include <memory>
+#include <mutex>
 #include <vector>
 
+struct ThreadPool;
+
 struct VectorData
 {
     std::vector<double> data;
 };
 
+// Element type of a matrix. F32 halves the memory, and the bandwidth, of every pass over the elements. Operations on
+// several matrices compute in F32 only when all of them are F32; otherwise the F32 operands are widened to F64 first.
+// Operations with a scalar keep the matrix's type, and reductions to a scalar accumulate in double either way.
+enum class ElementType : uint8_t
+{
+    F64,
+    F32,
+};
+
+template<class T>
+struct ElementTraits;
+template<>
+struct ElementTraits<double>
+{
+    static constexpr ElementType type = ElementType::F64;
+    static constexpr const char* name = "f64";
+};
+template<>
+struct ElementTraits<float>
+{
+    static constexpr ElementType type = ElementType::F32;
+    static constexpr const char* name = "f32";
+};
+
+inline ElementType common_type(ElementType a, ElementType b)
+{
+    return a == ElementType::F32 && b == ElementType::F32 ? ElementType::F32 : ElementType::F64;
+}
+
+// Calls f with a zero of the C++ type that holds `type`'s elements, so a generic lambda can take its element type
+// from decltype of its argument.
+template<class F>
+decltype(auto) dispatch_element_type(ElementType type, F&& f)
+{
+    if (type == ElementType::F32) return f(0.0f);
+    return f(0.0);
+}
+
+// Logical shape of a matrix, fastest-varying dimension first.
 struct MatrixExtents
 {
+    MatrixExtents() = default;
+    MatrixExtents(std::initializer_list<int> ilist) : extents(ilist) {}
+    explicit MatrixExtents(std::vector<int> e) : extents(std::move(e)) {}
+
+    int rank() const { return (int)extents.size(); }
+    size_t size() const;
+
     std::vector<int> extents;
 };
 
+// Recycles matrix storage by size class, so freeing an intermediate and allocating the next one of a similar size
+// skips the system allocator. Blocks are 64-byte aligned and padded to a whole number of 64-byte lines; classes are
+// spaced four to an octave, so at most a quarter of a block is slack.
+struct MatrixPool
+{
+    static constexpr size_t ALIGNMENT = 64;
+    static constexpr size_t LINE_DOUBLES = ALIGNMENT / sizeof(double);
+
+    struct Stats
+    {
+        size_t hits;
+        size_t misses;
+        size_t cached_bytes;
+        size_t cached_blocks;
+        // Bytes handed out since the pool was created, counting padding; not cleared by reset_stats.
+        uint64_t allocated_bytes;
+    };
+
+    // The pool owned by this module. Never destroyed, so buffers may outlive static destruction.
+    static MatrixPool& global();
+
+    explicit MatrixPool(size_t max_cached_bytes) : m_max_cached_bytes(max_cached_bytes) {}
+    MatrixPool(const MatrixPool&) = delete;
+    MatrixPool& operator=(const MatrixPool&) = delete;
+    ~MatrixPool() { trim(); }
+
+    // A block of at least `n` doubles; `capacity` receives its padded size in doubles.
+    double* allocate(size_t n, size_t& capacity);
+    void release(double* p, size_t capacity);
+    // Frees every cached block.
+    void trim();
+
+    Stats stats() const;
+    void reset_stats();
+
+private:
+    static constexpr int CLASS_COUNT = 256;
+
+    std::vector<double*> m_free[CLASS_COUNT];
+    size_t m_hits = 0;
+    size_t m_misses = 0;
+    size_t m_cached_bytes = 0;
+    size_t m_cached_blocks = 0;
+    uint64_t m_allocated_bytes = 0;
+    size_t m_max_cached_bytes;
+    mutable std::mutex m_mutex;
+};
+
+// Element storage shared between a matrix and the views taken of it. The elements are either owned by the buffer,
+// which takes them from a MatrixPool and hands them back when it dies, or borrowed from memory (such as a mapped
+// snapshot file) that `owner` keeps alive. Owned storage is zero past size() up to the padded capacity. Sizes count
+// doubles; an F32 matrix packs two elements into each.
+struct MatrixBuffer
+{
+    explicit MatrixBuffer(size_t n, double fill = 0.0, MatrixPool& pool = MatrixPool::global());
+    MatrixBuffer(double* data, size_t n, std::shared_ptr<void> owner)
+        : m_data(data), m_size(n), m_owner(std::move(owner))
+    {
+    }
+    ~MatrixBuffer();
+
+    MatrixBuffer(const MatrixBuffer&) = delete;
+    MatrixBuffer& operator=(const MatrixBuffer&) = delete;
+
+    double* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    double* m_data;
+    size_t m_size;
+    size_t m_capacity = 0;
+    MatrixPool* m_pool = nullptr;
+    std::shared_ptr<void> m_owner;
+};
+
+// A strided view of a MatrixBuffer. clone, reshape, swap_axes and slice are O(1) and share the source's buffer, which
+// is copy-on-write: kernels that need dense input call contiguous(), which only copies when the view is actually
+// strided, and in-place updates go through mutable_data(), which first gives the matrix a dense buffer of its own if
+// the current one is strided or shared.
 struct MatrixData
 {
+    // An empty placeholder of rank 0; does not allocate, so it is cheap to embed in Value.
     MatrixData() = default;
-    MatrixData(std::initializer_list<double> ilist) : data(ilist) {}
+    explicit MatrixData(size_t size, double fill = 0.0);
+    explicit MatrixData(MatrixExtents extents, double fill = 0.0);
+    MatrixData(MatrixExtents extents, ElementType type, double fill = 0.0);
+    // Dense matrix over an existing buffer, which must hold at least extents.size() elements of `type`.
+    MatrixData(MatrixExtents extents, std::shared_ptr<MatrixBuffer> buffer, ElementType type = ElementType::F64);
+    MatrixData(std::initializer_list<double> ilist);
 
     MatrixData(MatrixData&&) = default;
     MatrixData(const MatrixData&) = delete;
@@ -24,47 +164,191 @@ struct MatrixData
     MatrixData& operator=(MatrixData&&) = default;
     MatrixData& operator=(const MatrixData&) = delete;
 
-    MatrixData clone() const
+    MatrixData clone() const { return alias(); }
+    // Dense private copy of the viewed elements. Large transposed views are copied on `pool` when one is given.
+    MatrixData copy(ThreadPool* pool = nullptr) const;
+
+    const MatrixExtents& extents() const { return m_extents; }
+    int rank() const { return m_extents.rank(); }
+    size_t size() const { return m_size; }
+    ElementType element_type() const { return m_type; }
+
+    bool is_contiguous() const;
+    // Contiguous and the only view of its buffer, so its elements may be overwritten without a copy.
+    bool is_exclusive() const { return m_buffer && m_buffer.use_count() == 1 && is_contiguous(); }
+    MatrixData contiguous(ThreadPool* pool = nullptr) const;
+    // Contiguous with elements of `type`; a matrix of another type is converted into a dense copy.
+    MatrixData contiguous(ElementType type, ThreadPool* pool = nullptr) const;
+    // Only valid on contiguous matrices whose elements are T.
+    template<class T>
+    const T* data_as() const
+    {
+        check_element_type(ElementTraits<T>::type);
+        return static_cast<const T*>(raw_data());
+    }
+    template<class T>
+    T* mutable_data_as()
     {
-        MatrixData ret;
-        ret.data = data;
-        return ret;
+        check_element_type(ElementTraits<T>::type);
+        return static_cast<T*>(mutable_raw_data());
     }
+    const double* data() const { return data_as<double>(); }
+    double* mutable_data() { return mutable_data_as<double>(); }
+    // T must match the element type.
+    template<class T>
+    void copy_to(T* out, ThreadPool* pool = nullptr) const;
+    // Element `index` in the order of the view's elements, read in place through its strides; for reading a few
+    // elements of a view without copying it.
+    double element(size_t index) const;
 
-    std::vector<double> data;
-};
+    MatrixData reshape(MatrixExtents extents) const;
+    MatrixData swap_axes(int axis1, int axis2) const;
+    MatrixData slice(int axis, int begin, int end) const;
 
-struct MatrixView
-{
-    MatrixExtents& e;
-    MatrixData& d;
+private:
+    struct AliasTag
+    {
+    };
+    MatrixData(const MatrixData& src, AliasTag);
+    MatrixData alias() const { return {*this, AliasTag{}}; }
+
+    void check_element_type(ElementType type) const;
+    const void* raw_data() const;
+    void* mutable_raw_data();
+
+    MatrixExtents m_extents;
+    std::vector<ptrdiff_t> m_strides;
+    ptrdiff_t m_offset = 0;
+    size_t m_size = 0;
+    ElementType m_type = ElementType::F64;
+    std::shared_ptr<MatrixBuffer> m_buffer;
 };
 
 MatrixData multiply_matrix(const MatrixData& left, const MatrixData& right, int extent);
 
 MatrixData dot(const MatrixData& v1, const MatrixData& v2);
-void display(const MatrixData& m, int columns = 4);
 
+// Reductions (reduce.cpp). COMPENSATED summation carries a Neumaier error term per SIMD lane, so sums of 10^8
+// elements keep nearly full precision at a modest cost over FAST.
+enum class Summation
+{
+    FAST,
+    COMPENSATED,
+};
+
+enum class Reduction
+{
+    SUM,
+    MEAN,
+    MIN,
+    MAX,
+    ARGMAX,
+    NORM,
+};
+
+double sum(const MatrixData& m, Summation mode = Summation::FAST);
+double mean(const MatrixData& m, Summation mode = Summation::FAST);
+double minimum(const MatrixData& m);
+double maximum(const MatrixData& m);
+// Index of the first largest element, in the order of the matrix's elements.
+size_t argmax(const MatrixData& m);
+// Euclidean norm of all elements.
+double norm(const MatrixData& m, Summation mode = Summation::FAST);
+// Reduces along `axis`, dropping it from the result's extents; ARGMAX yields indices along the axis.
+MatrixData reduce_axis(const MatrixData& m, Reduction op, int axis, Summation mode = Summation::FAST);
+// Appends m to `out`, one row per `columns` elements; by default rows follow the innermost extent of matrices of rank 2
+// or more. When `limit` is nonzero and m has more elements than that, only the first and last few rows and columns are
+// shown, followed by the shape. When `stream` is given, the buffer is written to it and emptied each time it fills.
+void format_matrix(fmt::memory_buffer& out,
+                   const MatrixData& m,
+                   size_t limit = 0,
+                   int columns = 0,
+                   FILE* stream = nullptr);
+// Prints the whole matrix to stdout in large writes.
+void display(const MatrixData& m, int columns = 0);
+
+// (src * mult) viewed as mult.size() x N and transposed, divided by div, computed in one pass over src.
 MatrixData bayes_rule(const MatrixData& src, const MatrixData& mult, const MatrixData& div);
 
+void check_by_element(const MatrixData& m, const MatrixData& v);
+
+// `func` is called with two elements of the operands' common type, so it should be generic over float and double.
 template<class BinaryFunc>
 MatrixData by_element(const MatrixData& m, const MatrixData& v, BinaryFunc func)
 {
-    MatrixData ret;
-    ret.data.resize(m.data.size());
-    for (size_t i_m = 0; i_m < m.data.size();)
-    {
-        for (size_t i_v = 0; i_v < v.data.size(); ++i_v, ++i_m)
+    check_by_element(m, v);
+    auto type = common_type(m.element_type(), v.element_type());
+    auto a = m.contiguous(type);
+    auto b = v.contiguous(type);
+    MatrixData ret(m.extents(), type);
+    dispatch_element_type(type, [&](auto zero) {
+        using T = decltype(zero);
+        const T* pa = a.data_as<T>();
+        const T* pb = b.data_as<T>();
+        T* out = ret.mutable_data_as<T>();
+        for (size_t i_m = 0; i_m < a.size();)
         {
-            ret.data[i_m] = func(m.data[i_m], v.data[i_v]);
+            for (size_t i_v = 0; i_v < b.size(); ++i_v, ++i_m)
+            {
+                out[i_m] = func(pa[i_m], pb[i_v]);
+            }
         }
-    }
+    });
     return ret;
 }
 
+// As above, but writes the result over `m` when `m` is the only view of its buffer and already has the result's type.
+template<class BinaryFunc>
+MatrixData by_element(MatrixData&& m, const MatrixData& v, BinaryFunc func)
+{
+    auto type = common_type(m.element_type(), v.element_type());
+    if (!m.is_exclusive() || m.element_type() != type) return by_element(static_cast<const MatrixData&>(m), v, func);
+    check_by_element(m, v);
+    auto b = v.contiguous(type);
+    dispatch_element_type(type, [&](auto zero) {
+        using T = decltype(zero);
+        const T* pb = b.data_as<T>();
+        T* out = m.mutable_data_as<T>();
+        for (size_t i_m = 0; i_m < m.size();)
+        {
+            for (size_t i_v = 0; i_v < b.size(); ++i_v, ++i_m)
+            {
+                out[i_m] = func(out[i_m], pb[i_v]);
+            }
+        }
+    });
+    return std::move(m);
+}
+
 MatrixData multiply(const MatrixData& m, const MatrixData& v);
+MatrixData multiply(MatrixData&& m, const MatrixData& v);
+// Views of v1 as extent x N (resp. extent1 x extent2 x N) with the first two axes exchanged; no elements are copied.
 MatrixData transpose(const MatrixData& v1, int extent);
 MatrixData transpose2(const MatrixData& v1, int extent1, int extent2);
+// dst[c * ld_dst + r] = src[r * ld_src + c] for a rows x cols block, in cache-sized tiles of 4x4 register transposes.
+// Runs on `pool` when one is given and the block is large.
+void transpose_copy(const double* src,
+                    ptrdiff_t ld_src,
+                    double* dst,
+                    ptrdiff_t ld_dst,
+                    size_t rows,
+                    size_t cols,
+                    ThreadPool* pool = nullptr);
+// The same in 8x8 tiles of floats.
+void transpose_copy(const float* src,
+                    ptrdiff_t ld_src,
+                    float* dst,
+                    ptrdiff_t ld_dst,
+                    size_t rows,
+                    size_t cols,
+                    ThreadPool* pool = nullptr);
 MatrixData divide(const MatrixData& m, const MatrixData& v);
+MatrixData divide(MatrixData&& m, const MatrixData& v);
 
-MatrixData inner_product(const MatrixData& m1, const MatrixData& m2, int inner_extent, int stride1, int stride2);
+// Contracts m1 and m2 over their middle dimension. Runs on `pool` when one is given.
+MatrixData inner_product(const MatrixData& m1,
+                         const MatrixData& m2,
+                         int inner_extent,
+                         int stride1,
+                         int stride2,
+                         ThreadPool* pool = nullptr);
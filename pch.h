@@ -13,8 +13,12 @@
 #include <unordered_map>
 #include <vector>
 
+#if defined(_WIN32)
 #define NOMINMAX
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
+#else
+#include <experimental/filesystem>
+#endif
 
 namespace fs = std::experimental::filesystem;
\ No newline at end of file
@@ -0,0 +1,110 @@
+#include "pch.h"
+
+#include "profile.h"
+
+#include <algorithm>
+#include <vector>
+
+static int histogram_bucket(uint64_t ns)
+{
+    int b = 0;
+    while (ns > 1 && b < Profiler::HISTOGRAM_BUCKETS - 1)
+    {
+        ns >>= 1;
+        ++b;
+    }
+    return b;
+}
+
+void Profiler::record(std::string_view label, Clock::duration elapsed, uint64_t bytes)
+{
+    auto ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    auto it = m_entries.find(label);
+    if (it == m_entries.end()) it = m_entries.emplace(std::string(label), Entry{}).first;
+    auto& e = it->second;
+    ++e.calls;
+    e.total_ns += ns;
+    e.min_ns = std::min(e.min_ns, ns);
+    e.max_ns = std::max(e.max_ns, ns);
+    e.bytes += bytes;
+    ++e.histogram[histogram_bucket(ns)];
+}
+
+std::string Profiler::table() const
+{
+    std::vector<const std::pair<const std::string, Entry>*> rows;
+    for (auto&& p : m_entries)
+        rows.push_back(&p);
+    std::sort(rows.begin(), rows.end(), [](auto a, auto b) { return a->second.total_ns > b->second.total_ns; });
+
+    fmt::memory_buffer out;
+    auto it = std::back_inserter(out);
+    fmt::format_to(it,
+                   "{:<16} {:>10} {:>12} {:>10} {:>10} {:>10} {:>14}\n",
+                   "command",
+                   "calls",
+                   "total ms",
+                   "mean us",
+                   "min us",
+                   "max us",
+                   "bytes");
+    for (auto p : rows)
+    {
+        auto& e = p->second;
+        fmt::format_to(it,
+                       "{:<16} {:>10} {:>12.3f} {:>10.3f} {:>10.3f} {:>10.3f} {:>14}\n",
+                       p->first,
+                       e.calls,
+                       e.total_ns / 1e6,
+                       e.total_ns / 1e3 / e.calls,
+                       e.min_ns / 1e3,
+                       e.max_ns / 1e3,
+                       e.bytes);
+    }
+    return fmt::to_string(out);
+}
+
+static void append_json_string(fmt::memory_buffer& out, std::string_view s)
+{
+    out.push_back('"');
+    for (char ch : s)
+    {
+        if (ch == '"' || ch == '\\')
+        {
+            out.push_back('\\');
+            out.push_back(ch);
+        }
+        else if ((unsigned char)ch < 0x20)
+            fmt::format_to(std::back_inserter(out), "\\u{:04x}", (unsigned)ch);
+        else
+            out.push_back(ch);
+    }
+    out.push_back('"');
+}
+
+std::string Profiler::json() const
+{
+    fmt::memory_buffer out;
+    auto it = std::back_inserter(out);
+    fmt::format_to(it, "{{\"histogram\":\"log2 ns\",\"commands\":[");
+    const char* sep = "";
+    for (auto&& p : m_entries)
+    {
+        auto& e = p.second;
+        fmt::format_to(it, "{}{{\"name\":", sep);
+        append_json_string(out, p.first);
+        fmt::format_to(it,
+                       ",\"calls\":{},\"total_ns\":{},\"min_ns\":{},\"max_ns\":{},\"bytes\":{},\"histogram\":[",
+                       e.calls,
+                       e.total_ns,
+                       e.min_ns,
+                       e.max_ns,
+                       e.bytes);
+        for (int b = 0; b < HISTOGRAM_BUCKETS; ++b)
+            fmt::format_to(it, "{}{}", b ? "," : "", e.histogram[b]);
+        fmt::format_to(it, "]}}");
+        sep = ",";
+    }
+    fmt::format_to(it, "]}}\n");
+    return fmt::to_string(out);
+}
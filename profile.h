@@ -0,0 +1,44 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+
+// Per-command timing and allocation counters for the interpreter's dispatch loop. A sample costs two clock reads, two
+// reads of the pools' allocation counters and a map lookup, so callers check enabled() first; when profiling is off,
+// dispatch pays a single branch.
+struct Profiler
+{
+    // Latencies are bucketed by powers of two nanoseconds; the last bucket collects everything slower.
+    static constexpr int HISTOGRAM_BUCKETS = 32;
+
+    struct Entry
+    {
+        uint64_t calls = 0;
+        uint64_t total_ns = 0;
+        uint64_t min_ns = UINT64_MAX;
+        uint64_t max_ns = 0;
+        uint64_t bytes = 0;
+        std::array<uint64_t, HISTOGRAM_BUCKETS> histogram = {};
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    bool enabled() const { return m_enabled; }
+    void set_enabled(bool enabled) { m_enabled = enabled; }
+
+    void record(std::string_view label, Clock::duration elapsed, uint64_t bytes);
+    void reset() { m_entries.clear(); }
+
+    // A table sorted by total time, for the console.
+    std::string table() const;
+    std::string json() const;
+
+private:
+    bool m_enabled = false;
+    std::map<std::string, Entry, std::less<>> m_entries;
+};
@@ -0,0 +1,363 @@
+#include "pch.h"
+
+#include "matrix.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    struct Identity
+    {
+        double operator()(double x) const { return x; }
+#if defined(__AVX2__)
+        __m256d operator()(__m256d x) const { return x; }
+#endif
+    };
+
+    struct Square
+    {
+        double operator()(double x) const { return x * x; }
+#if defined(__AVX2__)
+        __m256d operator()(__m256d x) const { return _mm256_mul_pd(x, x); }
+#endif
+    };
+
+    // Neumaier's variant of Kahan summation: adds x to s, keeping the rounding error in c.
+    inline void neumaier_add(double& s, double& c, double x)
+    {
+        double t = s + x;
+        c += std::fabs(s) >= std::fabs(x) ? (s - t) + x : (x - t) + s;
+        s = t;
+    }
+
+#if defined(__AVX2__)
+    // Four elements as double lanes. Floats are widened on load, so F32 data is reduced with double accumulators
+    // while reading half the bytes.
+    inline __m256d load4(const double* p) { return _mm256_loadu_pd(p); }
+    inline __m256d load4(const float* p) { return _mm256_cvtps_pd(_mm_loadu_ps(p)); }
+#endif
+}
+
+// Sum of f(p[i]) with four independent accumulators, so the adds pipeline instead of waiting on each other.
+template<class T, class F>
+static double sum_fast(const T* p, size_t n, F f)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256d a0 = _mm256_setzero_pd();
+    __m256d a1 = _mm256_setzero_pd();
+    __m256d a2 = _mm256_setzero_pd();
+    __m256d a3 = _mm256_setzero_pd();
+    for (; i + 16 <= n; i += 16)
+    {
+        a0 = _mm256_add_pd(a0, f(load4(p + i)));
+        a1 = _mm256_add_pd(a1, f(load4(p + i + 4)));
+        a2 = _mm256_add_pd(a2, f(load4(p + i + 8)));
+        a3 = _mm256_add_pd(a3, f(load4(p + i + 12)));
+    }
+    for (; i + 4 <= n; i += 4)
+        a0 = _mm256_add_pd(a0, f(load4(p + i)));
+    double lanes[4];
+    _mm256_storeu_pd(lanes, _mm256_add_pd(_mm256_add_pd(a0, a1), _mm256_add_pd(a2, a3)));
+    double s = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#else
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        s0 += f(p[i]);
+        s1 += f(p[i + 1]);
+        s2 += f(p[i + 2]);
+        s3 += f(p[i + 3]);
+    }
+    double s = (s0 + s1) + (s2 + s3);
+#endif
+    for (; i < n; ++i)
+        s += f(p[i]);
+    return s;
+}
+
+// As sum_fast, but every lane keeps a Neumaier compensation term; the lanes are combined the same way at the end.
+template<class T, class F>
+static double sum_compensated(const T* p, size_t n, F f)
+{
+    double s = 0, c = 0;
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256d abs_mask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7fffffffffffffff));
+    __m256d s0 = _mm256_setzero_pd(), c0 = _mm256_setzero_pd();
+    __m256d s1 = _mm256_setzero_pd(), c1 = _mm256_setzero_pd();
+    auto add = [&](__m256d& vs, __m256d& vc, __m256d x) {
+        __m256d t = _mm256_add_pd(vs, x);
+        __m256d s_bigger = _mm256_cmp_pd(_mm256_and_pd(vs, abs_mask), _mm256_and_pd(x, abs_mask), _CMP_GE_OQ);
+        __m256d big = _mm256_blendv_pd(x, vs, s_bigger);
+        __m256d small = _mm256_blendv_pd(vs, x, s_bigger);
+        vc = _mm256_add_pd(vc, _mm256_add_pd(_mm256_sub_pd(big, t), small));
+        vs = t;
+    };
+    for (; i + 8 <= n; i += 8)
+    {
+        add(s0, c0, f(load4(p + i)));
+        add(s1, c1, f(load4(p + i + 4)));
+    }
+    double ls[8], lc[8];
+    _mm256_storeu_pd(ls, s0);
+    _mm256_storeu_pd(ls + 4, s1);
+    _mm256_storeu_pd(lc, c0);
+    _mm256_storeu_pd(lc + 4, c1);
+    for (int l = 0; l < 8; ++l)
+    {
+        neumaier_add(s, c, ls[l]);
+        c += lc[l];
+    }
+#endif
+    for (; i < n; ++i)
+        neumaier_add(s, c, f(p[i]));
+    return s + c;
+}
+
+template<class T, class F>
+static double sum_with(const T* p, size_t n, Summation mode, F f)
+{
+    return mode == Summation::COMPENSATED ? sum_compensated(p, n, f) : sum_fast(p, n, f);
+}
+
+template<class T>
+static double max_kernel(const T* p, size_t n)
+{
+    size_t i = 0;
+    double best = p[0];
+#if defined(__AVX2__)
+    if (n >= 16)
+    {
+        __m256d m0 = load4(p);
+        __m256d m1 = m0, m2 = m0, m3 = m0;
+        for (; i + 16 <= n; i += 16)
+        {
+            m0 = _mm256_max_pd(m0, load4(p + i));
+            m1 = _mm256_max_pd(m1, load4(p + i + 4));
+            m2 = _mm256_max_pd(m2, load4(p + i + 8));
+            m3 = _mm256_max_pd(m3, load4(p + i + 12));
+        }
+        double lanes[4];
+        _mm256_storeu_pd(lanes, _mm256_max_pd(_mm256_max_pd(m0, m1), _mm256_max_pd(m2, m3)));
+        best = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+    }
+#endif
+    for (; i < n; ++i)
+        best = std::max(best, (double)p[i]);
+    return best;
+}
+
+template<class T>
+static double min_kernel(const T* p, size_t n)
+{
+    size_t i = 0;
+    double best = p[0];
+#if defined(__AVX2__)
+    if (n >= 16)
+    {
+        __m256d m0 = load4(p);
+        __m256d m1 = m0, m2 = m0, m3 = m0;
+        for (; i + 16 <= n; i += 16)
+        {
+            m0 = _mm256_min_pd(m0, load4(p + i));
+            m1 = _mm256_min_pd(m1, load4(p + i + 4));
+            m2 = _mm256_min_pd(m2, load4(p + i + 8));
+            m3 = _mm256_min_pd(m3, load4(p + i + 12));
+        }
+        double lanes[4];
+        _mm256_storeu_pd(lanes, _mm256_min_pd(_mm256_min_pd(m0, m1), _mm256_min_pd(m2, m3)));
+        best = std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+    }
+#endif
+    for (; i < n; ++i)
+        best = std::min(best, (double)p[i]);
+    return best;
+}
+
+// The vectorized max, then a scan for its first occurrence, which stops early and is cheaper than tracking indices
+// in every lane.
+template<class T>
+static size_t argmax_kernel(const T* p, size_t n)
+{
+    double best = max_kernel(p, n);
+    for (size_t i = 0; i < n; ++i)
+        if (p[i] == best) return i;
+    // Only reachable when the data holds NaNs; fall back to an ordered scan.
+    size_t at = 0;
+    for (size_t i = 1; i < n; ++i)
+        if (p[i] > p[at]) at = i;
+    return at;
+}
+
+static void check_not_empty(const MatrixData& m)
+{
+    if (m.size() == 0) throw std::runtime_error("reduction of an empty matrix");
+}
+
+// Calls f with the elements of m, made contiguous, as a pointer of their type.
+template<class F>
+static decltype(auto) with_elements(const MatrixData& m, F f)
+{
+    auto c = m.contiguous();
+    return dispatch_element_type(c.element_type(), [&](auto zero) { return f(c.data_as<decltype(zero)>()); });
+}
+
+double sum(const MatrixData& m, Summation mode)
+{
+    return with_elements(m, [&](auto p) { return sum_with(p, m.size(), mode, Identity{}); });
+}
+
+double mean(const MatrixData& m, Summation mode)
+{
+    check_not_empty(m);
+    return sum(m, mode) / m.size();
+}
+
+double minimum(const MatrixData& m)
+{
+    check_not_empty(m);
+    return with_elements(m, [&](auto p) { return min_kernel(p, m.size()); });
+}
+
+double maximum(const MatrixData& m)
+{
+    check_not_empty(m);
+    return with_elements(m, [&](auto p) { return max_kernel(p, m.size()); });
+}
+
+size_t argmax(const MatrixData& m)
+{
+    check_not_empty(m);
+    return with_elements(m, [&](auto p) { return argmax_kernel(p, m.size()); });
+}
+
+double norm(const MatrixData& m, Summation mode)
+{
+    return std::sqrt(with_elements(m, [&](auto p) { return sum_with(p, m.size(), mode, Square{}); }));
+}
+
+// One row of `n` elements with stride 1.
+template<class T>
+static double reduce_row(const T* p, size_t n, Reduction op, Summation mode)
+{
+    switch (op)
+    {
+        case Reduction::SUM: return sum_with(p, n, mode, Identity{});
+        case Reduction::MEAN: return sum_with(p, n, mode, Identity{}) / n;
+        case Reduction::MIN: return min_kernel(p, n);
+        case Reduction::MAX: return max_kernel(p, n);
+        case Reduction::ARGMAX: return (double)argmax_kernel(p, n);
+        case Reduction::NORM: return std::sqrt(sum_with(p, n, mode, Square{}));
+        default: throw std::runtime_error("unknown reduction");
+    }
+}
+
+// `n` rows of `inner` elements, combined element-wise into out[0, inner). The inner loops run over contiguous
+// elements of both the row and the accumulators, so the compiler vectorizes them.
+template<class T>
+static void reduce_rows(const T* p, size_t n, size_t inner, Reduction op, Summation mode, double* out)
+{
+    if (op == Reduction::MIN || op == Reduction::MAX || op == Reduction::ARGMAX)
+    {
+        std::vector<double> best(p, p + inner);
+        if (op == Reduction::ARGMAX) std::fill(out, out + inner, 0.0);
+        for (size_t k = 1; k < n; ++k)
+        {
+            const T* row = p + k * inner;
+            if (op == Reduction::MIN)
+                for (size_t i = 0; i < inner; ++i)
+                    best[i] = std::min(best[i], (double)row[i]);
+            else if (op == Reduction::MAX)
+                for (size_t i = 0; i < inner; ++i)
+                    best[i] = std::max(best[i], (double)row[i]);
+            else
+                for (size_t i = 0; i < inner; ++i)
+                    if (row[i] > best[i])
+                    {
+                        best[i] = row[i];
+                        out[i] = (double)k;
+                    }
+        }
+        if (op != Reduction::ARGMAX) std::copy(best.begin(), best.end(), out);
+        return;
+    }
+
+    bool square = op == Reduction::NORM;
+    std::fill(out, out + inner, 0.0);
+    if (mode == Summation::COMPENSATED)
+    {
+        std::vector<double> comp(inner, 0.0);
+        for (size_t k = 0; k < n; ++k)
+        {
+            const T* row = p + k * inner;
+            for (size_t i = 0; i < inner; ++i)
+            {
+                double x = row[i];
+                neumaier_add(out[i], comp[i], square ? x * x : x);
+            }
+        }
+        for (size_t i = 0; i < inner; ++i)
+            out[i] += comp[i];
+    }
+    else
+    {
+        for (size_t k = 0; k < n; ++k)
+        {
+            const T* row = p + k * inner;
+            if (square)
+                for (size_t i = 0; i < inner; ++i)
+                    out[i] += (double)row[i] * row[i];
+            else
+                for (size_t i = 0; i < inner; ++i)
+                    out[i] += row[i];
+        }
+    }
+    if (op == Reduction::MEAN)
+        for (size_t i = 0; i < inner; ++i)
+            out[i] /= n;
+    else if (square)
+        for (size_t i = 0; i < inner; ++i)
+            out[i] = std::sqrt(out[i]);
+}
+
+MatrixData reduce_axis(const MatrixData& m, Reduction op, int axis, Summation mode)
+{
+    if (axis < 0 || axis >= m.rank()) throw std::runtime_error("axis out of range");
+    auto& extents = m.extents().extents;
+    size_t inner = 1, outer = 1;
+    for (int d = 0; d < axis; ++d)
+        inner *= extents[d];
+    for (int d = axis + 1; d < m.rank(); ++d)
+        outer *= extents[d];
+    size_t n = extents[axis];
+    if (n == 0 && op != Reduction::SUM && op != Reduction::NORM)
+        throw std::runtime_error("reduction of an empty matrix");
+
+    std::vector<int> out_extents(extents);
+    out_extents.erase(out_extents.begin() + axis);
+    if (out_extents.empty()) out_extents.push_back(1);
+    // Rows are reduced in double; values, but not ARGMAX's indices, are then stored back as the input's type.
+    MatrixData ret(MatrixExtents(std::move(out_extents)));
+    auto type = op == Reduction::ARGMAX ? ElementType::F64 : m.element_type();
+    if (n == 0) return ret.contiguous(type);
+
+    double* out = ret.mutable_data();
+    with_elements(m, [&](auto p) {
+        for (size_t o = 0; o < outer; ++o)
+        {
+            auto block = p + o * n * inner;
+            if (inner == 1)
+                out[o] = reduce_row(block, n, op, mode);
+            else
+                reduce_rows(block, n, inner, op, mode, out + o * inner);
+        }
+    });
+    return ret.contiguous(type);
+}
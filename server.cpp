@@ -0,0 +1,280 @@
+#include "pch.h"
+
+#include "interpreter.h"
+#include "server.h"
+
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <mutex>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Requests longer than this close the session rather than grow its buffer without bound.
+static constexpr size_t MAX_REQUEST = 16 << 20;
+// Response bytes are collected up to this size before they are sent.
+static constexpr size_t RESPONSE_BUFFER = 64 << 10;
+
+namespace
+{
+    struct Session
+    {
+        int fd = -1;
+        std::unique_ptr<Interpreter> interpreter;
+        // A buffered stream over a duplicate of fd, which the session's commands print to.
+        FILE* out = nullptr;
+        // Received bytes that do not yet make a complete line.
+        std::string pending;
+        bool closing = false;
+    };
+
+    struct Server
+    {
+        explicit Server(const ServerOptions& options);
+        ~Server();
+
+        void run();
+
+    private:
+        void load_globals(const std::string& script);
+        void listen_on(const std::string& path);
+        void accept_sessions();
+        void arm(Session* s, int op);
+        void worker_main();
+        void serve(Session* s);
+        void close_session(Session* s);
+
+        std::shared_ptr<Engine> m_engine;
+        std::unique_ptr<Interpreter> m_globals;
+        int m_listen_fd = -1;
+        int m_epoll_fd = -1;
+        unsigned m_worker_count;
+
+        std::mutex m_mutex;
+        std::condition_variable m_cv;
+        std::deque<Session*> m_ready;
+    };
+}
+
+Server::Server(const ServerOptions& options) : m_engine(std::make_shared<Engine>()), m_worker_count(options.workers)
+{
+    if (m_worker_count == 0) m_worker_count = 1;
+    m_engine->variant = options.engine_variant;
+    m_engine->load();
+    if (!options.globals_script.empty()) load_globals(options.globals_script);
+    listen_on(options.socket_path);
+}
+
+Server::~Server()
+{
+    if (m_epoll_fd >= 0) close(m_epoll_fd);
+    if (m_listen_fd >= 0) close(m_listen_fd);
+}
+
+void Server::load_globals(const std::string& script)
+{
+    m_globals = std::make_unique<Interpreter>(m_engine, std::thread::hardware_concurrency());
+    auto& env = m_globals->environment();
+    env.auto_display_flag = false;
+    env.interactive = false;
+    m_globals->load_file(fs::absolute(script));
+
+    // Sessions read the globals concurrently, so deferred expressions are evaluated now rather than on first use.
+    std::vector<int> deferred;
+    env.varmap.for_each([&](int symbol, const Value& v) {
+        if (v.type() == ValueType::EXPRESSION) deferred.push_back(symbol);
+    });
+    for (int symbol : deferred)
+    {
+        auto v = env.varmap.find(symbol)->clone();
+        v.evaluate();
+        env.varmap.set(symbol, std::move(v));
+    }
+    fmt::fprintf(stderr, "Loaded %zu global variables from %s.\n", env.varmap.size(), script);
+}
+
+void Server::listen_on(const std::string& path)
+{
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path))
+        throw std::runtime_error(fmt::format("Invalid socket path \"{}\".", path));
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    // A socket left behind by an earlier server would make bind fail; anything else at the path is left alone.
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path.c_str());
+
+    m_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (m_listen_fd < 0) throw std::runtime_error("socket failed");
+    if (bind(m_listen_fd, (const sockaddr*)&addr, sizeof(addr)) < 0)
+        throw std::runtime_error(fmt::format("Failed to bind {}: {}", path, std::strerror(errno)));
+    if (listen(m_listen_fd, SOMAXCONN) < 0) throw std::runtime_error("listen failed");
+
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epoll_fd < 0) throw std::runtime_error("epoll_create1 failed");
+    epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_listen_fd, &ev) < 0) throw std::runtime_error("epoll_ctl failed");
+}
+
+void Server::run()
+{
+    // A client that disconnects mid-response must not take the server down with it.
+    std::signal(SIGPIPE, SIG_IGN);
+
+    for (unsigned i = 0; i < m_worker_count; ++i)
+        std::thread([this] { worker_main(); }).detach();
+    fmt::fprintf(stderr,
+                 "Serving %zu commands from the %s engine with %u workers.\n",
+                 m_engine->commands.size,
+                 m_engine->loaded_variant,
+                 m_worker_count);
+
+    epoll_event events[64];
+    while (true)
+    {
+        int n = epoll_wait(m_epoll_fd, events, 64, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            throw std::runtime_error("epoll_wait failed");
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            auto s = (Session*)events[i].data.ptr;
+            if (!s)
+            {
+                accept_sessions();
+                continue;
+            }
+            {
+                std::lock_guard<std::mutex> lk(m_mutex);
+                m_ready.push_back(s);
+            }
+            m_cv.notify_one();
+        }
+    }
+}
+
+void Server::accept_sessions()
+{
+    while (true)
+    {
+        int fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return;
+        }
+
+        auto s = new Session;
+        s->fd = fd;
+        s->interpreter = std::make_unique<Interpreter>(m_engine, 1);
+        s->out = fdopen(dup(fd), "w");
+        if (!s->out)
+        {
+            close(fd);
+            delete s;
+            continue;
+        }
+        std::setvbuf(s->out, nullptr, _IOFBF, RESPONSE_BUFFER);
+
+        auto& env = s->interpreter->environment();
+        env.auto_display_flag = false;
+        env.out = s->out;
+        env.globals = m_globals ? &m_globals->environment() : nullptr;
+        env.on_exit = [s] { s->closing = true; };
+
+        arm(s, EPOLL_CTL_ADD);
+    }
+}
+
+// One-shot registration: after an event the session is not reported again until a worker re-arms it, so only one
+// worker at a time serves it.
+void Server::arm(Session* s, int op)
+{
+    epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = s;
+    if (epoll_ctl(m_epoll_fd, op, s->fd, &ev) < 0) close_session(s);
+}
+
+void Server::worker_main()
+{
+    while (true)
+    {
+        Session* s;
+        {
+            std::unique_lock<std::mutex> lk(m_mutex);
+            m_cv.wait(lk, [this] { return !m_ready.empty(); });
+            s = m_ready.front();
+            m_ready.pop_front();
+        }
+        serve(s);
+        if (s->closing)
+            close_session(s);
+        else
+            arm(s, EPOLL_CTL_MOD);
+    }
+}
+
+// Reads whatever input is waiting and runs every complete line in it. A client that has closed its end still gets
+// the responses to the lines it sent before closing.
+void Server::serve(Session* s)
+{
+    char buf[64 << 10];
+    bool eof = false;
+    while (true)
+    {
+        auto n = recv(s->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n > 0)
+        {
+            s->pending.append(buf, n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        eof = n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+        break;
+    }
+
+    size_t begin = 0;
+    size_t end;
+    while (!s->closing && (end = s->pending.find('\n', begin)) != std::string::npos)
+    {
+        try
+        {
+            s->interpreter->run_batch(std::string_view(s->pending).substr(begin, end - begin));
+        }
+        catch (const std::exception& e)
+        {
+            fmt::fprintf(s->out, "error: %s\n", e.what());
+        }
+        std::fputc('\0', s->out);
+        std::fflush(s->out);
+        begin = end + 1;
+    }
+    s->pending.erase(0, begin);
+    if (eof || s->pending.size() > MAX_REQUEST) s->closing = true;
+}
+
+void Server::close_session(Session* s)
+{
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, s->fd, nullptr);
+    std::fclose(s->out);
+    close(s->fd);
+    delete s;
+}
+
+void run_server(const ServerOptions& options)
+{
+    Server server(options);
+    server.run();
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+#include <thread>
+
+// Multi-session server over a Unix domain socket (Linux only, as it waits on epoll).
+//
+// Each connection is a session with its own Interpreter and Environment. All sessions share one loaded engine, and
+// with it the command table, plus a read-only set of global variables that they see under any name they have not
+// bound themselves. A request is one line of whitespace-separated commands, run as in batch mode. The response is
+// whatever those commands printed, then "error: <message>\n" if one of them failed, then a NUL byte. `exit` ends
+// the session after its response.
+//
+// Sessions are served by a fixed pool of worker threads. A connection is handed to a free worker only when it has
+// input waiting, and one worker at a time serves it, so idle connections hold no thread and a session's requests run
+// in order.
+struct ServerOptions
+{
+    std::string socket_path;
+    unsigned workers = std::thread::hardware_concurrency();
+    // A script run once at startup; the variables it binds become the shared globals.
+    std::string globals_script;
+    // The engine build to load; empty picks one as Engine::variant describes.
+    std::string engine_variant;
+};
+
+// Serves until the process is terminated. Throws if the engine, the globals or the socket cannot be set up.
+void run_server(const ServerOptions& options);
@@ -0,0 +1,345 @@
+#include "pch.h"
+
+#include "cfile.h"
+#include "mapped_file.h"
+#include "snapshot.h"
+
+#include <cstdint>
+#include <cstring>
+#include <random>
+
+static constexpr char SNAPSHOT_MAGIC[8] = {'S', 'H', 'S', 'N', 'A', 'P', '\r', '\n'};
+static constexpr uint32_t SNAPSHOT_VERSION = 1;
+static constexpr uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+static constexpr uint64_t SNAPSHOT_ALIGNMENT = 64;
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t record_count;
+    char reserved[40];
+};
+static_assert(sizeof(SnapshotHeader) == SNAPSHOT_ALIGNMENT, "snapshot header must fill one alignment unit");
+
+enum class SnapshotSlot : uint32_t
+{
+    VARIABLE,
+    STACK,
+};
+
+// Each record is followed by its name bytes and `rank` int32 extents. The payload (a double for scalars, the
+// characters of symbols and strings, the elements of matrices) lives at payload_offset, and the next record starts at
+// the first 8-byte boundary after it. The low 16 bits of `type` hold the ValueType; for matrices the high 16 bits hold
+// the ElementType, which is 0 (F64) in files written before F32 existed. A sparse matrix has extents {cols, rows} and a
+// payload of its CSR arrays: rows + 1 uint64 row offsets, then the int32 column indices, then (from the next 8-byte
+// boundary) the double values.
+struct SnapshotRecord
+{
+    uint32_t slot;
+    uint32_t type;
+    uint32_t name_size;
+    uint32_t rank;
+    uint64_t payload_offset;
+    uint64_t payload_size;
+};
+static_assert(sizeof(SnapshotRecord) == 32, "snapshot records are packed");
+
+static uint64_t align_up(uint64_t x, uint64_t alignment) { return (x + alignment - 1) / alignment * alignment; }
+
+// Offset of the values within a sparse payload, and the size of the whole payload.
+static uint64_t sparse_values_offset(uint64_t rows, uint64_t nonzeros)
+{
+    return align_up((rows + 1) * sizeof(uint64_t) + nonzeros * sizeof(int32_t), 8);
+}
+static uint64_t sparse_payload_size(uint64_t rows, uint64_t nonzeros)
+{
+    return sparse_values_offset(rows, nonzeros) + nonzeros * sizeof(double);
+}
+
+namespace
+{
+    struct SnapshotWriter
+    {
+        SnapshotWriter(FILE* f, const SymbolTable& symbols) : m_file(f), m_symbols(symbols) {}
+
+        void write(const void* p, size_t n)
+        {
+            if (n != 0 && fwrite(p, 1, n, m_file) != n) throw std::runtime_error("failed to write snapshot");
+            m_pos += n;
+        }
+        void pad_to(uint64_t alignment)
+        {
+            static const char zeros[SNAPSHOT_ALIGNMENT] = {};
+            write(zeros, align_up(m_pos, alignment) - m_pos);
+        }
+
+        void write_value(SnapshotSlot slot, std::string_view name, const Value& v)
+        {
+            if (v.type() == ValueType::EXPRESSION) return write_matrix(slot, name, v.expression()->evaluate());
+            if (v.type() == ValueType::FUTURE) return write_value(slot, name, v.future()->result());
+
+            SnapshotRecord r = {};
+            r.slot = (uint32_t)slot;
+            r.type = (uint32_t)v.type();
+            r.name_size = (uint32_t)name.size();
+
+            const void* payload;
+            std::string_view sv;
+            double d;
+            switch (v.type())
+            {
+                case ValueType::SCALAR:
+                    d = v.scalar();
+                    payload = &d;
+                    r.payload_size = sizeof(d);
+                    break;
+                case ValueType::SYMBOL:
+                    sv = m_symbols.name(v.symbol());
+                    payload = sv.data();
+                    r.payload_size = sv.size();
+                    break;
+                case ValueType::STRING:
+                    sv = v.string().to_string_view();
+                    payload = sv.data();
+                    r.payload_size = sv.size();
+                    break;
+                case ValueType::MATRIX: return write_matrix(slot, name, v.matrix());
+                case ValueType::SPARSE: return write_sparse(slot, name, v.sparse());
+                default: throw std::runtime_error("unknown value type");
+            }
+            r.payload_offset = align_up(m_pos + sizeof(r) + name.size(), 8);
+
+            write(&r, sizeof(r));
+            write(name.data(), name.size());
+            pad_to(8);
+            write(payload, r.payload_size);
+            pad_to(8);
+        }
+
+        void write_matrix(SnapshotSlot slot, std::string_view name, const MatrixData& m)
+        {
+            auto c = m.contiguous();
+            auto&& extents = c.extents().extents;
+            auto element_size = c.element_type() == ElementType::F32 ? sizeof(float) : sizeof(double);
+
+            SnapshotRecord r = {};
+            r.slot = (uint32_t)slot;
+            r.type = (uint32_t)ValueType::MATRIX | (uint32_t)c.element_type() << 16;
+            r.name_size = (uint32_t)name.size();
+            r.rank = (uint32_t)extents.size();
+            r.payload_size = c.size() * element_size;
+            r.payload_offset =
+                align_up(m_pos + sizeof(r) + name.size() + extents.size() * sizeof(int32_t), SNAPSHOT_ALIGNMENT);
+
+            write(&r, sizeof(r));
+            write(name.data(), name.size());
+            for (auto x : extents)
+            {
+                int32_t e = x;
+                write(&e, sizeof(e));
+            }
+            pad_to(SNAPSHOT_ALIGNMENT);
+            dispatch_element_type(c.element_type(),
+                                  [&](auto zero) { write(c.data_as<decltype(zero)>(), r.payload_size); });
+            pad_to(8);
+        }
+
+        void write_sparse(SnapshotSlot slot, std::string_view name, const SparseMatrix& m)
+        {
+            int32_t extents[2] = {m.cols(), m.rows()};
+
+            SnapshotRecord r = {};
+            r.slot = (uint32_t)slot;
+            r.type = (uint32_t)ValueType::SPARSE;
+            r.name_size = (uint32_t)name.size();
+            r.rank = 2;
+            r.payload_size = sparse_payload_size(m.rows(), m.nonzeros());
+            r.payload_offset = align_up(m_pos + sizeof(r) + name.size() + sizeof(extents), SNAPSHOT_ALIGNMENT);
+
+            write(&r, sizeof(r));
+            write(name.data(), name.size());
+            write(extents, sizeof(extents));
+            pad_to(SNAPSHOT_ALIGNMENT);
+            for (int i = 0; i <= m.rows(); ++i)
+            {
+                uint64_t offset = m.row_ptr()[i];
+                write(&offset, sizeof(offset));
+            }
+            write(m.col_index(), m.nonzeros() * sizeof(int32_t));
+            pad_to(8);
+            write(m.values(), m.nonzeros() * sizeof(double));
+            pad_to(8);
+        }
+
+    private:
+        FILE* m_file;
+        const SymbolTable& m_symbols;
+        uint64_t m_pos = 0;
+    };
+}
+
+void save_snapshot(const Environment& env, const std::experimental::filesystem::path& filename)
+{
+    // Write beside the target under a private name and rename over it, so a snapshot that is currently mapped by an
+    // earlier load-bin stays intact until its buffers are released, and concurrent saves to the same file, such as
+    // from two server sessions, do not write into each other's temporary file.
+    auto tmp = filename;
+    tmp += fmt::format(".{:x}.tmp", std::random_device{}());
+    try
+    {
+        auto out_file = CFile::open_wb(tmp);
+        SnapshotWriter w(out_file.get(), env.symbols);
+
+        SnapshotHeader h = {};
+        memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+        h.version = SNAPSHOT_VERSION;
+        h.byte_order = SNAPSHOT_BYTE_ORDER;
+        h.record_count = env.varmap.size() + env.stack.size();
+        w.write(&h, sizeof(h));
+
+        env.varmap.for_each(
+            [&](int sym, const Value& v) { w.write_value(SnapshotSlot::VARIABLE, env.symbols.name(sym), v); });
+        for (int x = env.stack.size() - 1; x >= 0; --x)
+            w.write_value(SnapshotSlot::STACK, {}, env.stack.at_from_top(x));
+    }
+    catch (...)
+    {
+        std::error_code ec;
+        std::experimental::filesystem::remove(tmp, ec);
+        throw;
+    }
+    std::experimental::filesystem::rename(tmp, filename);
+}
+
+void load_snapshot(Environment& env, const std::experimental::filesystem::path& filename)
+{
+    auto file = MappedFile::open(filename);
+    const char* base = file->data();
+    uint64_t size = file->size();
+
+    SnapshotHeader h;
+    if (size < sizeof(h)) throw std::runtime_error("not a snapshot file");
+    memcpy(&h, base, sizeof(h));
+    if (memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) != 0) throw std::runtime_error("not a snapshot file");
+    if (h.byte_order != SNAPSHOT_BYTE_ORDER)
+        throw std::runtime_error("snapshot was written with a different byte order");
+    if (h.version != SNAPSHOT_VERSION)
+        throw std::runtime_error(fmt::sprintf("unsupported snapshot version %d", (int)h.version));
+
+    // Decode everything before touching the environment, so a truncated or corrupt file leaves it unchanged.
+    std::vector<std::pair<int, Value>> variables;
+    std::vector<Value> stack;
+
+    uint64_t pos = sizeof(h);
+    for (uint64_t i = 0; i < h.record_count; ++i)
+    {
+        SnapshotRecord r;
+        // pos is past the end when the previous payload ended in the last, unpadded, bytes of the file.
+        if (pos > size || size - pos < sizeof(r)) throw std::runtime_error("truncated snapshot");
+        memcpy(&r, base + pos, sizeof(r));
+        pos += sizeof(r);
+
+        uint64_t extents_size = (uint64_t)r.rank * sizeof(int32_t);
+        if (size - pos < r.name_size + extents_size) throw std::runtime_error("truncated snapshot");
+        std::string_view name(base + pos, r.name_size);
+        pos += r.name_size;
+        const char* extents_data = base + pos;
+        pos += extents_size;
+
+        if (r.payload_offset < pos || r.payload_offset > size || size - r.payload_offset < r.payload_size)
+            throw std::runtime_error("truncated snapshot");
+        const char* payload = base + r.payload_offset;
+        pos = align_up(r.payload_offset + r.payload_size, 8);
+
+        auto v = [&]() -> Value {
+            switch ((ValueType)(r.type & 0xffff))
+            {
+                case ValueType::SCALAR:
+                {
+                    double d;
+                    if (r.payload_size != sizeof(d)) throw std::runtime_error("corrupt snapshot scalar");
+                    memcpy(&d, payload, sizeof(d));
+                    return d;
+                }
+                case ValueType::SYMBOL:
+                    return {env.symbols.intern(std::string_view(payload, r.payload_size)), Value::symbol_tag};
+                case ValueType::STRING: return {std::string_view(payload, r.payload_size), Value::string_tag};
+                case ValueType::MATRIX:
+                {
+                    MatrixExtents extents;
+                    extents.extents.resize(r.rank);
+                    for (uint32_t d = 0; d < r.rank; ++d)
+                    {
+                        int32_t e;
+                        memcpy(&e, extents_data + d * sizeof(e), sizeof(e));
+                        extents.extents[d] = e;
+                    }
+                    auto element_type = (ElementType)(r.type >> 16);
+                    if (element_type != ElementType::F64 && element_type != ElementType::F32)
+                        throw std::runtime_error("corrupt snapshot matrix");
+                    auto element_size = element_type == ElementType::F32 ? sizeof(float) : sizeof(double);
+                    if (r.payload_size != extents.size() * element_size || r.payload_offset % SNAPSHOT_ALIGNMENT != 0)
+                        throw std::runtime_error("corrupt snapshot matrix");
+                    // The buffer counts doubles; an odd number of floats ends in half of one, which the file pads.
+                    auto buffer = std::make_shared<MatrixBuffer>(
+                        (double*)payload, (r.payload_size + sizeof(double) - 1) / sizeof(double), file);
+                    return MatrixData(std::move(extents), std::move(buffer), element_type);
+                }
+                case ValueType::SPARSE:
+                {
+                    int32_t extents[2];
+                    if (r.rank != 2) throw std::runtime_error("corrupt snapshot sparse matrix");
+                    memcpy(extents, extents_data, sizeof(extents));
+                    int cols = extents[0];
+                    int rows = extents[1];
+                    if (rows < 0 || cols < 0 || r.payload_size < ((uint64_t)rows + 1) * sizeof(uint64_t))
+                        throw std::runtime_error("corrupt snapshot sparse matrix");
+
+                    // The arrays are copied out rather than adopted, so they are validated once here and the kernels
+                    // can trust them.
+                    SparseMatrix::Storage s;
+                    s.row_ptr.resize((size_t)rows + 1);
+                    for (int i = 0; i <= rows; ++i)
+                    {
+                        uint64_t offset;
+                        memcpy(&offset, payload + i * sizeof(offset), sizeof(offset));
+                        s.row_ptr[i] = offset;
+                    }
+                    uint64_t nonzeros = s.row_ptr[rows];
+                    if (s.row_ptr[0] != 0 || nonzeros > r.payload_size ||
+                        r.payload_size != sparse_payload_size(rows, nonzeros))
+                        throw std::runtime_error("corrupt snapshot sparse matrix");
+                    s.col_index.resize(nonzeros);
+                    s.values.resize(nonzeros);
+                    memcpy(s.col_index.data(), payload + (rows + 1) * sizeof(uint64_t), nonzeros * sizeof(int32_t));
+                    memcpy(s.values.data(), payload + sparse_values_offset(rows, nonzeros), nonzeros * sizeof(double));
+                    for (int i = 0; i < rows; ++i)
+                        if (s.row_ptr[i + 1] < s.row_ptr[i]) throw std::runtime_error("corrupt snapshot sparse matrix");
+                    for (int i = 0; i < rows; ++i)
+                    {
+                        for (size_t k = s.row_ptr[i]; k < s.row_ptr[i + 1]; ++k)
+                            if (s.col_index[k] < 0 || s.col_index[k] >= cols ||
+                                (k > s.row_ptr[i] && s.col_index[k] <= s.col_index[k - 1]))
+                                throw std::runtime_error("corrupt snapshot sparse matrix");
+                    }
+                    return SparseMatrix(rows, cols, std::move(s));
+                }
+                default: throw std::runtime_error("corrupt snapshot value type");
+            }
+        }();
+
+        if (r.slot == (uint32_t)SnapshotSlot::VARIABLE)
+            variables.emplace_back(env.symbols.intern(name), std::move(v));
+        else if (r.slot == (uint32_t)SnapshotSlot::STACK)
+            stack.push_back(std::move(v));
+        else
+            throw std::runtime_error("corrupt snapshot record");
+    }
+
+    for (auto&& p : variables)
+        env.varmap.set(p.first, std::move(p.second));
+    for (auto&& v : stack)
+        env.stack.push(std::move(v));
+}
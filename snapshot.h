@@ -0,0 +1,11 @@
+#pragma once
+
+#include "environment.h"
+
+#include <filesystem>
+
+// Binary workspace snapshots. The file is a versioned header followed by one record per variable and stack entry;
+// matrix elements are stored raw at 64-byte aligned offsets, so load_snapshot maps the file and adopts them in place
+// rather than parsing anything.
+void save_snapshot(const Environment& env, const std::experimental::filesystem::path& filename);
+void load_snapshot(Environment& env, const std::experimental::filesystem::path& filename);
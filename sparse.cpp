@@ -0,0 +1,415 @@
+#include "pch.h"
+
+#include "sparse.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+// Output blocks are handed to the pool in chunks of about this many multiply-adds.
+static constexpr size_t SPARSE_GRAIN = 16384;
+
+// Formatting flushes to the stream, when one is given, once the buffer holds this many bytes.
+static constexpr size_t SPARSE_DISPLAY_FLUSH = 64 << 10;
+
+SparseMatrix::SparseMatrix()
+    : m_storage(std::make_shared<Storage>(Storage{{0}, {}, {}}))
+{
+}
+
+SparseMatrix::SparseMatrix(int rows, int cols, Storage storage)
+    : m_rows(rows)
+    , m_cols(cols)
+    , m_storage(std::make_shared<Storage>(std::move(storage)))
+{
+}
+
+// Rows of a dense operand: the innermost extent for rank 2 and up, the whole vector for rank 1.
+static int dense_columns(const MatrixData& m)
+{
+    return m.rank() > 1 ? m.extents().extents[0] : (int)m.size();
+}
+
+SparseMatrix SparseMatrix::from_dense(const MatrixData& m, ThreadPool* pool)
+{
+    auto c = m.contiguous(ElementType::F64, pool);
+    int cols = dense_columns(c);
+    int rows = cols == 0 ? 0 : (int)(c.size() / cols);
+    // With no columns the size says nothing about the rows, so a matrix keeps the count from its outer extents.
+    if (cols == 0 && c.rank() > 1)
+    {
+        rows = 1;
+        for (int i = 1; i < c.rank(); ++i)
+            rows *= c.extents().extents[i];
+    }
+    const double* data = c.data();
+
+    // Count each row's nonzeros, then fill the rows in place once their offsets are known.
+    Storage s;
+    s.row_ptr.assign((size_t)rows + 1, 0);
+    auto count = [&](size_t begin, size_t end) {
+        for (size_t r = begin; r < end; ++r)
+        {
+            const double* row = data + r * cols;
+            s.row_ptr[r + 1] = cols - std::count(row, row + cols, 0.0);
+        }
+    };
+    auto grain = std::max<size_t>(1, SPARSE_GRAIN / std::max(cols, 1));
+    if (pool)
+        pool->parallel_for(rows, grain, count);
+    else
+        count(0, rows);
+    for (int r = 0; r < rows; ++r)
+        s.row_ptr[r + 1] += s.row_ptr[r];
+
+    s.col_index.resize(s.row_ptr[rows]);
+    s.values.resize(s.row_ptr[rows]);
+    auto fill = [&](size_t begin, size_t end) {
+        for (size_t r = begin; r < end; ++r)
+        {
+            const double* row = data + r * cols;
+            size_t k = s.row_ptr[r];
+            for (int j = 0; j < cols; ++j)
+            {
+                if (row[j] == 0.0) continue;
+                s.col_index[k] = j;
+                s.values[k++] = row[j];
+            }
+        }
+    };
+    if (pool)
+        pool->parallel_for(rows, grain, fill);
+    else
+        fill(0, rows);
+    return SparseMatrix(rows, cols, std::move(s));
+}
+
+SparseMatrix SparseMatrix::from_triplets(int rows, int cols, std::vector<Triplet> triplets)
+{
+    if (rows < 0 || cols < 0) throw std::runtime_error("sparse extents must not be negative");
+    for (auto&& t : triplets)
+        if (t.row < 0 || t.row >= rows || t.col < 0 || t.col >= cols)
+            throw std::runtime_error("sparse index out of range");
+    std::sort(triplets.begin(), triplets.end(), [](const Triplet& a, const Triplet& b) {
+        return a.row != b.row ? a.row < b.row : a.col < b.col;
+    });
+
+    Storage s;
+    s.row_ptr.assign((size_t)rows + 1, 0);
+    for (size_t i = 0; i < triplets.size();)
+    {
+        auto t = triplets[i];
+        for (++i; i < triplets.size() && triplets[i].row == t.row && triplets[i].col == t.col; ++i)
+            t.value += triplets[i].value;
+        if (t.value == 0.0) continue;
+        s.col_index.push_back(t.col);
+        s.values.push_back(t.value);
+        ++s.row_ptr[t.row + 1];
+    }
+    for (int r = 0; r < rows; ++r)
+        s.row_ptr[r + 1] += s.row_ptr[r];
+    return SparseMatrix(rows, cols, std::move(s));
+}
+
+MatrixData SparseMatrix::to_dense() const
+{
+    MatrixData ret(m_rows == 1 ? MatrixExtents{m_cols} : MatrixExtents{m_cols, m_rows});
+    double* out = ret.mutable_data();
+    for (int r = 0; r < m_rows; ++r)
+        for (size_t k = row_ptr()[r]; k < row_ptr()[r + 1]; ++k)
+            out[(size_t)r * m_cols + col_index()[k]] = values()[k];
+    return ret;
+}
+
+double SparseMatrix::density() const
+{
+    double n = (double)m_rows * m_cols;
+    return n == 0 ? 0.0 : nonzeros() / n;
+}
+
+// Sum of row r of m times the dense vector x, which holds m.cols() elements.
+static double sparse_row_dot(const SparseMatrix& m, int r, const double* x)
+{
+    const int* cols = m.col_index();
+    const double* values = m.values();
+    double v = 0;
+    for (size_t k = m.row_ptr()[r]; k < m.row_ptr()[r + 1]; ++k)
+        v += values[k] * x[cols[k]];
+    return v;
+}
+
+// The nonzeros of a single-row sparse vector scattered into a dense vector.
+static std::vector<double> sparse_vector(const SparseMatrix& v)
+{
+    if (v.rows() != 1) throw std::runtime_error("sparse vector must be a single row");
+    std::vector<double> x(v.cols());
+    for (size_t k = 0; k < v.nonzeros(); ++k)
+        x[v.col_index()[k]] = v.values()[k];
+    return x;
+}
+
+MatrixData dot(const SparseMatrix& m, const MatrixData& v)
+{
+    if ((int)v.size() != m.cols()) throw std::runtime_error("sparse matrix columns do not match the vector size");
+    auto b = v.contiguous(ElementType::F64);
+    MatrixData out(MatrixExtents{m.rows()});
+    double* po = out.mutable_data();
+    for (int r = 0; r < m.rows(); ++r)
+        po[r] = sparse_row_dot(m, r, b.data());
+    return out;
+}
+
+MatrixData dot(const MatrixData& m, const SparseMatrix& v)
+{
+    if (v.rows() != 1) throw std::runtime_error("sparse vector must be a single row");
+    size_t n = v.cols();
+    if (n == 0 || m.size() % n != 0) throw std::runtime_error("matrix size is not a multiple of the vector size");
+    auto a = m.contiguous(ElementType::F64);
+    const double* pa = a.data();
+
+    MatrixData out(MatrixExtents{(int)(m.size() / n)});
+    double* po = out.mutable_data();
+    const int* cols = v.col_index();
+    const double* values = v.values();
+    for (size_t r = 0; r < out.size(); ++r)
+    {
+        const double* row = pa + r * n;
+        double d = 0;
+        for (size_t k = 0; k < v.nonzeros(); ++k)
+            d += values[k] * row[cols[k]];
+        po[r] = d;
+    }
+    return out;
+}
+
+MatrixData dot(const SparseMatrix& m, const SparseMatrix& v)
+{
+    if (v.cols() != m.cols()) throw std::runtime_error("sparse matrix columns do not match the vector size");
+    auto x = sparse_vector(v);
+    MatrixData out(MatrixExtents{m.rows()});
+    double* po = out.mutable_data();
+    for (int r = 0; r < m.rows(); ++r)
+        po[r] = sparse_row_dot(m, r, x.data());
+    return out;
+}
+
+// Row i of the product is the sum, over the nonzeros (p, a) of row i of the left operand, of a times row p of the
+// right one. Each variant below walks that sum with whichever side is sparse skipping its zeros.
+MatrixData multiply_matrix(const SparseMatrix& left, const MatrixData& right, int extent)
+{
+    if (extent <= 0 || left.cols() != extent) throw std::runtime_error("sparse matrix columns do not match the extent");
+    size_t n = right.size() / extent;
+    auto b = right.contiguous(ElementType::F64);
+    const double* pb = b.data();
+
+    MatrixData ret(MatrixExtents{(int)n, left.rows()});
+    double* pc = ret.mutable_data();
+    const int* cols = left.col_index();
+    const double* values = left.values();
+    for (int i = 0; i < left.rows(); ++i)
+    {
+        double* c_row = pc + i * n;
+        for (size_t k = left.row_ptr()[i]; k < left.row_ptr()[i + 1]; ++k)
+        {
+            double a = values[k];
+            const double* b_row = pb + (size_t)cols[k] * n;
+            for (size_t j = 0; j < n; ++j)
+                c_row[j] += a * b_row[j];
+        }
+    }
+    return ret;
+}
+
+MatrixData multiply_matrix(const MatrixData& left, const SparseMatrix& right, int extent)
+{
+    if (extent <= 0 || right.rows() != extent) throw std::runtime_error("sparse matrix rows do not match the extent");
+    size_t m = left.size() / extent;
+    size_t n = right.cols();
+    auto a = left.contiguous(ElementType::F64);
+    const double* pa = a.data();
+
+    MatrixData ret(MatrixExtents{(int)n, (int)m});
+    double* pc = ret.mutable_data();
+    const int* cols = right.col_index();
+    const double* values = right.values();
+    for (size_t i = 0; i < m; ++i)
+    {
+        double* c_row = pc + i * n;
+        for (int p = 0; p < extent; ++p)
+        {
+            double a_ip = pa[i * extent + p];
+            if (a_ip == 0.0) continue;
+            for (size_t k = right.row_ptr()[p]; k < right.row_ptr()[p + 1]; ++k)
+                c_row[cols[k]] += a_ip * values[k];
+        }
+    }
+    return ret;
+}
+
+// Gustavson's algorithm: each output row is accumulated in a dense scratch row, with `mark` recording which of its
+// columns the current row has touched so that only those are visited, sorted and cleared.
+SparseMatrix multiply_matrix(const SparseMatrix& left, const SparseMatrix& right, int extent)
+{
+    if (extent <= 0 || left.cols() != extent || right.rows() != extent)
+        throw std::runtime_error("sparse matrix extents do not match");
+    int n = right.cols();
+    std::vector<double> acc(n);
+    std::vector<int> mark(n, -1);
+    std::vector<int> touched;
+
+    SparseMatrix::Storage s;
+    s.row_ptr.reserve((size_t)left.rows() + 1);
+    s.row_ptr.push_back(0);
+    for (int i = 0; i < left.rows(); ++i)
+    {
+        touched.clear();
+        for (size_t k = left.row_ptr()[i]; k < left.row_ptr()[i + 1]; ++k)
+        {
+            double a = left.values()[k];
+            int p = left.col_index()[k];
+            for (size_t l = right.row_ptr()[p]; l < right.row_ptr()[p + 1]; ++l)
+            {
+                int j = right.col_index()[l];
+                if (mark[j] != i)
+                {
+                    mark[j] = i;
+                    acc[j] = 0;
+                    touched.push_back(j);
+                }
+                acc[j] += a * right.values()[l];
+            }
+        }
+        std::sort(touched.begin(), touched.end());
+        for (int j : touched)
+        {
+            if (acc[j] == 0.0) continue;
+            s.col_index.push_back(j);
+            s.values.push_back(acc[j]);
+        }
+        s.row_ptr.push_back(s.values.size());
+    }
+    return SparseMatrix(left.rows(), n, std::move(s));
+}
+
+static void check_sparse_inner(int inner_extent, int stride1, int stride2)
+{
+    if (inner_extent <= 0 || stride1 <= 0 || stride2 <= 0)
+        throw std::runtime_error("inner product extents must be positive");
+    if (stride1 != 1 || stride2 != 1) throw std::runtime_error("sparse inner product requires unit strides");
+}
+
+static void check_sparse_columns(const SparseMatrix& m, int inner_extent)
+{
+    if (m.cols() != inner_extent) throw std::runtime_error("sparse matrix columns do not match the inner extent");
+}
+
+// Calls rows(begin, end) over the n1 output rows, on `pool` when one is given. Each output row costs about
+// `row_work` multiply-adds.
+template<class F>
+static void for_output_rows(size_t n1, size_t row_work, ThreadPool* pool, F&& rows)
+{
+    if (pool)
+        pool->parallel_for(n1, std::max<size_t>(1, SPARSE_GRAIN / std::max<size_t>(row_work, 1)), rows);
+    else
+        rows(0, n1);
+}
+
+// The output shape of the dense inner product with unit strides.
+static MatrixData inner_result(size_t n1, size_t n2)
+{
+    return MatrixData(MatrixExtents{1, 1, (int)n2, (int)n1});
+}
+
+MatrixData inner_product(
+    const SparseMatrix& m1, const MatrixData& m2, int inner_extent, int stride1, int stride2, ThreadPool* pool)
+{
+    check_sparse_inner(inner_extent, stride1, stride2);
+    check_sparse_columns(m1, inner_extent);
+    size_t n1 = m1.rows();
+    size_t n2 = m2.size() / inner_extent;
+    auto b = m2.contiguous(ElementType::F64, pool);
+    const double* pb = b.data();
+
+    auto ret = inner_result(n1, n2);
+    double* out = ret.mutable_data();
+    for_output_rows(n1, (m1.nonzeros() / std::max<size_t>(n1, 1) + 1) * n2, pool, [&](size_t begin, size_t end) {
+        for (size_t k1 = begin; k1 < end; ++k1)
+            for (size_t k2 = 0; k2 < n2; ++k2)
+                out[k2 + n2 * k1] = sparse_row_dot(m1, (int)k1, pb + k2 * inner_extent);
+    });
+    return ret;
+}
+
+MatrixData inner_product(
+    const MatrixData& m1, const SparseMatrix& m2, int inner_extent, int stride1, int stride2, ThreadPool* pool)
+{
+    check_sparse_inner(inner_extent, stride1, stride2);
+    check_sparse_columns(m2, inner_extent);
+    size_t n1 = m1.size() / inner_extent;
+    size_t n2 = m2.rows();
+    auto a = m1.contiguous(ElementType::F64, pool);
+    const double* pa = a.data();
+
+    auto ret = inner_result(n1, n2);
+    double* out = ret.mutable_data();
+    for_output_rows(n1, m2.nonzeros() + n2, pool, [&](size_t begin, size_t end) {
+        for (size_t k1 = begin; k1 < end; ++k1)
+            for (size_t k2 = 0; k2 < n2; ++k2)
+                out[k2 + n2 * k1] = sparse_row_dot(m2, (int)k2, pa + k1 * inner_extent);
+    });
+    return ret;
+}
+
+MatrixData inner_product(
+    const SparseMatrix& m1, const SparseMatrix& m2, int inner_extent, int stride1, int stride2, ThreadPool* pool)
+{
+    check_sparse_inner(inner_extent, stride1, stride2);
+    check_sparse_columns(m1, inner_extent);
+    check_sparse_columns(m2, inner_extent);
+    size_t n1 = m1.rows();
+    size_t n2 = m2.rows();
+
+    // Each row of m1 is scattered into a dense scratch row, which every row of m2 then reads at its own nonzeros.
+    auto ret = inner_result(n1, n2);
+    double* out = ret.mutable_data();
+    for_output_rows(n1, m2.nonzeros() + n2, pool, [&](size_t begin, size_t end) {
+        std::vector<double> x(inner_extent);
+        for (size_t k1 = begin; k1 < end; ++k1)
+        {
+            size_t first = m1.row_ptr()[k1];
+            size_t last = m1.row_ptr()[k1 + 1];
+            if (first == last) continue;
+            for (size_t k = first; k < last; ++k)
+                x[m1.col_index()[k]] = m1.values()[k];
+            for (size_t k2 = 0; k2 < n2; ++k2)
+                out[k2 + n2 * k1] = sparse_row_dot(m2, (int)k2, x.data());
+            for (size_t k = first; k < last; ++k)
+                x[m1.col_index()[k]] = 0;
+        }
+    });
+    return ret;
+}
+
+void format_sparse(fmt::memory_buffer& out, const SparseMatrix& m, size_t limit, FILE* stream)
+{
+    auto it = std::back_inserter(out);
+    fmt::format_to(it,
+                   "sparse {}x{}, {} nonzeros ({:.2f}%)\n",
+                   m.rows(),
+                   m.cols(),
+                   m.nonzeros(),
+                   m.density() * 100);
+    size_t shown = limit == 0 ? m.nonzeros() : std::min(limit, m.nonzeros());
+    size_t k = 0;
+    for (int r = 0; r < m.rows() && k < shown; ++r)
+    {
+        for (; k < m.row_ptr()[r + 1] && k < shown; ++k)
+            fmt::format_to(it, "  ({}, {}) {:2.3f}\n", r, m.col_index()[k], m.values()[k]);
+        if (stream && out.size() >= SPARSE_DISPLAY_FLUSH)
+        {
+            std::fwrite(out.data(), 1, out.size(), stream);
+            out.clear();
+        }
+    }
+    if (shown < m.nonzeros()) fmt::format_to(it, "  ... ({} more)\n", m.nonzeros() - shown);
+}
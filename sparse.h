@@ -0,0 +1,91 @@
+#pragma once
+
+#include "matrix.h"
+
+#include <memory>
+#include <vector>
+
+// A rows x cols matrix in compressed sparse row form: the nonzeros of row r are values[row_ptr[r] .. row_ptr[r + 1]),
+// at columns col_index[...] in increasing order. A dense matrix is read as rows of its innermost extent, so `sparse`
+// and `dense` round-trip a rank-2 matrix and the kernels below line up with their dense counterparts. The storage is
+// immutable once built, so copies share it. Elements are doubles; float32 operands are widened.
+struct SparseMatrix
+{
+    struct Storage
+    {
+        std::vector<size_t> row_ptr;
+        std::vector<int> col_index;
+        std::vector<double> values;
+    };
+
+    // One nonzero in coordinate (COO) form.
+    struct Triplet
+    {
+        int row;
+        int col;
+        double value;
+    };
+
+    // An empty 0 x 0 matrix.
+    SparseMatrix();
+    // Takes CSR arrays that are already well formed: row_ptr has rows + 1 entries and the columns of each row ascend.
+    SparseMatrix(int rows, int cols, Storage storage);
+
+    // The nonzeros of `m`; a matrix of rank 1 becomes a single row.
+    static SparseMatrix from_dense(const MatrixData& m, ThreadPool* pool = nullptr);
+    // Triplets in any order; entries at the same position are summed, and zeros are dropped.
+    static SparseMatrix from_triplets(int rows, int cols, std::vector<Triplet> triplets);
+
+    // Extents {cols, rows}, or {cols} for a single row.
+    MatrixData to_dense() const;
+
+    int rows() const { return m_rows; }
+    int cols() const { return m_cols; }
+    size_t nonzeros() const { return m_storage->values.size(); }
+    // Fraction of the rows x cols elements that are stored.
+    double density() const;
+
+    const size_t* row_ptr() const { return m_storage->row_ptr.data(); }
+    const int* col_index() const { return m_storage->col_index.data(); }
+    const double* values() const { return m_storage->values.data(); }
+
+private:
+    int m_rows = 0;
+    int m_cols = 0;
+    std::shared_ptr<const Storage> m_storage;
+};
+
+// Sparse versions of dot, multiply_matrix and inner_product (sparse.cpp), for any mix of sparse and dense operands.
+// They follow the dense shapes: a sparse operand stands for its dense form, rows of `cols` elements. The vector of dot
+// must be a single row when it is sparse. Only the product of two sparse matrices is sparse; the others are dense.
+MatrixData dot(const SparseMatrix& m, const MatrixData& v);
+MatrixData dot(const MatrixData& m, const SparseMatrix& v);
+MatrixData dot(const SparseMatrix& m, const SparseMatrix& v);
+
+MatrixData multiply_matrix(const SparseMatrix& left, const MatrixData& right, int extent);
+MatrixData multiply_matrix(const MatrixData& left, const SparseMatrix& right, int extent);
+SparseMatrix multiply_matrix(const SparseMatrix& left, const SparseMatrix& right, int extent);
+
+// Only the unit-stride form, which contracts rows with rows: ret[k2 + n2 * k1] is row k1 of m1 dot row k2 of m2.
+MatrixData inner_product(const SparseMatrix& m1,
+                         const MatrixData& m2,
+                         int inner_extent,
+                         int stride1,
+                         int stride2,
+                         ThreadPool* pool = nullptr);
+MatrixData inner_product(const MatrixData& m1,
+                         const SparseMatrix& m2,
+                         int inner_extent,
+                         int stride1,
+                         int stride2,
+                         ThreadPool* pool = nullptr);
+MatrixData inner_product(const SparseMatrix& m1,
+                         const SparseMatrix& m2,
+                         int inner_extent,
+                         int stride1,
+                         int stride2,
+                         ThreadPool* pool = nullptr);
+
+// Appends a summary line, then the nonzeros as "(row, col) value", up to `limit` of them when limit is nonzero. When
+// `stream` is given, the buffer is written to it and emptied each time it fills.
+void format_sparse(fmt::memory_buffer& out, const SparseMatrix& m, size_t limit = 0, FILE* stream = nullptr);
@@ -0,0 +1,565 @@
+#include "pch.h"
+
+#include "interpreter.h"
+#include "sparse.h"
+
+#include <fmt/printf.h>
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#if !defined(_WIN32)
+#include <csignal>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// sh-tests: regression tests for the interpreter and the engine, run by ctest. Each test throws on failure; the rest
+// still run, and the exit status is the number of failures.
+//
+// Usage: sh-tests [name...]
+
+static void expect(bool condition, std::string_view what)
+{
+    if (!condition) throw std::runtime_error(std::string(what));
+}
+
+static void expect_output(std::string_view actual, std::string_view expected)
+{
+    if (actual != expected) throw std::runtime_error(fmt::sprintf("expected \"%s\", got \"%s\"", expected, actual));
+}
+
+// Runs `script` in batch mode and returns what it printed.
+static std::string run_script(Interpreter& interpreter, std::string_view script)
+{
+    auto& env = interpreter.environment();
+    FILE* f = std::tmpfile();
+    if (!f) throw std::runtime_error("cannot create a temporary file");
+    env.out = f;
+    std::string ret;
+    try
+    {
+        interpreter.run_batch(script);
+        std::fflush(f);
+        std::rewind(f);
+        char buffer[4096];
+        size_t n;
+        while ((n = std::fread(buffer, 1, sizeof(buffer), f)) > 0)
+            ret.append(buffer, n);
+    }
+    catch (...)
+    {
+        env.out = stdout;
+        std::fclose(f);
+        throw;
+    }
+    env.out = stdout;
+    std::fclose(f);
+    return ret;
+}
+
+// Runs `script`, which must fail with an error containing `message`.
+static void expect_error(Interpreter& interpreter, std::string_view script, std::string_view message)
+{
+    try
+    {
+        run_script(interpreter, script);
+    }
+    catch (const std::exception& e)
+    {
+        if (std::string_view(e.what()).find(message) != std::string_view::npos) return;
+        throw std::runtime_error(fmt::sprintf("expected an error with \"%s\", got \"%s\"", message, e.what()));
+    }
+    throw std::runtime_error(fmt::sprintf("expected an error with \"%s\"", message));
+}
+
+// A path in the temporary directory that no other run uses; whatever is created there is removed when this goes out of
+// scope.
+struct TempPath
+{
+    TempPath(std::string_view suffix)
+        : path(fs::temp_directory_path() /
+               fmt::format("sh-tests.{:x}{}", std::random_device{}(), suffix))
+    {
+    }
+    ~TempPath()
+    {
+        std::error_code ec;
+        fs::remove_all(path, ec);
+    }
+
+    fs::path path;
+};
+
+static std::string read_file(const fs::path& p)
+{
+    std::string ret;
+    FILE* f = std::fopen(p.string().c_str(), "rb");
+    if (!f) throw std::runtime_error("cannot open " + p.string());
+    char buffer[4096];
+    size_t n;
+    while ((n = std::fread(buffer, 1, sizeof(buffer), f)) > 0)
+        ret.append(buffer, n);
+    std::fclose(f);
+    return ret;
+}
+
+static void write_file(const fs::path& p, std::string_view data)
+{
+    FILE* f = std::fopen(p.string().c_str(), "wb");
+    if (!f) throw std::runtime_error("cannot create " + p.string());
+    std::fwrite(data.data(), 1, data.size(), f);
+    std::fclose(f);
+}
+
+static std::string run_script(std::string_view script)
+{
+    Interpreter interpreter;
+    interpreter.load_engine();
+    return run_script(interpreter, script);
+}
+
+// A lazy chain far deeper than ElementExpr::MAX_DEPTH evaluates without exhausting the stack, to the eager result.
+static void test_lazy_deep_chain()
+{
+    std::string chain;
+    for (int i = 0; i < 100000; ++i)
+        chain += " 0.5 m+ 0.5 m*";
+    auto eager = run_script("1000 ones" + chain + " sum print");
+    auto lazy = run_script("1 lazy 1000 ones" + chain + " sum print");
+    expect_output(lazy, eager);
+}
+
+// Lazy float32 chains round at every step, as the eager commands do, so both give bit-identical matrices, also when
+// an F32 subtree feeds an F64 sum and when the chain is deep enough to be evaluated in pieces.
+static void test_lazy_f32_matches_eager()
+{
+    std::string a = "0.1 0.7 1.3 2.9 3.3 4.1 5.5 6.7 8";
+    std::string b = "9.1 1.2 0.4 7.7 2.6 5.3 3.8 4.9 8";
+    std::string chain = " 1.1 m* 0.3 m+ 1.7 m**";
+    for (int i = 0; i < 40; ++i)
+        chain += " 1.01 m* 0.01 m+";
+    std::string script = a + " matrix to-f32 $$a store " + b + " matrix to-f32 $$b store " + b + " matrix $$c store ";
+    for (auto rhs : {"b", "c"})
+    {
+        script += fmt::sprintf("0 lazy $a %s $%s m+m $$e store ", chain, rhs);
+        script += fmt::sprintf("1 lazy $a %s $%s m+m $$l store ", chain, rhs);
+        script += "0 lazy $l $e -1 m* m+m 1000000000 m* $$d store $d max print $d min print ";
+    }
+    expect_output(run_script(script), "= 0.000000\n= 0.000000\n= 0.000000\n= 0.000000\n");
+}
+
+// The record count of a snapshot header, which follows the magic, version and byte order.
+static constexpr size_t SNAPSHOT_RECORD_COUNT_OFFSET = 16;
+
+// Snapshots that end early, or that claim more records than they hold, fail to load and leave the environment as it
+// was, even when the last payload runs to the very end of the file and of its mapping.
+static void test_snapshot_truncated()
+{
+    TempPath snapshot(".snap");
+    Interpreter interpreter;
+    interpreter.load_engine();
+
+    // A 64-byte header, one 32-byte record and a symbol payload that ends 3 bytes short of a page, before the padding.
+    std::string name(4096 - 3 - 64 - 32, 'x');
+    run_script(interpreter, fmt::sprintf("$$%s dump-bin %s clear", name, snapshot.path.string()));
+    auto data = read_file(snapshot.path);
+    expect(data.size() == 4096, "unexpected snapshot layout");
+
+    // One record more than the file holds, with the padding after the last payload cut off.
+    auto over_counted = data.substr(0, data.size() - 3);
+    uint64_t count = 2;
+    memcpy(&over_counted[SNAPSHOT_RECORD_COUNT_OFFSET], &count, sizeof(count));
+    write_file(snapshot.path, over_counted);
+    expect_error(interpreter, "load-bin " + snapshot.path.string(), "truncated snapshot");
+    expect(interpreter.environment().stack.size() == 0, "a failed load changed the stack");
+
+    // Cut off in the middle of a record, and in the middle of a payload.
+    for (size_t size : {64 + 16, 64 + 32 + 100})
+    {
+        write_file(snapshot.path, data.substr(0, size));
+        expect_error(interpreter, "load-bin " + snapshot.path.string(), "truncated snapshot");
+        expect(interpreter.environment().stack.size() == 0, "a failed load changed the stack");
+    }
+
+    write_file(snapshot.path, data);
+    auto loaded = run_script(interpreter, "load-bin " + snapshot.path.string() + " print");
+    expect(loaded.find("= $" + name + "\n") != std::string::npos, "the intact snapshot did not load");
+}
+
+// A rows x cols matrix (extents {cols, rows}) of elements drawn uniformly from [low, high).
+static MatrixData random_dense(int rows, int cols, unsigned seed, double low = -1.0, double high = 1.0)
+{
+    MatrixData m(MatrixExtents{cols, rows});
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> dist(low, high);
+    auto p = m.mutable_data();
+    for (size_t i = 0; i < m.size(); ++i)
+        p[i] = dist(rng);
+    return m;
+}
+
+// A rows x cols matrix (extents {cols, rows}) in which each element is nonzero with probability `density`. Row 0 and
+// column 0 are left empty, so the kernels meet empty rows and columns.
+static MatrixData random_sparse(int rows, int cols, double density, unsigned seed)
+{
+    MatrixData m(MatrixExtents{cols, rows});
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> dist(0.0, 1.0);
+    auto p = m.mutable_data();
+    for (int r = 1; r < rows; ++r)
+        for (int c = 1; c < cols; ++c)
+            if (dist(rng) < density) p[(size_t)r * cols + c] = dist(rng) - 0.5;
+    return m;
+}
+
+// Same extents, and elements within `tolerance` of each other relative to the largest of them.
+static void expect_close(const MatrixData& actual,
+                         const MatrixData& expected,
+                         std::string_view what,
+                         double tolerance = 1e-12)
+{
+    if (actual.extents().extents != expected.extents().extents)
+        throw std::runtime_error(fmt::format("{}: extents differ", what));
+    auto a = actual.contiguous(ElementType::F64);
+    auto e = expected.contiguous(ElementType::F64);
+    double scale = 1.0;
+    for (size_t i = 0; i < e.size(); ++i)
+        scale = std::max(scale, std::abs(e.data()[i]));
+    for (size_t i = 0; i < e.size(); ++i)
+    {
+        if (std::abs(a.data()[i] - e.data()[i]) > tolerance * scale)
+            throw std::runtime_error(
+                fmt::format("{}: element {} is {}, expected {}", what, i, a.data()[i], e.data()[i]));
+    }
+}
+
+// Each float32 kernel gives the float64 kernel's result on the same, float-rounded, inputs to within float rounding,
+// and the matrix kernels keep their results in float32.
+static void test_f32_matches_f64()
+{
+    constexpr double F32_TOLERANCE = 1e-5;
+    ThreadPool pool(2);
+    auto a = random_dense(64, 48, 1).contiguous(ElementType::F32);
+    auto b = random_dense(48, 40, 2).contiguous(ElementType::F32);
+    auto rows = random_dense(40, 48, 3).contiguous(ElementType::F32);
+    auto v = random_dense(1, 48, 4).reshape({48}).contiguous(ElementType::F32);
+    auto divisor = random_dense(1, 48, 5, 1.0, 3.0).reshape({48}).contiguous(ElementType::F32);
+    auto wide = [](const MatrixData& m) { return m.contiguous(ElementType::F64); };
+    auto check = [&](const MatrixData& narrow, const MatrixData& expected, std::string_view what) {
+        expect(narrow.element_type() == ElementType::F32, std::string(what) + " is not float32");
+        expect_close(narrow, expected, what, F32_TOLERANCE);
+    };
+
+    check(multiply_matrix(a, b, 48), multiply_matrix(wide(a), wide(b), 48), "multiply_matrix");
+    check(inner_product(a, rows, 48, 1, 1, &pool), inner_product(wide(a), wide(rows), 48, 1, 1), "inner_product");
+    check(dot(a, v), dot(wide(a), wide(v)), "dot");
+    check(multiply(a, v), multiply(wide(a), wide(v)), "multiply");
+    check(divide(a, divisor), divide(wide(a), wide(divisor)), "divide");
+    check(bayes_rule(a, v, divisor), bayes_rule(wide(a), wide(v), wide(divisor)), "bayes_rule");
+    check(transpose(a, 48).contiguous(), transpose(wide(a), 48).contiguous(), "transpose");
+
+    for (auto op :
+         {Reduction::SUM, Reduction::MEAN, Reduction::MIN, Reduction::MAX, Reduction::ARGMAX, Reduction::NORM})
+    {
+        for (int axis : {0, 1})
+        {
+            expect_close(reduce_axis(a, op, axis),
+                         reduce_axis(wide(a), op, axis),
+                         fmt::format("reduce_axis {} along {}", (int)op, axis),
+                         F32_TOLERANCE);
+        }
+    }
+    auto scalar = [&](double narrow, double expected, std::string_view what) {
+        if (std::abs(narrow - expected) > F32_TOLERANCE * std::max(1.0, std::abs(expected)))
+            throw std::runtime_error(fmt::format("{} is {}, expected {}", what, narrow, expected));
+    };
+    scalar(sum(a), sum(wide(a)), "sum");
+    scalar(mean(a), mean(wide(a)), "mean");
+    scalar(minimum(a), minimum(wide(a)), "minimum");
+    scalar(maximum(a), maximum(wide(a)), "maximum");
+    scalar(norm(a), norm(wide(a)), "norm");
+    expect(argmax(a) == argmax(wide(a)), "argmax differs");
+}
+
+// Copies made by @N, $var, load and store share storage until one is written, and writing one leaves the others as
+// they were, also when both operands of m+m are the same matrix and when the copy is a reshaped view.
+static void test_copy_on_write_isolation()
+{
+    expect_output(run_script("4 ones $$x store "
+                             "$x 2 m* pop $x sum print pop "
+                             "$x $$y store $y 3 m+ sum print pop $x sum print pop "
+                             "$$x load 5 m** 0 m* pop $x sum print pop "
+                             "$x $x m+m sum print pop $x sum print pop "
+                             "$x 2 2 2 reshape 10 m* pop $x sum print pop "
+                             "4 ones @0 3 m* sum print pop sum print pop"),
+                  "= 4.000000\n= 16.000000\n= 4.000000\n= 4.000000\n= 8.000000\n= 4.000000\n= 4.000000\n"
+                  "= 12.000000\n= 4.000000\n");
+}
+
+// multiply and divide on an rvalue overwrite its buffer only when no other matrix shares it: copies such as @N and $var
+// make, and views such as a slice, keep their elements. In every case the result is the allocating version's.
+static void test_in_place_keeps_shared_copies()
+{
+    auto v = random_dense(1, 16, 1, 1.0, 2.0).reshape({16});
+    auto original = random_dense(8, 16, 2);
+    for (auto divide_op : {false, true})
+    {
+        auto op = [&](auto&& m) {
+            using M = decltype(m);
+            return divide_op ? divide(std::forward<M>(m), v) : multiply(std::forward<M>(m), v);
+        };
+        std::string what = divide_op ? "divide" : "multiply";
+        auto expected = op(original);
+
+        // The only view of its buffer: written in place.
+        auto exclusive = original.copy();
+        auto buffer = exclusive.data();
+        auto result = op(std::move(exclusive));
+        expect(result.data() == buffer, what + " did not reuse an exclusive buffer");
+        expect_close(result, expected, what + " in place");
+
+        // Shared with a clone, as @0 and $x do: the clone is unchanged.
+        auto shared = original.copy();
+        auto clone = shared.clone();
+        result = op(std::move(shared));
+        expect(result.data() != clone.data(), what + " wrote over a shared buffer");
+        expect_close(clone, original, what + " changed a shared copy", 0.0);
+        expect_close(result, expected, what + " of a shared matrix");
+
+        // A view of part of a buffer: the rest of the buffer is unchanged.
+        auto whole = original.copy();
+        auto rows = whole.slice(1, 0, 4);
+        result = op(std::move(rows));
+        expect_close(whole, original, what + " changed the matrix under a slice", 0.0);
+        expect_close(result, op(original.slice(1, 0, 4)), what + " of a slice");
+    }
+}
+
+// Each sparse kernel, with sparse operands on either side, gives the dense kernel's result on the same matrices: at
+// several densities, including none at all, and with empty rows and columns.
+static void test_sparse_matches_dense()
+{
+    ThreadPool pool(2);
+    for (double density : {0.0, 0.05, 0.3, 1.0})
+    {
+        auto what = [&](std::string_view kernel) { return fmt::format("{} at density {}", kernel, density); };
+
+        auto m = random_sparse(37, 23, density, 1);
+        auto s = SparseMatrix::from_dense(m);
+        expect(s.rows() == 37 && s.cols() == 23, "from_dense has the wrong shape");
+        expect_close(s.to_dense(), m, what("to_dense"));
+
+        MatrixData v(MatrixExtents{23});
+        for (int i = 0; i < 23; ++i)
+            v.mutable_data()[i] = i % 5 == 0 ? 0.0 : 0.1 * i - 1.0;
+        auto vs = SparseMatrix::from_dense(v);
+        expect_close(dot(s, v), dot(m, v), what("dot sparse dense"));
+        expect_close(dot(m, vs), dot(m, v), what("dot dense sparse"));
+        expect_close(dot(s, vs), dot(m, v), what("dot sparse sparse"));
+
+        // 37 x 23 times 23 x 11, with either side sparse.
+        auto left = random_sparse(37, 23, density, 3);
+        auto right = random_sparse(23, 11, density, 4);
+        auto dense = multiply_matrix(left, right, 23);
+        auto left_sparse = SparseMatrix::from_dense(left);
+        auto right_sparse = SparseMatrix::from_dense(right);
+        expect_close(multiply_matrix(left_sparse, right, 23), dense, what("multiply_matrix sparse dense"));
+        expect_close(multiply_matrix(left, right_sparse, 23), dense, what("multiply_matrix dense sparse"));
+        expect_close(
+            multiply_matrix(left_sparse, right_sparse, 23).to_dense(), dense, what("multiply_matrix sparse sparse"));
+
+        // Rows of m against the rows of another 19 x 23 matrix.
+        auto rows = random_sparse(19, 23, density, 5);
+        auto rows_sparse = SparseMatrix::from_dense(rows);
+        auto inner = inner_product(m, rows, 23, 1, 1);
+        expect_close(inner_product(s, rows, 23, 1, 1, &pool), inner, what("inner_product sparse dense"));
+        expect_close(inner_product(m, rows_sparse, 23, 1, 1, &pool), inner, what("inner_product dense sparse"));
+        expect_close(inner_product(s, rows_sparse, 23, 1, 1), inner, what("inner_product sparse sparse"));
+    }
+
+    // No columns at all: the rows are kept, all empty, and a dot product over the empty row is zero. The dense dot
+    // rejects an empty vector, so the result is checked directly.
+    MatrixData no_columns(MatrixExtents{0, 5});
+    auto no_columns_sparse = SparseMatrix::from_dense(no_columns);
+    expect(no_columns_sparse.rows() == 5 && no_columns_sparse.nonzeros() == 0, "from_dense of 5 x 0 is wrong");
+    expect_close(no_columns_sparse.to_dense(), no_columns, "to_dense with no columns");
+    expect_close(
+        dot(no_columns_sparse, MatrixData(MatrixExtents{0})), MatrixData(MatrixExtents{5}), "dot with no columns");
+
+    // Triplets out of order, with a duplicate to sum and an explicit zero to drop.
+    auto t = SparseMatrix::from_triplets(3, 4, {{2, 3, 1.5}, {0, 1, 2.0}, {2, 3, 0.5}, {1, 0, 0.0}, {0, 0, -1.0}});
+    expect(t.nonzeros() == 3, "from_triplets kept a zero or a duplicate");
+    expect_close(t.to_dense(), MatrixData({-1, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2}).reshape({4, 3}), "from_triplets");
+}
+
+// A sparse matrix survives dump and load-file, which rebuild it with coo, and dump-bin and load-bin.
+static void test_sparse_snapshot_round_trip()
+{
+    TempPath text(".sh");
+    TempPath binary(".snap");
+    std::string make = "0 0 1 2 0 3 5 8 0 0 0 0 12 matrix 4 3 2 reshape sparse $$s store";
+    std::string expected = run_script(make + " $s dense print");
+    expect(expected.find("= [") != std::string::npos, "unexpected dense output");
+
+    expect_output(run_script(fmt::format("{} dump {} clear load-file {} $s dense print",
+                                         make,
+                                         text.path.string(),
+                                         text.path.string())),
+                  fmt::format("Wrote state to \"{}\".\nLoaded file \"{}\".\n{}",
+                              fs::absolute(text.path).u8string(),
+                              fs::absolute(text.path).u8string(),
+                              expected));
+    auto binary_output = run_script(fmt::format(
+        "{} dump-bin {} clear load-bin {} $s dense print", make, binary.path.string(), binary.path.string()));
+    expect(binary_output.size() >= expected.size() &&
+               binary_output.compare(binary_output.size() - expected.size(), expected.size(), expected) == 0,
+           "the sparse matrix changed through dump-bin and load-bin: " + binary_output);
+}
+
+#if !defined(_WIN32)
+// sh-interpreter --serve, started from the build directory this test runs in, and stopped when this goes out of scope.
+struct ServerProcess
+{
+    ServerProcess(const fs::path& socket, const fs::path& globals)
+    {
+        auto exe = fs::read_symlink("/proc/self/exe").parent_path() / "sh-interpreter";
+        std::string args[] = {
+            exe.string(), "--serve", socket.string(), "--workers", "2", "--globals", globals.string()};
+        char* argv[] = {args[0].data(),
+                        args[1].data(),
+                        args[2].data(),
+                        args[3].data(),
+                        args[4].data(),
+                        args[5].data(),
+                        args[6].data(),
+                        nullptr};
+        if (posix_spawn(&pid, argv[0], nullptr, nullptr, argv, environ) != 0)
+            throw std::runtime_error("cannot start " + exe.string());
+    }
+    ~ServerProcess()
+    {
+        kill(pid, SIGTERM);
+        waitpid(pid, nullptr, 0);
+    }
+
+    pid_t pid = -1;
+};
+
+// A connection to a server session; retries while the server is still starting.
+struct ServerSession
+{
+    explicit ServerSession(const fs::path& socket)
+    {
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        auto path = socket.string();
+        if (path.size() >= sizeof(addr.sun_path)) throw std::runtime_error("socket path too long");
+        memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        for (int attempt = 0; attempt < 200; ++attempt)
+        {
+            fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd < 0) throw std::runtime_error("cannot create a socket");
+            if (connect(fd, (const sockaddr*)&addr, sizeof(addr)) == 0) return;
+            close(fd);
+            fd = -1;
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        throw std::runtime_error("cannot connect to the server");
+    }
+    ~ServerSession()
+    {
+        if (fd >= 0) close(fd);
+    }
+
+    // Sends one request line and returns its response, without the terminating NUL.
+    std::string request(std::string_view line)
+    {
+        std::string data(line);
+        data += '\n';
+        if (send(fd, data.data(), data.size(), MSG_NOSIGNAL) != (ssize_t)data.size())
+            throw std::runtime_error("failed to send a request");
+        std::string ret;
+        char c;
+        while (true)
+        {
+            auto n = recv(fd, &c, 1, 0);
+            if (n <= 0) throw std::runtime_error("server closed the connection");
+            if (c == '\0') return ret;
+            ret += c;
+        }
+    }
+
+    int fd = -1;
+};
+
+// A global bound to a symbol reads back as the same name in a session, whose symbol table numbers names differently
+// from the globals' table.
+static void test_server_symbol_global()
+{
+    // A directory, since loading the globals script also writes its bytecode cache beside it.
+    TempPath dir(".d");
+    fs::create_directory(dir.path);
+    auto socket = dir.path / "server.sock";
+    auto globals = dir.path / "globals.sh";
+    write_file(globals, "$$aaa $$bbb $$zzz $$sym store\n");
+    ServerProcess server(socket, globals);
+
+    ServerSession session(socket);
+    expect_output(session.request("$$qqq pop $sym print"), "= $zzz\n");
+    expect_output(session.request("$sym $$mine store $mine print"), "= $zzz\n");
+    ServerSession other(socket);
+    expect_output(other.request("$sym print"), "= $zzz\n");
+}
+#endif
+
+struct Test
+{
+    std::string_view name;
+    void (*function)();
+};
+
+static const Test tests[] = {
+    {"lazy_deep_chain", &test_lazy_deep_chain},
+    {"lazy_f32_matches_eager", &test_lazy_f32_matches_eager},
+    {"snapshot_truncated", &test_snapshot_truncated},
+    {"f32_matches_f64", &test_f32_matches_f64},
+    {"copy_on_write_isolation", &test_copy_on_write_isolation},
+    {"in_place_keeps_shared_copies", &test_in_place_keeps_shared_copies},
+    {"sparse_matches_dense", &test_sparse_matches_dense},
+    {"sparse_snapshot_round_trip", &test_sparse_snapshot_round_trip},
+#if !defined(_WIN32)
+    {"server_symbol_global", &test_server_symbol_global},
+#endif
+};
+
+int main(int argc, char** argv)
+{
+    int failures = 0;
+    for (auto& test : tests)
+    {
+        bool selected = argc < 2;
+        for (int i = 1; i < argc; ++i)
+            selected |= test.name == argv[i];
+        if (!selected) continue;
+
+        try
+        {
+            test.function();
+            fmt::printf("ok   %s\n", test.name);
+        }
+        catch (const std::exception& e)
+        {
+            fmt::printf("FAIL %s: %s\n", test.name, e.what());
+            ++failures;
+        }
+    }
+    return failures;
+}
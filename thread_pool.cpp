@@ -0,0 +1,121 @@
+#include "pch.h"
+
+#include "thread_pool.h"
+
+#include <atomic>
+#include <exception>
+
+struct ThreadPool::Job
+{
+    const std::function<void(size_t)>* fn;
+    size_t chunks;
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> done{0};
+
+    std::mutex m;
+    std::condition_variable cv;
+    std::exception_ptr error;
+};
+
+ThreadPool::ThreadPool(unsigned threads) { start(threads); }
+ThreadPool::~ThreadPool() { stop(); }
+
+void ThreadPool::resize(unsigned threads)
+{
+    stop();
+    start(threads);
+}
+
+void ThreadPool::start(unsigned threads)
+{
+    m_stop = false;
+    for (unsigned i = 1; i < threads; ++i)
+        m_workers.emplace_back([this] { worker_main(); });
+}
+
+void ThreadPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    for (auto&& t : m_workers)
+        t.join();
+    m_workers.clear();
+}
+
+void ThreadPool::work_on(Job& job)
+{
+    size_t completed = 0;
+    size_t i;
+    while ((i = job.next.fetch_add(1)) < job.chunks)
+    {
+        try
+        {
+            (*job.fn)(i);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lk(job.m);
+            if (!job.error) job.error = std::current_exception();
+        }
+        ++completed;
+    }
+    if (completed != 0 && job.done.fetch_add(completed) + completed == job.chunks)
+    {
+        std::lock_guard<std::mutex> lk(job.m);
+        job.cv.notify_all();
+    }
+}
+
+void ThreadPool::worker_main()
+{
+    while (true)
+    {
+        std::shared_ptr<Job> job;
+        {
+            std::unique_lock<std::mutex> lk(m_mutex);
+            m_cv.wait(lk, [this] { return m_stop || !m_jobs.empty(); });
+            if (m_stop) return;
+            job = m_jobs.front();
+            if (job->next >= job->chunks)
+            {
+                m_jobs.pop_front();
+                continue;
+            }
+        }
+        work_on(*job);
+    }
+}
+
+void ThreadPool::run(size_t chunks, const std::function<void(size_t)>& fn)
+{
+    auto job = std::make_shared<Job>();
+    job->fn = &fn;
+    job->chunks = chunks;
+
+    if (!m_workers.empty())
+    {
+        {
+            std::lock_guard<std::mutex> lk(m_mutex);
+            m_jobs.push_back(job);
+        }
+        m_cv.notify_all();
+    }
+
+    work_on(*job);
+
+    {
+        std::unique_lock<std::mutex> lk(job->m);
+        job->cv.wait(lk, [&] { return job->done == job->chunks; });
+    }
+    if (!m_workers.empty())
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        auto it = std::find(m_jobs.begin(), m_jobs.end(), job);
+        if (it != m_jobs.end()) m_jobs.erase(it);
+    }
+
+    if (job->error) std::rethrow_exception(job->error);
+}
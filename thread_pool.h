@@ -0,0 +1,60 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads for data-parallel kernels. The calling thread always takes part in the work it submits,
+// so a pool of size 1 runs everything inline and nested or concurrent submissions cannot deadlock.
+struct ThreadPool
+{
+    explicit ThreadPool(unsigned threads = std::thread::hardware_concurrency());
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Number of threads that execute work, including the caller.
+    unsigned size() const { return (unsigned)m_workers.size() + 1; }
+    void resize(unsigned threads);
+
+    // Calls body(begin, end) over disjoint subranges covering [0, n), each at least `grain` long where possible.
+    // Blocks until every subrange has finished; the first exception thrown by `body` is rethrown here.
+    template<class F>
+    void parallel_for(size_t n, size_t grain, F&& body)
+    {
+        if (n == 0) return;
+        size_t chunks = std::min<size_t>(n / std::max<size_t>(grain, 1), size() * 4);
+        if (chunks <= 1)
+        {
+            body(size_t(0), n);
+            return;
+        }
+        size_t chunk_size = (n + chunks - 1) / chunks;
+        chunks = (n + chunk_size - 1) / chunk_size;
+        run(chunks, [&](size_t c) {
+            size_t begin = c * chunk_size;
+            body(begin, std::min(n, begin + chunk_size));
+        });
+    }
+
+private:
+    struct Job;
+
+    void run(size_t chunks, const std::function<void(size_t)>& fn);
+    void work_on(Job& job);
+    void worker_main();
+    void start(unsigned threads);
+    void stop();
+
+    std::vector<std::thread> m_workers;
+    std::deque<std::shared_ptr<Job>> m_jobs;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    bool m_stop = false;
+};
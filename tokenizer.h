@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string_view>
+
+// Splits text into whitespace-separated tokens in place. Tokens are views into the source text, so there is no
+// per-token copy and no limit on token length; the source must outlive them.
+struct Tokenizer
+{
+    explicit Tokenizer(std::string_view text) : m_rest(text) {}
+
+    static bool is_space(char ch) { return ch == ' ' || (ch >= '\t' && ch <= '\r'); }
+
+    bool next(std::string_view& token)
+    {
+        const char* p = m_rest.data();
+        const char* end = p + m_rest.size();
+        while (p != end && is_space(*p))
+            ++p;
+        if (p == end)
+        {
+            m_rest = {};
+            return false;
+        }
+        const char* begin = p;
+        while (p != end && !is_space(*p))
+            ++p;
+        token = std::string_view(begin, p - begin);
+        m_rest = std::string_view(p, end - p);
+        return true;
+    }
+
+private:
+    std::string_view m_rest;
+};